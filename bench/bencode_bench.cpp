@@ -0,0 +1,124 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include "bencode.h"
+#include "metainfo.h"
+
+using namespace std;
+using namespace cls;
+
+// Parse time of large generated torrents: the bencode tree alone, and the whole
+// MetaInfoParser::parse with field checks, piece hash list and info hash.
+// Usage: bencode_bench [num_pieces ...], default 100k, 250k and 1M pieces, each
+// as a single-file torrent and as one with 10k files
+namespace {
+using Clock = chrono::steady_clock;
+
+const int NUM_ROUNDS = 5;    // best of
+const int NUM_FILES  = 10000;
+const int PIECE_LEN  = 256 * 1024;
+
+string bytes(const string& value)
+{
+    return to_string(value.size()) + ":" + value;
+}
+
+string integer(llong value)
+{
+    return "i" + to_string(value) + "e";
+}
+
+ByteArray makeTorrent(int num_pieces, int num_files)
+{
+    llong total_len = llong(num_pieces) * PIECE_LEN;
+    string pieces(size_t(num_pieces) * SHA1_LENGTH, '\0');
+    for (auto i = 0u; i < pieces.size(); ++i) pieces[i] = static_cast<char>(i * 131 + 7);
+
+    string info = "d";
+    if (num_files > 1) {
+        info += "5:filesl";
+        llong file_len = total_len / num_files;
+        for (auto i = 0; i < num_files; ++i) {
+            llong length = i + 1 < num_files ? file_len : total_len - file_len * i;
+            info += "d6:length" + integer(length) + "4:pathl" +
+                    bytes("dir" + to_string(i % 100)) +
+                    bytes("file" + to_string(i) + ".bin") + "ee";
+        }
+        info += "e";
+    } else {
+        info += "6:length" + integer(total_len);
+    }
+    info += "4:name" + bytes("bench") + "12:piece length" + integer(PIECE_LEN) +
+            "6:pieces" + bytes(pieces) + "e";
+
+    string torrent = "d8:announce" + bytes("http://tracker.example.org/announce") +
+                     "13:announce-listll" + bytes("http://tracker.example.org/announce") +
+                     "el" + bytes("udp://tracker.example.org:6969") + "ee" +
+                     "4:info" + info + "e";
+    return ByteArray(torrent.begin(), torrent.end());
+}
+
+// Best time in ms over NUM_ROUNDS runs of parse, false if any of them failed
+template<typename Func>
+bool measure(Func parse, double& best_ms)
+{
+    best_ms = 1e30;
+    for (auto round = 0; round < NUM_ROUNDS; ++round) {
+        auto start = Clock::now();
+        if (!parse()) return false;
+        chrono::duration<double, milli> elapsed = Clock::now() - start;
+        best_ms = min(best_ms, elapsed.count());
+    }
+    return true;
+}
+
+bool runTorrent(int num_pieces, int num_files)
+{
+    auto data = makeTorrent(num_pieces, num_files);
+
+    BencodeTree tree;
+    double tree_ms;
+    if (!measure([&] { return tree.parse(data); }, tree_ms)) {
+        cerr << "Bencode parse failed: " << tree.error() << endl;
+        return false;
+    }
+
+    MetaInfoParser parser;
+    MetaInfo meta_info;
+    double meta_ms;
+    if (!measure([&] { meta_info = MetaInfo(); return parser.parse(data, meta_info); },
+                 meta_ms)) {
+        cerr << "Torrent parse failed: " << parser.error() << endl;
+        return false;
+    }
+    if (meta_info.num_pieces != num_pieces || int(meta_info.files.size()) != num_files) {
+        cerr << "Torrent parsed into " << meta_info.num_pieces << " pieces and "
+             << meta_info.files.size() << " files" << endl;
+        return false;
+    }
+
+    cout << setw(8) << num_pieces << " pieces, " << setw(5) << num_files << " files, "
+         << fixed << setprecision(1) << setw(5) << data.size() / 1024.0 / 1024.0
+         << " MB: tree " << setprecision(3) << setw(7) << tree_ms << " ms ("
+         << setw(5) << tree.numNodes() << " nodes), torrent " << setw(7) << meta_ms
+         << " ms" << endl;
+    return true;
+}
+} // Unnamed namespace
+
+int main(int argc, char* argv[])
+{
+    vector<int> sizes;
+    for (auto i = 1; i < argc; ++i) sizes.push_back(atoi(argv[i]));
+    if (sizes.empty()) sizes = {100000, 250000, 1000000};
+
+    for (auto num_pieces : sizes) {
+        if (num_pieces < NUM_FILES) {
+            cerr << "Need at least " << NUM_FILES << " pieces" << endl;
+            return 1;
+        }
+        if (!runTorrent(num_pieces, 1) || !runTorrent(num_pieces, NUM_FILES)) return 1;
+    }
+    return 0;
+}
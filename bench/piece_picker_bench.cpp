@@ -0,0 +1,143 @@
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdlib>
+#include "piece_picker.h"
+
+using namespace std;
+using namespace cls;
+
+// Time per pick of PiecePicker against the scan it replaced: a find_if over the
+// shuffled list of needed pieces, testing the peer bitfield and the piece status
+// of every entry on the way. Picked pieces stay in that list, so the scan gets
+// slower the further the download is.
+// Usage: piece_picker_bench [num_pieces ...], default 100k, 250k and 1M pieces
+namespace {
+using Clock = chrono::steady_clock;
+
+const int    NUM_PEERS  = 8;
+const double PEER_HAS   = 0.75;   // share of all pieces each peer has
+const int    NUM_PICKS  = 1000;   // timed picks per run
+const double PROGRESS[] = {0.0, 0.5, 0.9};
+
+double elapsedNs(Clock::time_point start)
+{
+    return chrono::duration<double, nano>(Clock::now() - start).count();
+}
+
+// The selection of the old PeerClient::request
+class ScanPicker {
+public:
+    ScanPicker(int num_pieces, default_random_engine& engine)
+        : status(num_pieces, -1) {
+        for (auto idx = 0; idx < num_pieces; ++idx) needed_piece.push_back(idx);
+        shuffle(needed_piece.begin(), needed_piece.end(), engine);
+    }
+
+    int pick(const BitField& peer_has) {
+        auto iter = find_if(needed_piece.begin(), needed_piece.end(), [&](int idx) {
+            return peer_has.test(idx) && status[idx] < 0;
+        });
+        if (iter == needed_piece.end()) return -1;
+        status[*iter] = 0;
+        return *iter;
+    }
+
+    // Same as picking count pieces from a seeder, without the quadratic scan
+    void take(int count) {
+        for (auto i = 0; i < count; ++i) status[needed_piece[i]] = 0;
+    }
+
+private:
+    vector<int> needed_piece;
+    vector<int> status;   // -1: not have, 0: downloading
+};
+
+vector<BitField> makePeers(int num_pieces, default_random_engine& engine)
+{
+    bernoulli_distribution has_piece(PEER_HAS);
+    vector<BitField> peers(NUM_PEERS, BitField(num_pieces));
+    for (auto& peer : peers) {
+        for (auto idx = 0; idx < num_pieces; ++idx) {
+            if (has_piece(engine)) peer[idx] = 1;
+        }
+    }
+    return peers;
+}
+
+// Average ns per pick over NUM_PICKS picks, peers taking turns
+template<typename Picker>
+double timePicks(Picker& picker, const vector<BitField>& peers, int& num_found)
+{
+    num_found = 0;
+    auto start = Clock::now();
+    for (auto i = 0; i < NUM_PICKS; ++i) {
+        if (picker.pick(peers[i % peers.size()]) >= 0) ++num_found;
+    }
+    return elapsedNs(start) / NUM_PICKS;
+}
+
+void runSize(int num_pieces)
+{
+    default_random_engine engine(num_pieces);
+    auto peers = makePeers(num_pieces, engine);
+    BitField seeder(num_pieces);
+    seeder.set();
+
+    // Availability updates, as from the bitfields and one HAVE per piece
+    PiecePicker picker;
+    picker.init(num_pieces);
+    auto start = Clock::now();
+    for (const auto& peer : peers) picker.addPeer(peer);
+    double bitfield_ms = elapsedNs(start) / 1e6;
+
+    uniform_int_distribution<int> any_piece(0, num_pieces - 1);
+    start = Clock::now();
+    for (auto i = 0; i < num_pieces; ++i) picker.incAvailability(any_piece(engine));
+    double have_ns = elapsedNs(start) / num_pieces;
+
+    cout << num_pieces << " pieces, " << NUM_PEERS << " peers: bitfields "
+         << fixed << setprecision(1) << bitfield_ms << " ms, HAVE "
+         << have_ns << " ns" << endl;
+
+    for (auto progress : PROGRESS) {
+        int num_taken = static_cast<int>(num_pieces * progress);
+
+        ScanPicker scan(num_pieces, engine);
+        scan.take(num_taken);
+
+        PiecePicker index;
+        index.init(num_pieces);
+        for (const auto& peer : peers) index.addPeer(peer);
+        for (auto i = 0; i < num_taken; ++i) index.pick(seeder);
+
+        int scan_found, index_found;
+        double scan_ns  = timePicks(scan, peers, scan_found);
+        double index_ns = timePicks(index, peers, index_found);
+        cout << "  " << setw(3) << int(progress * 100) << "% taken: scan "
+             << setw(10) << scan_ns << " ns/pick, picker " << setw(7) << index_ns
+             << " ns/pick, " << setprecision(0) << scan_ns / index_ns << "x"
+             << setprecision(1) << endl;
+        if (scan_found != index_found) {
+            cout << "  picked " << scan_found << " vs " << index_found
+                 << " pieces" << endl;
+        }
+    }
+}
+} // Unnamed namespace
+
+int main(int argc, char* argv[])
+{
+    vector<int> sizes;
+    for (auto i = 1; i < argc; ++i) sizes.push_back(atoi(argv[i]));
+    if (sizes.empty()) sizes = {100000, 250000, 1000000};
+
+    for (auto num_pieces : sizes) {
+        if (num_pieces <= 0) {
+            cerr << "Invalid number of pieces: " << num_pieces << endl;
+            return 1;
+        }
+        runSize(num_pieces);
+    }
+    return 0;
+}
@@ -0,0 +1,124 @@
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <openssl/sha.h>
+#include "sha1.h"
+
+using namespace std;
+using namespace cls;
+
+// Piece hashing throughput in GB/s of the one-shot OpenSSL SHA1() call that used
+// to do all hashing, and of every Sha1 implementation the CPU supports, one piece
+// at a time (Sha1::hash) and in batches as the hash pool hands them out
+// (Sha1::hashMany).
+// Usage: sha1_bench [piece_kb [total_mb]], default 512 KiB pieces, 256 MiB
+namespace {
+using Clock = chrono::steady_clock;
+
+const int NUM_ROUNDS = 3;   // best of
+
+struct Pieces {
+    ByteArray           data;
+    vector<const char*> ptrs;
+    vector<size_t>      lengths;
+    ByteArray           digests;
+    vector<char*>       digest_ptrs;
+};
+
+Pieces makePieces(size_t piece_len, size_t total_len)
+{
+    Pieces pieces;
+    pieces.data.resize(total_len);
+    mt19937 engine(2014);
+    for (auto i = 0u; i + 4 <= total_len; i += 4) {
+        uint32_t word = engine();
+        memcpy(pieces.data.data() + i, &word, 4);
+    }
+
+    size_t num_pieces = total_len / piece_len;
+    pieces.digests.resize(num_pieces * Sha1::DIGEST_LEN);
+    for (auto i = 0u; i < num_pieces; ++i) {
+        pieces.ptrs.push_back(pieces.data.data() + i * piece_len);
+        pieces.lengths.push_back(piece_len);
+        pieces.digest_ptrs.push_back(pieces.digests.data() + i * Sha1::DIGEST_LEN);
+    }
+    return pieces;
+}
+
+// Best GB/s over NUM_ROUNDS runs of hash_all
+template<typename Func>
+double measure(const Pieces& pieces, Func hash_all)
+{
+    double best = 0;
+    for (auto round = 0; round < NUM_ROUNDS; ++round) {
+        auto start = Clock::now();
+        hash_all();
+        chrono::duration<double> elapsed = Clock::now() - start;
+        size_t num_bytes = pieces.ptrs.size() * pieces.lengths[0];
+        best = max(best, num_bytes / elapsed.count() / 1e9);
+    }
+    return best;
+}
+
+void report(const string& name, double gbps, double baseline)
+{
+    cout << "  " << left << setw(38) << name << right << fixed << setprecision(2)
+         << setw(6) << gbps << " GB/s  " << setw(5) << gbps / baseline << "x" << endl;
+}
+} // Unnamed namespace
+
+int main(int argc, char* argv[])
+{
+    size_t piece_kb = argc > 1 ? atoi(argv[1]) : 512;
+    size_t total_mb = argc > 2 ? atoi(argv[2]) : 256;
+    if (piece_kb == 0 || total_mb * 1024 < piece_kb) {
+        cerr << "Usage: sha1_bench [piece_kb [total_mb]]" << endl;
+        return 1;
+    }
+
+    auto pieces = makePieces(piece_kb * 1024, total_mb * 1024 * 1024);
+    int  num_pieces = static_cast<int>(pieces.ptrs.size());
+    cout << num_pieces << " pieces of " << piece_kb << " KiB" << endl;
+
+    double baseline = measure(pieces, [&] {
+        for (auto i = 0; i < num_pieces; ++i) {
+            SHA1(reinterpret_cast<const uchar*>(pieces.ptrs[i]), pieces.lengths[i],
+                 reinterpret_cast<uchar*>(pieces.digest_ptrs[i]));
+        }
+    });
+    report("OpenSSL SHA1()", baseline, baseline);
+    ByteArray expected = pieces.digests;
+
+    bool is_ok = true;
+    for (auto impl : {Sha1::OpenSSL, Sha1::ShaNi, Sha1::Avx2}) {
+        if (!Sha1::setImpl(impl)) continue;
+        string name = Sha1::implName();
+
+        double single = measure(pieces, [&] {
+            for (auto i = 0; i < num_pieces; ++i) {
+                Sha1::hash(pieces.ptrs[i], pieces.lengths[i], pieces.digest_ptrs[i]);
+            }
+        });
+        report(name + ", hash", single, baseline);
+        is_ok = is_ok && pieces.digests == expected;
+
+        double batched = measure(pieces, [&] {
+            for (auto i = 0; i < num_pieces; i += Sha1::MAX_LANES) {
+                int n = min(Sha1::MAX_LANES, num_pieces - i);
+                Sha1::hashMany(&pieces.ptrs[i], &pieces.lengths[i], n,
+                               &pieces.digest_ptrs[i]);
+            }
+        });
+        report(name + ", hashMany", batched, baseline);
+        is_ok = is_ok && pieces.digests == expected;
+    }
+
+    if (!is_ok) {
+        cerr << "Digests differ from OpenSSL" << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,104 @@
+#ifndef BENCODE_H
+#define BENCODE_H
+
+#include "clany/byte_array.hpp"
+
+_CLANY_BEGIN
+// Bencoded data decoded into a flat tree of typed nodes. Nodes are views into the
+// input buffer, nothing is copied, so the input must outlive the tree. Parsing is
+// strict: malformed integers and lengths, data running past the end of the buffer
+// or nesting deeper than the depth limit all fail the whole parse
+class BencodeTree {
+public:
+    enum Type { Integer, Bytes, List, Dict };
+
+    static const int    DEFAULT_MAX_DEPTH = 64;
+    static const size_t DEFAULT_MAX_NODES = 1 << 20;
+
+private:
+    // Containers are followed by their children, end is one past the last node of
+    // the subtree, so the next sibling of a node is nodes[end]. The node indices
+    // of the children of a container are listed from child_pos[first_child] on
+    struct Entry {
+        Type     type;
+        int      end;
+        int      count;
+        int      first_child;
+        llong    integer;
+        ByteView value;
+        ByteView raw;
+    };
+
+public:
+    // Handle to a node of the tree. Lookups that fail give an invalid node,
+    // which answers every further lookup with an invalid node as well
+    class Node {
+        friend class BencodeTree;
+
+    public:
+        Node() = default;
+
+        bool valid()     const { return tree != nullptr; }
+        Type type()      const { return node().type; }
+        bool isInteger() const { return valid() && type() == Integer; }
+        bool isBytes()   const { return valid() && type() == Bytes; }
+        bool isList()    const { return valid() && type() == List; }
+        bool isDict()    const { return valid() && type() == Dict; }
+
+        llong    integer() const { return isInteger() ? node().integer : 0; }
+        ByteView bytes()   const { return isBytes() ? node().value : ByteView(); }
+        string   str()     const { return bytes().to_string(); }
+        // The encoded value as it appears in the input, e.g. to hash the info dict
+        ByteView raw()     const { return valid() ? node().raw : ByteView(); }
+
+        // Number of elements of a list or entries of a dict
+        size_t size() const;
+        // i-th element of a list, or value of the i-th entry of a dict
+        Node at(size_t i) const;
+        // Key of the i-th entry of a dict
+        ByteView key(size_t i) const;
+        // Value of key in a dict
+        Node operator[](const string& key) const;
+
+    private:
+        Node(const BencodeTree* owner, int node_idx) : tree(owner), idx(node_idx) {}
+        const Entry& node() const { return tree->nodes[idx]; }
+        // Index of the i-th child node, keys and values of a dict count separately
+        int child(size_t i) const;
+
+        const BencodeTree* tree = nullptr;
+        int idx = 0;
+    };
+
+    explicit BencodeTree(int max_depth = DEFAULT_MAX_DEPTH,
+                         size_t max_nodes = DEFAULT_MAX_NODES)
+        : depth_limit(max_depth), node_limit(max_nodes) {}
+
+    // Return false and leave the reason in error() if input isn't valid bencode
+    bool parse(const ByteView& input);
+    void clear();
+
+    Node root() const { return nodes.empty() ? Node() : Node(this, 0); }
+    size_t numNodes() const { return nodes.size(); }
+    const string& error() const { return err_msg; }
+
+private:
+    bool parseValue(int depth);
+    void indexChildren();
+    bool parseInteger(llong& number);
+    bool parseLength(size_t& length);
+    bool fail(const string& message);
+
+    vector<Entry> nodes;
+    vector<int>   child_pos;
+    const char* input_begin = nullptr;
+    const char* pos = nullptr;
+    const char* input_end = nullptr;
+
+    int    depth_limit;
+    size_t node_limit;
+    string err_msg;
+};
+_CLANY_END
+
+#endif // BENCODE_H
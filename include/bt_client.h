@@ -2,12 +2,22 @@
 #define BT_CLIENT_H
 
 #include <list>
+#include <map>
 #include <fstream>
 #include <chrono>
 #include <clany/file_operation.hpp>
 #include "peer_client.h"
 #include "tcp_server.hpp"
 #include "metainfo.h"
+#include "torrent_storage.h"
+#include "resume_data.h"
+#include "piece_picker.h"
+#include "hash_pool.h"
+#include "write_cache.h"
+#include "read_cache.h"
+#include "connection_registry.h"
+#include "tracker.h"
+#include "sha1.h"
 
 _CLANY_BEGIN
 class BTClient : public TCPServer {
@@ -16,37 +26,46 @@ class BTClient : public TCPServer {
     using atm_bool = tbb::atomic<bool>;
     using atm_int  = tbb::atomic<int>;
 
-    // Preallocated temporary file on disk
-    struct TmpFile {
-        TmpFile() = default;
-        TmpFile(const string& file_name, llong file_size) { create(file_name, file_size); }
-
-        bool create(const string& file_name, llong file_size);
-        bool write(size_t idx, const ByteArray& data) const;
-        bool read(size_t idx, size_t length, ByteArray& data) const;
-
-        llong size() const { return fsize; }
-        bool empty() const { return fsize == 0; }
-
-        string fname = "";
-        llong  fsize = 0;
-    };
-
     // Search for peer clients, fill connection list
     using TCPServer::listen;
     void listen(atm_bool& running);
     void initiate(atm_bool& running);
+    // Outgoing connection on its way, waiting to be connected or for the handshake
+    struct Dial {
+        PeerClient::Ptr client;
+        list<Peer>::iterator peer;
+        ByteArray buffer;
+        chrono::steady_clock::time_point deadline;
+        bool is_connected;
+    };
+    void dialPeers(Reactor& dial_reactor, map<SOCKET, Dial>& dials);
+    void onDialEvent(Reactor& dial_reactor, map<SOCKET, Dial>& dials,
+                     SOCKET sock, int events);
+    // Connection or handshake failed, wait longer before trying the peer again
+    void dialFailed(Reactor& dial_reactor, map<SOCKET, Dial>& dials, SOCKET sock);
     bool addPeerClient(PeerClient::Ptr peer_client);
     void addPeerInfo(const Peer& peer);
     void removePeerClient(PeerClient::Ptr peer_client);
     void removePeerInfo(const Peer& peer);
+    // Hold the result in a local while iterating, a temporary in a range-for
+    // is released before the loop body runs
+    auto connectionSnapshot() const -> ConnectionRegistry::Snapshot;
+
+    // Drive all established connections from the reactor, drop dead ones
+    void serve(atm_bool& running);
 
     // Mange torrent task
-    auto getIncomingPeer() -> PeerClient::Ptr;
+    auto getIncomingPeer(double time_out) -> PeerClient::Ptr;
     bool handShake(PeerClient* peer_client, bool is_initiator);
+    string handShakeMessage() const;
+    // Whether peer_id is ours, as it goes out in a handshake
+    bool isSelf(const string& peer_id) const;
+    static string makePeerId(int16_t port);
     void broadcastPU(int piece_idx) const;
+    // Block has arrived, stop everyone else still fetching it in endgame
+    void cancelBlock(int piece_idx, int offset) const;
 
-    bool hasIncomingData(const TCPSocket* client_sock) const;
+    bool hasIncomingData(const TCPSocket* client_sock, double time_out = 0) const;
     int recvMsg(const TCPSocket* client_sock, char* buffer,
                 size_t msg_len = string::npos, double time_out = 3.0) const;
     int recvMsg(const TCPSocket* client_sock, ByteArray& buffer,
@@ -54,44 +73,145 @@ class BTClient : public TCPServer {
     int recvMsg(const TCPSocket* client_sock, string& buffer,
                 size_t msg_len = string::npos, double time_out = 3.0) const;
 
-    auto getBlock(int piece, int offset, int length) const -> ByteArray;
-    auto getBlock(const ByteArray& block_header) const -> ByteArray;
-    void writeBlock(int piece, int offset, const ByteArray& block_data);
+    // Return file position of the block, or -1 if we don't have this piece or
+    // the block doesn't lie inside it
+    llong blockPosition(int piece, int offset, int& length) const;
+    // Return a view of the block, either into the file mapping or into buffer
+    auto getBlock(int piece, int offset, int length, ByteArray& buffer) const -> ByteView;
+    auto getBlock(const ByteArray& block_header, ByteArray& buffer) const -> ByteView;
+    // Whole piece through the read cache, nullptr if we don't have it or the
+    // cache is off
+    auto getPiece(int idx) -> ReadCache::Piece;
+
+    // Length of piece idx, only the last piece may be shorter
+    size_t pieceLength(int idx) const {
+        return static_cast<size_t>(min<llong>(meta_info.piece_length,
+                                   meta_info.length - llong(idx)*meta_info.piece_length));
+    }
+
+    // Turn file priorities into piece priorities, return the file list to open
+    vector<TorrentStorage::FileEntry> selectFiles();
 
     // Load existing (partial) downloaded file
-    bool loadFile(const string& file_name);
+    bool loadFile(const vector<TorrentStorage::FileEntry>& file_list);
+    // Find the pieces we have in the open file, from resume data or by hashing
+    void checkFile();
+
+    // Trust the bitfield saved in the resume file if it still matches the download
+    // file, after hash checking a random sample of pieces
+    bool loadResumeData();
+    bool saveResumeData();
+    void autoSave(atm_bool& running);
 
-    // Return true if SHA1 value of piece is correct, update pieces accordingly
-    bool validatePiece(const ByteArray& piece, int idx);
+    // Announce to the trackers of the torrent periodically, backing off while
+    // none of them answers
+    void announce(atm_bool& running);
+    bool announceTo(vector<Tracker::Ptr>& trackers, AnnounceRequest& request,
+                    AnnounceResponse& response);
+    // Add peers a tracker handed out to the peer list, skipping known ones
+    void addTrackerPeers(const vector<PeerEndpoint>& peers);
+
+    // Return true if SHA1 value of piece is correct
+    bool checkPiece(const char* piece, size_t length, int idx) const;
+    // Check n pieces at once, is_valid[i] tells about pieces[i]
+    void checkPieces(const char* const pieces[], const size_t lengths[],
+                     const int indices[], int n, bool is_valid[]) const;
+    void markPiece(int idx);
+    // Completion of a piece queued on the hash pool, runs on a hash worker
+    void pieceHashed(HashPool::Job& job, bool is_valid);
+    // Copy or count of our bitfield, safe against hash workers updating it
+    BitField havePieces() const;
+    int numHave() const;
 
 public:
     using Ptr = shared_ptr<BTClient>;
 
+    // When to write back pieces of a memory mapped file once they are verified
+    enum FlushPolicy { FlushNone, FlushAsync, FlushSync };
+
     BTClient(const string& peer_id, const string& ip = "", int16_t port = 6767)
-        : max_connections(4), ts_init(16), pid(peer_id),
+        : TCPServer(64), max_connections(200), ts_init(16), pid(peer_id),
           start(chrono::system_clock::now()) {
-        // Set peer id to bt_client:port if not provided
+        // Set peer id to bt_client:port plus a random tail if not provided
         listen_port = port;
         local_addr  = ip;
-        if (pid.empty()) pid = string("bt_client") + ":" + to_string(listen_port);
+        if (pid.empty()) pid = makePeerId(listen_port);
 
-        downloaded = 0;
-        uploaded   = 0;
+        downloaded  = 0;
+        uploaded    = 0;
+        sendfile_bytes = 0;
+        mapped_bytes   = 0;
+        first_ready = false;
     };
 
-    bool setTorrent(const string& torrent_name, const string& save_file_name = "");
+    bool setTorrent(const string& torrent_name, const string& save_file_name = "",
+                    FileStorage::AllocMode alloc_mode = FileStorage::AllocReserve);
+
+    // Must be called before setTorrent
+    void setStorageMode(bool use_mmap, FlushPolicy policy = FlushAsync) {
+        this->use_mmap     = use_mmap;
+        this->flush_policy = policy;
+    }
+
+    // Number of pieces to hash check when resume data is trusted,
+    // must be called before setTorrent
+    void setResumeCheck(int num_samples) {
+        resume_samples = num_samples;
+    }
+
+    // Priority of each file of the torrent in order, files beyond the list are
+    // normal. Pieces take the highest priority of the files they overlap, files
+    // skipped are not created unless they share a piece with a wanted file.
+    // Must be called before setTorrent
+    void setFilePriority(const vector<PiecePicker::Priority>& priorities) {
+        file_priority = priorities;
+    }
 
     bool setLogFile(const string& file_name);
 
     void writeLog(const string& message);
 
+    // Bytes of verified pieces held in memory before they are written back,
+    // 0 writes every piece as soon as it is verified
+    void setWriteCache(size_t num_bytes) {
+        write_cache.setCapacity(num_bytes);
+    }
+
+    // Bytes of recently uploaded pieces kept in memory, 0 disables the cache.
+    // Blocks the file has are served without copy from a memory mapped file or,
+    // on Linux, with sendfile, the cache then only holds pieces that are still in
+    // the write cache
+    void setReadCache(size_t num_bytes) {
+        read_cache.setCapacity(num_bytes);
+    }
+
     void setMaxConnection(int max_connections) {
         this->max_connections = max_connections;
     }
 
+    // Minimum number of block requests kept outstanding per peer, the window
+    // grows beyond it with the measured bandwidth-delay product
+    void setRequestWindow(int num_requests) {
+        request_window = max(num_requests, 1);
+    }
+
+    // Download in order from the read cursor on, window_pieces pieces ahead of
+    // it, each given piece_deadline more seconds than the one before. 0 disables
+    void setStreaming(int window_pieces, double piece_deadline = 2.0) {
+        picker.setStreaming(window_pieces, piece_deadline);
+    }
+
+    // Read cursor of a local consumer, the streaming window follows it
+    void  setCursor(llong pos);
+    llong cursor() const;
+    // Number of verified bytes from pos on without a gap
+    llong available(llong pos) const;
+    // Copy up to length verified bytes at pos, return the number copied
+    size_t readVerified(llong pos, size_t length, char* data) const;
+
     void addPeerAddr(const string& address, ushort port) {
-        // Peer ID, ip, port, is_connected, is_available, trying times
-        peer_list.push_back({"", address, port, false, true, 0});
+        // Peer ID, ip, port, is_connected, is_available, trying times, retry time
+        peer_list.push_back({"", address, port, false, true, 0, {}});
     }
 
     auto getMetaInfo() -> const MetaInfo& { return meta_info; }
@@ -100,27 +220,41 @@ public:
 
 private:
     list<Peer> peer_list;
-    list<PeerClient::Ptr> connection_list;
+    ConnectionRegistry connections;
     size_t max_connections;
+    int request_window = 16;
     tbb::task_scheduler_init ts_init;
-    tbb::task_group torrent_task;
+    Reactor reactor;
 
     string pid;
 
     MetaInfo meta_info;
-    TmpFile download_file;
+    TorrentStorage download_file;
+    bool use_mmap = false;
+    FlushPolicy flush_policy = FlushAsync;
+    int resume_samples = 16;
+    vector<PiecePicker::Priority> file_priority;
     BitField bit_field;
-    vector<atm_int> pieces_status;
-    vector<int> needed_piece;
+    mutable tbb::spin_mutex piece_mtx;
+    HashPool hash_pool;
+    PiecePicker picker;
+    PieceAssembly assembly;
+    WriteCache write_cache;
+    ReadCache read_cache;
 
     string save_name;
     pair<string, ofstream> log_file;
     string log_buffer;
     tbb::mutex log_mtx;
     chrono::time_point<chrono::system_clock> start;
+    chrono::steady_clock::time_point run_start;
+    atm_bool first_ready;
 
     atm_int downloaded;
     atm_int uploaded;
+    // Uploaded block bytes that never passed through user space
+    tbb::atomic<llong> sendfile_bytes;
+    tbb::atomic<llong> mapped_bytes;
     bool is_complete = false;
     bool verbose     = false;
 };
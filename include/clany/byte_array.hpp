@@ -113,6 +113,39 @@ inline bool operator!=(const ByteArray& left, const ByteArray& right)
     return !(left == right);
 }
 
+// Non-owning view of contiguous bytes, the referenced memory must outlive the view
+class ByteView {
+public:
+    ByteView() = default;
+    ByteView(const char* data, size_t size) : ptr(data), len(size) {}
+    ByteView(const ByteArray& data) : ptr(data.data()), len(data.size()) {}
+
+    const char* data()  const { return ptr; }
+    const char* begin() const { return ptr; }
+    const char* end()   const { return ptr + len; }
+    size_t size()  const { return len; }
+    bool   empty() const { return len == 0; }
+
+    char operator[](size_t idx) const { return ptr[idx]; }
+
+    ByteView sub(size_t pos, size_t n = string::npos) const {
+        return ByteView(ptr + pos, min(n, len - pos));
+    }
+
+    ByteArray toByteArray() const { return ByteArray(ptr, ptr + len); }
+    string    to_string()   const { return string(ptr, len); }
+
+private:
+    const char* ptr = nullptr;
+    size_t      len = 0;
+};
+
+inline ByteArray& operator+=(ByteArray& left, const ByteView& right)
+{
+    left.insert(left.end(), right.begin(), right.end());
+    return left;
+}
+
 inline ostream& operator<<(ostream& os, const ByteArray& byte_arr)
 {
     stringstream ss;
@@ -0,0 +1,54 @@
+#ifndef CONNECTION_REGISTRY_H
+#define CONNECTION_REGISTRY_H
+
+#include <memory>
+#include <unordered_map>
+#include "peer_client.h"
+#include <tbb/tbb.h>
+
+_CLANY_BEGIN
+// Established connections, each in a numbered slot that is reused once the
+// connection is gone. Duplicates are found by peer id and address through a hash
+// index.
+// Readers iterate an immutable snapshot that is republished on every change. This
+// is a lock-based copy-on-write, not lock-free RCU: atomic_load/atomic_store of a
+// shared_ptr take a lock from the library's spinlock pool around the pointer and
+// reference count copy, and each add or remove copies all n pointers. Both are
+// cheap here, n is bounded by max_connections and changes only on connect and
+// disconnect, while the lock is never held across an iteration or while a writer
+// builds the next snapshot. An old snapshot is freed by the last reader holding it
+class ConnectionRegistry {
+public:
+    using Snapshot = shared_ptr<const vector<PeerClient::Ptr>>;
+
+    ConnectionRegistry();
+    ConnectionRegistry(const ConnectionRegistry&) = delete;
+    ConnectionRegistry& operator=(const ConnectionRegistry&) = delete;
+
+    // Return the slot of the new connection, or -1 if the peer is connected already
+    int  add(const PeerClient::Ptr& peer_client);
+    // Return false if the connection isn't registered
+    bool remove(const PeerClient::Ptr& peer_client);
+
+    bool contains(const string& pid, const string& address) const;
+    Snapshot snapshot() const { return atomic_load(&current); }
+    size_t size() const { return num_connections; }
+
+private:
+    static string key(const string& pid, const string& address) {
+        return pid + '\0' + address;
+    }
+    void publish();
+
+    vector<PeerClient::Ptr> slots;
+    vector<int> free_slots;
+    unordered_map<string, int> index;
+    Snapshot current;
+    tbb::atomic<size_t> num_connections;
+
+    // Serializes writers only
+    mutable tbb::mutex writer_mtx;
+};
+_CLANY_END
+
+#endif // CONNECTION_REGISTRY_H
@@ -0,0 +1,66 @@
+#ifndef HASH_POOL_H
+#define HASH_POOL_H
+
+#include <chrono>
+#include <functional>
+#include "clany/byte_array.hpp"
+#include <tbb/tbb.h>
+
+_CLANY_BEGIN
+// Verifies completed pieces on a few dedicated worker tasks, so the receive path
+// hands a piece off and keeps reading. The queue is bounded, when it is full the
+// submitting thread hashes the piece itself, which slows the network down to
+// hashing speed instead of piling up piece buffers. A worker takes whatever else is
+// queued along with its job, so multi-buffer SHA1 can hash them side by side
+class HashPool {
+    using sys_clock = chrono::steady_clock;
+
+public:
+    struct Job {
+        int       idx;
+        ByteArray data;
+        string    from;
+        sys_clock::time_point queued;
+    };
+    // Both are called on a worker thread, or on the submitting one when the
+    // queue is full
+    using CheckFunc = function<void(Job* const jobs[], int num_jobs, bool is_valid[])>;
+    using DoneFunc  = function<void(Job& job, bool is_valid)>;
+
+    HashPool() = default;
+    HashPool(const HashPool&) = delete;
+    HashPool& operator=(const HashPool&) = delete;
+    ~HashPool() { stop(); }
+
+    void start(int num_workers, size_t capacity, CheckFunc check, DoneFunc done);
+    // Finish everything queued, then let the workers go
+    void stop();
+
+    void submit(int idx, ByteArray&& data, const string& from);
+
+    // Pieces waiting for a worker, and the most seen at once
+    int    depth()    const { return max(0, static_cast<int>(job_queue.size())); }
+    int    maxDepth() const { return max_depth; }
+    // Average time from submit until the piece is verified in ms
+    double latency()  const;
+    int    numHashed() const { return num_hashed; }
+
+private:
+    void work();
+    void finish(Job* const jobs[], int num_jobs);
+
+    tbb::concurrent_bounded_queue<Job*> job_queue;
+    tbb::task_group workers;
+    int num_workers = 0;
+
+    CheckFunc check_func;
+    DoneFunc  done_func;
+
+    tbb::atomic<int> max_depth;
+    tbb::atomic<int> num_hashed;
+    double total_latency = 0;
+    mutable tbb::spin_mutex stat_mtx;
+};
+_CLANY_END
+
+#endif // HASH_POOL_H
@@ -1,46 +1,52 @@
 #ifndef METAINFO_H
 #define METAINFO_H
 
-#include <map>
 #include "clany/byte_array.hpp"
+#include "bencode.h"
 
 _CLANY_BEGIN
 const int SHA1_LENGTH = 20;
 
+// A file of the torrent, path is relative to the torrent root and uses '/' as
+// separator, offset is where the file starts in the concatenated data
+struct FileInfo {
+    string path;
+    llong length;
+    llong offset;
+};
+
 struct MetaInfo {
     string announce     = "";
+    // Trackers of announce-list (BEP 12) tier by tier, else just announce
+    vector<string> announce_list = {};
     string name         = "";
     llong length        = 0;
     int piece_length    = 0;
     int num_pieces      = 0;
     ByteArray info_hash = ByteArray(20, '0');
     vector<ByteArray> sha1_vec = {};
+    // A single-file torrent has one entry named after the torrent
+    vector<FileInfo> files     = {};
+    bool is_multi_file         = false;
 };
 
 class MetaInfoParser {
-    using Dict = map<string, string>;
-
 public:
     bool parse(const ByteArray& data, MetaInfo& meta_info);
     void clear();
 
-    const Dict& getDictionary() { return meta_dict; }
+    // Decoded torrent file, refers to the data passed to parse()
+    const BencodeTree& getTree() const { return tree; }
+    const string& error() const { return err_msg; }
 
 private:
-    bool parseString(string& str);
-    bool parseInteger(llong& number);
-    bool parseList(string& str);
-    bool parseDictionry(Dict& dict);
-
-    void fillMetaInfo(const Dict& info_dict, MetaInfo& meta_info);
+    bool fillMetaInfo(const BencodeTree::Node& root, MetaInfo& meta_info);
+    bool fillFiles(const BencodeTree::Node& info, MetaInfo& meta_info);
 
 private:
-    ByteArray file_data;
-    ByteArray info_data;
-    size_t idx;
-
-    Dict meta_dict;
+    BencodeTree tree;
+    string err_msg;
 };
 _CLANY_END
 
-#endif // METAINFO_H
\ No newline at end of file
+#endif // METAINFO_H
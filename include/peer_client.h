@@ -1,9 +1,15 @@
 #ifndef PEER_CLIENT_H
 #define PEER_CLIENT_H
 
+#include <deque>
+#include <chrono>
 #include <clany/dyn_bitset.hpp>
 #include "metainfo.h"
 #include "socket.hpp"
+#include "reactor.h"
+#include "recv_buffer.hpp"
+#include "piece_assembly.h"
+#include "read_cache.h"
 #include <tbb/tbb.h>
 
 _CLANY_BEGIN
@@ -16,6 +22,8 @@ struct Peer
     bool is_connected;
     bool is_available;
     int  trying_times;
+    // Failed peers are not dialed again before then, the wait doubles each time
+    chrono::steady_clock::time_point retry_time;
 };
 
 inline bool operator==(const Peer& left, const Peer& right)
@@ -41,14 +49,29 @@ inline bool operator>(const Peer& left, const Peer& right)
 
 class BTClient;
 
+// Per connection state machine, driven by readiness events from the reactor.
+// Incoming data and requests are handled on the reactor thread only, messages may
+// be sent from any thread, they are queued and written out without blocking
 class PeerClient : public TCPSocket{
     using atm_bool = tbb::atomic<bool>;
     using atm_int = tbb::atomic<int>;
+    using sys_clock = chrono::steady_clock;
 
+    friend class BTClient;
     friend bool operator==(const PeerClient& left, const PeerClient& right);
 
-    void listen();
-    void request();
+    // Reactor callbacks
+    void onEvent(int events);
+    void onTick();
+    void readMessages();
+    void handleMessage(uchar msg_id, const ByteView& buffer);
+    void requestPieces();
+    // Number of block requests to keep outstanding
+    int  requestWindow() const;
+    // Block has arrived from another peer, cancel our request for it
+    void cancelBlock(int idx, int offset);
+    // Requests are lost, let other peers request the blocks
+    void releaseRequests();
 
 public:
     using Ptr = shared_ptr<PeerClient>;
@@ -81,9 +104,9 @@ public:
         return bit_field[idx];
     }
 
-    void start();
+    // Switch to non-blocking mode and hand the connection to the reactor
+    bool start();
     void stop() { running = false; }
-    void wait() { peer_task.wait(); }
     bool isRunning() const { return running; }
     bool isSeeder()  const { return bit_field.all(); }
 
@@ -94,6 +117,9 @@ public:
     bool sendInterested(bool interested) const;
     // have: <len=0005><id=4><piece index>
     bool sendPieceUpdate(int piece) const;
+    // Queue a HAVE for the reactor thread, which sends all queued ones in one
+    // write. Doesn't block, safe to call from any thread
+    void queueHave(int piece);
     // bitfield: <len=0001+X><id=5><bitfield>
     bool sendAvailPieces(const BitField& bit_field) const;
     // request: <len=0013><id=6><index><begin><length>
@@ -101,19 +127,85 @@ public:
     // cancel: <len=0013><id=8><index><begin><length>
     bool cancelRequest(int piece, int offset, int length) const;
     // piece: <len=0009+X><id=7><index><begin><block>
-    bool sendBlock(int piece, int offset, const ByteArray& data) const;
+    bool sendBlock(int piece, int offset, const ByteView& data) const;
+    // piece, body is sent straight out of a cached piece without copying
+    bool sendBlock(int piece, int offset, int length, const ReadCache::Piece& data) const;
+    // piece, body is sent straight out of the file mapping without copying
+    bool sendBlockMapped(int piece, int offset, const ByteView& data) const;
+    // piece, body is pushed from the download file to the socket by the kernel,
+    // return number of body bytes queued, or -1 if the fast path is unavailable
+    int  sendBlockFile(int piece, int offset, int length, llong file_pos) const;
+
+    // Queue the message and send as much as the socket takes without blocking
+    using TCPSocket::write;
+    bool write(const char* message, size_t n) const override;
+    void disconnect() override;
 
 private:
-    void setBitField(const ByteArray& buffer, const vector<int>& needed_piece);
-    void updatePiece(const ByteArray& buffer, const vector<int>& needed_piece);
-    void handleRequest(const ByteArray& request_msg);
-    void receiveBlock(const ByteArray& buffer);
+    void setBitField(const ByteView& buffer);
+    void updatePiece(const ByteView& buffer);
+    void handleRequest(const ByteView& request_msg);
+    void handleCancel(const ByteView& cancel_msg);
+    void receiveBlock(const ByteView& buffer);
+
+    // Outgoing message, body may be left in the download file and sent with sendfile.
+    // An in memory body is either a cached piece or a view into the file mapping,
+    // body_pos and body_len select what is left of it. Blocks remember which piece
+    // they belong to so a CANCEL can find them
+    struct OutMessage {
+        ByteArray data;
+        ReadCache::Piece body;
+        ByteView mapped;
+        size_t body_pos = 0;
+        size_t body_len = 0;
+        llong  file_pos = 0;
+        size_t file_len = 0;
+        size_t sent     = 0;
+        int    piece    = -1;
+        int    offset   = 0;
+    };
+    bool enqueue(OutMessage&& msg) const;
+    // Write queued messages until the socket would block, return false on error.
+    // Caller must hold send_mtx
+    bool flushQueue() const;
+    // Send the in memory parts of queued messages in one call, then advance the
+    // queue past what was sent
+    int  sendGathered() const;
+    void consumeSent(size_t num_bytes) const;
+    // Runs on the reactor thread, pieces the peer has are left out
+    void flushHaves();
 
     BTClient* bt_client;
 
     const MetaInfo& torrent_info;
     atm_bool running;
-    tbb::task_group peer_task;
+    Reactor* reactor = nullptr;
+
+    mutable tbb::mutex send_mtx;
+    mutable deque<OutMessage> send_queue;
+    mutable bool want_write = false;
+
+    tbb::spin_mutex have_mtx;
+    vector<int> pending_haves;
+
+    // Received bytes, 256kb to start with, messages up to 1mb
+    RecvBuffer recv_buffer {256 * 1024, 1024 * 1024};
+
+    // Block requests in flight, oldest first
+    struct BlockRequest {
+        int piece;
+        int offset;
+        int length;
+        sys_clock::time_point time;
+    };
+    deque<BlockRequest> requests;
+
+    // Download rate (bytes/s) and minimum round trip time (s) of the last interval
+    double down_rate  = 0;
+    double rtt        = 0;
+    double round_rtt  = 0;
+    llong  rate_bytes = 0;
+    sys_clock::time_point rate_time;
 
     string addr;
     string addr_id;
@@ -0,0 +1,68 @@
+#ifndef PIECE_ASSEMBLY_H
+#define PIECE_ASSEMBLY_H
+
+#include <map>
+#include <functional>
+#include <clany/dyn_bitset.hpp>
+#include <tbb/tbb.h>
+
+_CLANY_BEGIN
+// Pieces being downloaded, shared by all connections. Blocks of one piece may be
+// requested from several peers and arrive in any order, each is copied straight
+// into a piece sized buffer taken from a pool, a per block bitmap and request
+// count track what is received and what is in flight
+class PieceAssembly {
+public:
+    enum Result { Rejected, Accepted, Completed };
+
+    static const int BLOCK_SIZE = 32 * 1024; // 32kb
+
+    void init(int piece_length, llong total_length);
+
+    // Start assembling a piece handed out by the piece picker
+    void start(int idx);
+
+    // Reserve a block no one has requested yet from a piece the peer has, in
+    // endgame also blocks requested but not received yet. skip(idx, offset)
+    // tells blocks the peer has requested already
+    bool reserveBlock(const BitField& peer_has, bool endgame,
+                      const function<bool(int, int)>& skip,
+                      int& idx, int& offset, int& length);
+    // Request of a block was lost, let it be requested again
+    void unrequest(int idx, int offset);
+
+    // Copy a block into its piece, Rejected if it wasn't expected or arrived before
+    Result addBlock(int idx, int offset, const ByteView& data);
+    // Remove a piece whose blocks all arrived, hand back the buffer with recycle()
+    ByteArray take(int idx);
+    void recycle(ByteArray&& buffer);
+
+    size_t size() const;
+
+private:
+    struct Piece {
+        ByteArray     data;
+        BitField      received;
+        vector<uchar> requested;
+        int num_received = 0;
+        int next_block   = 0;  // no unrequested block before this one
+    };
+
+    int pieceLength(int idx) const {
+        return static_cast<int>(min<llong>(piece_length,
+                                total_length - llong(idx)*piece_length));
+    }
+    int numBlocks(int idx) const {
+        return (pieceLength(idx) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    }
+
+    map<int, Piece>   pieces;
+    vector<ByteArray> pool;
+    int   piece_length = 0;
+    llong total_length = 0;
+
+    mutable tbb::spin_mutex assembly_mtx;
+};
+_CLANY_END
+
+#endif // PIECE_ASSEMBLY_H
@@ -0,0 +1,119 @@
+#ifndef PIECE_PICKER_H
+#define PIECE_PICKER_H
+
+#include <set>
+#include <random>
+#include <chrono>
+#include <clany/dyn_bitset.hpp>
+#include <tbb/tbb.h>
+
+_CLANY_BEGIN
+// Rarest first piece selection. Free pieces we still want are kept in one array
+// ordered by availability (number of connected peers having the piece), with the
+// start of every availability bucket recorded. Moving a piece one bucket up or
+// down is a single swap with the bucket boundary, so availability updates are
+// O(1) and a pick walks the array from the rarest bucket, which for peers having
+// most pieces ends after a few steps. Pieces entering a bucket are swapped to a
+// random place in it, which breaks ties between equally rare pieces.
+// Once only a few pieces are missing the picker enters endgame, blocks already
+// being downloaded are then requested again from other peers having them.
+// Skipped pieces are never picked, free high priority pieces are kept apart and
+// tried before any normal one, rarest first among themselves.
+// In streaming mode a window of pieces from the read cursor on goes first, in
+// order. Each piece of the window has a deadline, later the further it is from
+// the cursor, and a piece still downloading past its deadline is reported as
+// overdue so its missing blocks can be raced on other peers
+class PiecePicker {
+public:
+    enum State { Free, Downloading, Have };
+    enum Priority { Skip, Normal, High };
+
+    // All pieces start with normal priority
+    void init(int num_pieces);
+    void setPriority(int idx, Priority priority);
+    Priority priority(int idx) const;
+
+    // Availability from peer bitfields and HAVE messages
+    void addPeer(const BitField& peer_has);
+    void removePeer(const BitField& peer_has);
+    void incAvailability(int idx);
+    void decAvailability(int idx);
+
+    // Pick pieces in order from the cursor on, window_pieces at a time, the n-th
+    // of them due n * piece_deadline seconds after it was picked. A window of 0
+    // goes back to rarest first
+    void setStreaming(int window_pieces, double piece_deadline);
+    void setCursor(int idx);
+    int  cursor() const;
+    bool isStreaming() const { return window > 0; }
+
+    // Take the rarest free piece the peer has and mark it downloading,
+    // return -1 if the peer has nothing we want
+    int  pick(const BitField& peer_has);
+    // First piece of the window the peer has that is downloading past its
+    // deadline, -1 if none
+    int  overdue(const BitField& peer_has) const;
+    // Downloading piece failed, make it available again
+    void release(int idx);
+    // We have the piece now, never pick it again
+    void complete(int idx);
+
+    bool wants(int idx) const;
+    // Return true if the peer has any piece we don't have
+    bool isInteresting(const BitField& peer_has) const;
+
+    // No free piece left, or at most endgame_pieces pieces missing
+    bool inEndgame() const;
+    void setEndgameThreshold(int num_pieces) { endgame_pieces = num_pieces; }
+
+    // Pieces not skipped, and those of them we don't have yet
+    int numWanted() const;
+    int numMissing() const;
+
+    int availability(int idx) const { return avail[idx]; }
+    size_t numFree() const { return order.size() + high_pieces.size(); }
+    size_t numDownloading() const { return downloading.size(); }
+
+private:
+    int  bucketEnd(int bucket) const {
+        return bucket + 1 < int(bucket_start.size()) ? bucket_start[bucket + 1]
+                                                     : int(order.size());
+    }
+    using Clock = chrono::steady_clock;
+
+    // Mark a free piece downloading
+    int  take(int idx);
+    // Move the window past pieces we have
+    void advanceWindow();
+    // Free pieces enter and leave the queue of their priority
+    void enqueue(int idx);
+    void dequeue(int idx);
+    void insert(int idx);
+    void erase(int idx);
+    void swapPos(int pos_a, int pos_b);
+    void shuffleIn(int idx);
+
+    vector<int>      avail;
+    vector<State>    state;
+    vector<Priority> prio;
+    vector<int>   order;        // free pieces sorted by availability
+    vector<int>   pos;          // position in order, -1 if not free
+    vector<int>   bucket_start; // first position of each availability
+    set<int>      high_pieces;  // free high priority pieces
+    set<int>      downloading;
+    int num_wanted  = 0;
+    int num_missing = 0;
+    int endgame_pieces = 8;
+
+    vector<Clock::time_point> pick_time;
+    int    window      = 0;
+    int    cursor_idx  = 0;
+    int    window_head = 0;  // first piece at or after the cursor we don't have
+    double deadline    = 0;
+
+    default_random_engine rd_engine {random_device()()};
+    mutable tbb::spin_mutex picker_mtx;
+};
+_CLANY_END
+
+#endif // PIECE_PICKER_H
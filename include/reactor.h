@@ -0,0 +1,51 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <functional>
+#include <unordered_map>
+#include <tbb/tbb.h>
+#include "socket.hpp"
+
+_CLANY_BEGIN
+// Readiness notification for many sockets on one thread. Backed by epoll on Linux
+// and by poll elsewhere. Sockets may be added or modified from any thread, events
+// are only dispatched on the thread calling poll()
+class Reactor {
+public:
+    enum Event { Readable = 1, Writable = 2, Closed = 4 };
+    using Handler = function<void(int events)>;
+
+    Reactor();
+    ~Reactor();
+
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    bool add(SOCKET sock, int events, const Handler& handler);
+    bool modify(SOCKET sock, int events);
+    void remove(SOCKET sock);
+
+    // Wait no longer than time_out seconds, dispatch ready events and return
+    // the number of sockets that had events
+    int poll(double time_out);
+
+    size_t size() const;
+
+private:
+    struct Entry {
+        int     events;
+        Handler handler;
+    };
+
+    bool dispatch(SOCKET sock, int events);
+
+    unordered_map<SOCKET, Entry> handlers;
+    mutable tbb::mutex handler_mtx;
+
+#ifdef __linux__
+    int epoll_fd;
+#endif
+};
+_CLANY_END
+
+#endif // REACTOR_H
@@ -0,0 +1,54 @@
+#ifndef READ_CACHE_H
+#define READ_CACHE_H
+
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include "clany/byte_array.hpp"
+#include <tbb/tbb.h>
+
+_CLANY_BEGIN
+// Recently uploaded pieces, shared by all connections. Pieces are reference
+// counted, so one evicted while its blocks are still queued on sockets lives on
+// until the last of them is sent. The least recently used pieces are evicted once
+// the cached pieces take more than capacity bytes
+class ReadCache {
+public:
+    using Piece = shared_ptr<const ByteArray>;
+
+    ReadCache() { hits = 0; misses = 0; }
+    ReadCache(const ReadCache&) = delete;
+    ReadCache& operator=(const ReadCache&) = delete;
+
+    // 0 disables the cache
+    void setCapacity(size_t num_bytes);
+
+    // Return the piece and make it most recently used, or nullptr on a miss
+    Piece get(int idx);
+    void  put(int idx, const Piece& piece);
+
+    size_t capacity() const { return cache_capacity; }
+    size_t size()     const;
+    int    numHits()   const { return hits; }
+    int    numMisses() const { return misses; }
+    double hitRate()   const {
+        int lookups = hits + misses;
+        return lookups == 0 ? 0 : double(hits) / lookups;
+    }
+
+private:
+    void evict(size_t num_bytes);
+
+    using Entry = pair<int, Piece>;
+    list<Entry> lru_list;  // most recently used first
+    unordered_map<int, list<Entry>::iterator> index;
+    size_t cache_capacity = 0;
+    size_t cache_size     = 0;
+
+    tbb::atomic<int> hits;
+    tbb::atomic<int> misses;
+    mutable tbb::spin_mutex cache_mtx;
+};
+_CLANY_END
+
+#endif // READ_CACHE_H
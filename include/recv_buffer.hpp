@@ -0,0 +1,80 @@
+#ifndef RECV_BUFFER_HPP
+#define RECV_BUFFER_HPP
+
+#include <cstring>
+#include "clany/byte_array.hpp"
+
+_CLANY_BEGIN
+// Per connection receive buffer for length prefixed messages
+// (<length prefix><message ID><payload>). Bytes are received straight into the
+// free tail in one large read, every complete message is then handed out as a
+// view into the buffer. Only the unfinished message at the end is ever moved,
+// and only when the tail runs out of room
+class RecvBuffer {
+public:
+    enum Status { Incomplete, Complete, Invalid };
+
+    RecvBuffer(size_t capacity, size_t max_msg_len)
+        : buffer(capacity), max_len(max_msg_len) {}
+
+    // Free space after the received bytes, make sure there is room for at least
+    // the rest of the message being received
+    char* tail() {
+        reserve();
+        return buffer.data() + end_pos;
+    }
+    size_t space() const { return buffer.size() - end_pos; }
+    void   produce(size_t n) { end_pos += n; }
+
+    // Take the next complete message, views stay valid until tail() is called.
+    // Keep alive messages (length 0) are skipped
+    Status next(uchar& msg_id, ByteView& payload) {
+        while (end_pos - begin_pos >= 4) {
+            int len = 0;
+            memcpy(&len, buffer.data() + begin_pos, 4);
+            if (len < 0 || size_t(len) > max_len) return Invalid;
+            if (len == 0) {
+                begin_pos += 4;
+                continue;
+            }
+            if (end_pos - begin_pos < 4 + size_t(len)) return Incomplete;
+
+            msg_id  = buffer[begin_pos + 4];
+            payload = ByteView(buffer.data() + begin_pos + 5, len - 1);
+            begin_pos += 4 + len;
+            return Complete;
+        }
+        return Incomplete;
+    }
+
+    size_t size() const { return end_pos - begin_pos; }
+
+private:
+    void reserve() {
+        if (begin_pos == end_pos) begin_pos = end_pos = 0;
+
+        // Bytes still needed to complete the pending message, at least a header
+        size_t need = 5;
+        if (end_pos - begin_pos >= 4) {
+            int len = 0;
+            memcpy(&len, buffer.data() + begin_pos, 4);
+            if (len >= 0 && size_t(len) <= max_len) need = 4 + len;
+        }
+        if (buffer.size() - begin_pos >= need && space() > 0) return;
+
+        // Move the partial message to the front, grow only if it still won't fit
+        size_t pending = end_pos - begin_pos;
+        if (begin_pos > 0) memmove(buffer.data(), buffer.data() + begin_pos, pending);
+        begin_pos = 0;
+        end_pos   = pending;
+        if (buffer.size() < need) buffer.resize(need);
+    }
+
+    ByteArray buffer;
+    size_t max_len;
+    size_t begin_pos = 0;
+    size_t end_pos   = 0;
+};
+_CLANY_END
+
+#endif // RECV_BUFFER_HPP
@@ -0,0 +1,20 @@
+#ifndef RESUME_DATA_H
+#define RESUME_DATA_H
+
+#include <clany/dyn_bitset.hpp>
+
+_CLANY_BEGIN
+// Sidecar file saved next to the download, lets a restart skip the full rehash
+// as long as the download file hasn't been touched since the data was saved
+struct ResumeData {
+    ByteArray info_hash;
+    llong    file_size = 0;
+    llong    mtime     = 0;
+    BitField bit_field;
+
+    bool load(const string& file_name, int num_pieces);
+    bool save(const string& file_name) const;
+};
+_CLANY_END
+
+#endif // RESUME_DATA_H
@@ -10,13 +10,22 @@
 
 _CLANY_BEGIN
 struct CmdArgs {
-    int    verbose       = 0;    // verbose level
-    string ip            = "";   // bind to this ip
-    string save_file     = "";   // filename to save to
-    string log_file      = "";   // log file name
-    string torrent_file  = "";   // torrent file name
-    string id            = "";   // this bt_clients id
-    ushort port          = 6767; // listening port
+    int    verbose       = 0;     // verbose level
+    bool   use_mmap      = false; // memory map the download file
+    string alloc_mode    = "";    // preallocation mode
+    string file_priority = "";    // per-file priorities, comma separated
+    int    resume_check  = 16;    // pieces to check when resuming
+    int    max_conn      = 200;   // max number of connections
+    int    req_window    = 16;    // min outstanding requests per peer
+    int    stream_window = 0;     // pieces ahead of the cursor when streaming
+    int    write_cache   = 32;    // write back cache size in MB
+    int    read_cache    = 64;    // upload read cache size in MB
+    string ip            = "";    // bind to this ip
+    string save_file     = "";    // filename to save to
+    string log_file      = "";    // log file name
+    string torrent_file  = "";    // torrent file name
+    string id            = "";    // this bt_clients id
+    ushort port          = 6767;  // listening port
     vector<string> peers = {};
 };
 
@@ -33,10 +42,20 @@ inline void usage(ostream& file)
          << "  -P port       \t Bind to this port for incoming connections (dflt: 6767)\n"
          << "  -s save_file  \t Save the torrent in directory save_dir (dflt: .)\n"
          << "  -l log_file   \t Save logs to log_filw (dflt: bt-client.log)\n"
-         << "  -p ip:port    \t Instead of contacting the tracker for a peer list,\n"
-         << "                \t use this peer instead, ip:port (ip or hostname)\n"
+         << "  -p ip:port    \t Besides the peers the tracker hands out,\n"
+         << "                \t also use this peer, ip:port (ip or hostname)\n"
          << "                \t (include multiple -p for more than 1 peer)\n"
          << "  -I id         \t Set the node identifier to id (dflt: random)\n"
+         << "  -m            \t Memory map the download file, serve blocks without copy\n"
+         << "  -a mode       \t Preallocate new file with full|reserve|sparse (dflt: reserve)\n"
+         << "  -f levels     \t Per-file priority in torrent order, comma separated\n"
+         << "                \t skip|normal|high, e.g. skip,high (dflt: normal)\n"
+         << "  -r num        \t Hash check num pieces when trusting resume data (dflt: 16)\n"
+         << "  -c num        \t Keep at most num peer connections (dflt: 200)\n"
+         << "  -w num        \t Keep at least num block requests in flight per peer (dflt: 16)\n"
+         << "  -S num        \t Stream: download in order, num pieces ahead (dflt: off)\n"
+         << "  -C size       \t Hold up to size MB of verified pieces before writing (dflt: 32)\n"
+         << "  -R size       \t Cache up to size MB of recently uploaded pieces (dflt: 64)\n"
          << "  -v            \t verbose, print additional verbose info\n";
 }
 
@@ -45,7 +64,7 @@ inline void parseArgs(CmdArgs& bt_args, int argc, char* argv[])
     // default log file
     bt_args.log_file = "bt-client.log";
 
-    CmdLineParser cmd_parser(argc, argv, "hvb:P:p:s:l:I:");
+    CmdLineParser cmd_parser(argc, argv, "hvmb:P:p:s:l:I:a:f:r:c:w:S:C:R:");
     int ch = 0; //ch for each flag
     while ((ch = cmd_parser.get()) != -1) {
         switch (ch) {
@@ -59,6 +78,33 @@ inline void parseArgs(CmdArgs& bt_args, int argc, char* argv[])
         case 'v': // verbose
             bt_args.verbose = 1;
             break;
+        case 'm': // memory map
+            bt_args.use_mmap = true;
+            break;
+        case 'a': // preallocation mode
+            bt_args.alloc_mode = cmd_parser.getArg<string>();
+            break;
+        case 'f': // file priorities
+            bt_args.file_priority = cmd_parser.getArg<string>();
+            break;
+        case 'r': // resume check
+            bt_args.resume_check = cmd_parser.getArg<int>();
+            break;
+        case 'c': // max connections
+            bt_args.max_conn = cmd_parser.getArg<int>();
+            break;
+        case 'w': // request window
+            bt_args.req_window = cmd_parser.getArg<int>();
+            break;
+        case 'S': // streaming window
+            bt_args.stream_window = cmd_parser.getArg<int>();
+            break;
+        case 'C': // write cache
+            bt_args.write_cache = cmd_parser.getArg<int>();
+            break;
+        case 'R': // read cache
+            bt_args.read_cache = cmd_parser.getArg<int>();
+            break;
         case 's': // save file
             bt_args.save_file = cmd_parser.getArg<string>();
             break;
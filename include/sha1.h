@@ -0,0 +1,36 @@
+#ifndef SHA1_H
+#define SHA1_H
+
+#include "clany/byte_array.hpp"
+
+_CLANY_BEGIN
+// SHA1 for piece verification. The implementation is chosen once at runtime from
+// what the CPU supports: SHA-NI instructions, AVX2 multi-buffer hashing 8 equally
+// long buffers in parallel lanes, or OpenSSL
+class Sha1 {
+public:
+    enum Impl { OpenSSL, ShaNi, Avx2 };
+
+    static const int DIGEST_LEN = 20;
+    static const int MAX_LANES  = 8;
+
+    static Impl impl();
+    static const char* implName();
+    // Force an implementation, return false if the CPU doesn't support it
+    static bool setImpl(Impl impl);
+
+    static void hash(const char* data, size_t length, char* digest);
+    static ByteArray hash(const char* data, size_t length) {
+        ByteArray digest(DIGEST_LEN);
+        hash(data, length, digest.data());
+        return digest;
+    }
+
+    // Hash n buffers at once, buffers of equal length are hashed side by side
+    // in SIMD lanes when multi-buffer hashing is available
+    static void hashMany(const char* const data[], const size_t length[], int n,
+                         char* const digest[]);
+};
+_CLANY_END
+
+#endif // SHA1_H
@@ -7,6 +7,8 @@
 #  include <ws2ipdef.h>
 #  define CLOSESOCKET ::closesocket
 #else
+#  include <cerrno>
+#  include <fcntl.h>
 #  include <unistd.h>
 #  include <sys/types.h>
 #  include <sys/socket.h>
@@ -17,6 +19,10 @@
 #  define INVALID_SOCKET -1
 #endif
 
+#ifndef MSG_NOSIGNAL
+#  define MSG_NOSIGNAL 0
+#endif
+
 #define INIT_WINSOCK \
 class WSA {\
 public:\
@@ -40,6 +46,16 @@ _CLANY_BEGIN
 using SockAddrIN  = sockaddr_in;
 using SockAddr    = sockaddr;
 
+// Return true if last socket call failed only because it would have blocked
+inline bool wouldBlock()
+{
+#ifdef _WIN32
+    return ::WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
 #if CLS_HAS_EXCEPT
 class SocketError : public runtime_error {
 public:
@@ -70,8 +86,9 @@ public:
     AbstractSocket(const AbstractSocket&) = delete;
     AbstractSocket& operator=(const AbstractSocket&) = delete;
 
+    // The descriptor is owned until close(), whatever state a failed connect left
     ~AbstractSocket() {
-        if (sock_state != UnconnectedState) CLOSESOCKET(handle);
+        if (handle != INVALID_SOCKET) CLOSESOCKET(handle);
     }
 
     bool bind(const string& host_address, ushort port) {
@@ -129,12 +146,62 @@ public:
         return true;
     }
 
+    // Start connecting and return without waiting, the socket is left non-blocking.
+    // Once it turns writable, finishConnect() tells whether the connection is up
+    bool connectAsync(const string& host_name, ushort port) {
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = port;
+
+        if (!::inet_pton(AF_INET, host_name.c_str(), &addr.sin_addr) || !setNonBlocking()) {
+            sock_state = UnconnectedState;
+            return false;
+        }
+        sock_state = ConnectingState;
+        if (::connect(handle, (SockAddr*)&addr, sizeof(addr)) < 0) {
+#ifdef _WIN32
+            bool in_progress = ::WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+            bool in_progress = errno == EINPROGRESS || errno == EINTR;
+#endif
+            if (!in_progress) sock_state = UnconnectedState;
+            return in_progress;
+        }
+
+        sock_state = ConnectedState;
+        return true;
+    }
+
+    bool finishConnect() {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (::getsockopt(handle, SOL_SOCKET, SO_ERROR, (char*)&error, &length) < 0 ||
+            error != 0) {
+            sock_state = UnconnectedState;
+            return false;
+        }
+        sock_state = ConnectedState;
+        return true;
+    }
+
     virtual void disconnect() {
         close();
     }
 
     bool isValid() const { return handle != INVALID_SOCKET; }
 
+    bool setNonBlocking(bool non_blocking = true) {
+#ifdef _WIN32
+        u_long mode = non_blocking ? 1 : 0;
+        return ::ioctlsocket(handle, FIONBIO, &mode) == 0;
+#else
+        int flags = ::fcntl(handle, F_GETFL, 0);
+        if (flags < 0) return false;
+        flags = non_blocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+        return ::fcntl(handle, F_SETFL, flags) == 0;
+#endif
+    }
+
     bool hasData() const {
         fd_set read_fds;
         FD_ZERO(&read_fds);
@@ -178,7 +245,8 @@ protected:
 
     void close() {
         sock_state = ClosingState;
-        CLOSESOCKET(handle);
+        if (handle != INVALID_SOCKET) CLOSESOCKET(handle);
+        handle     = INVALID_SOCKET;
         sock_state = UnconnectedState;
     }
 
@@ -0,0 +1,93 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include "clany/byte_array.hpp"
+
+_CLANY_BEGIN
+// Preallocated file on disk. The descriptor is held open for the lifetime of the
+// torrent and all I/O is positional, so concurrent readers and writers never
+// share a seek pointer and need no locking
+class FileStorage {
+public:
+#ifdef _WIN32
+    using Handle = void*;
+#else
+    using Handle = int;
+#endif
+
+    // How a new file is preallocated: write zeros over the whole file, reserve
+    // blocks with fallocate, or only set the size and leave the file sparse
+    enum AllocMode { AllocFull, AllocReserve, AllocSparse };
+
+    FileStorage() = default;
+    FileStorage(const FileStorage&) = delete;
+    FileStorage& operator=(const FileStorage&) = delete;
+    ~FileStorage() { close(); }
+
+    // Open an existing file, return false if it can't be opened
+    bool open(const string& file_name);
+    // Create (or truncate) the file and preallocate it up to file_size
+    bool create(const string& file_name, llong file_size, AllocMode mode = AllocFull);
+    void close();
+
+    // Map the whole file into memory, reads and writes then go through the mapping
+    // and view() hands out zero-copy references to file content
+    bool map();
+    void unmap();
+    // Schedule (or wait for, if sync is true) write-back of a mapped range
+    bool flush(llong pos, size_t length, bool sync = false) const;
+
+    bool write(llong pos, const char* data, size_t length) const;
+    bool write(llong pos, const ByteArray& data) const {
+        return write(pos, data.data(), data.size());
+    }
+    // Write consecutive buffers as one contiguous range starting at pos
+    bool write(llong pos, const vector<ByteView>& parts) const;
+
+    bool read(llong pos, size_t length, char* data) const;
+    bool read(llong pos, size_t length, ByteArray& data) const {
+        data.resize(length);
+        return read(pos, length, data.data());
+    }
+
+    // Return a view into the mapping, or an empty view if the range isn't mapped
+    ByteView view(llong pos, size_t length) const {
+        if (!inMapping(pos, length)) return ByteView();
+        return ByteView(map_addr + pos, length);
+    }
+
+    bool  isOpen()   const { return is_open; }
+    bool  isMapped() const { return map_addr != nullptr; }
+    bool  empty()    const { return fsize == 0; }
+    llong size()     const { return fsize; }
+    const string& name() const { return fname; }
+    Handle handle() const { return fhandle; }
+    // Last modification time of the file in nanoseconds, 0 if unknown
+    llong modifiedTime() const;
+    // Mode actually used by create, AllocReserve may fall back to AllocSparse
+    AllocMode allocMode() const { return alloc_mode; }
+
+private:
+    bool openHandle(const string& file_name, bool truncate);
+    bool fillZero(llong file_size);
+    bool resize(llong file_size);
+    bool reserve(llong file_size);
+    bool inMapping(llong pos, size_t length) const {
+        return map_addr && pos >= 0 && llong(pos + length) <= llong(map_size);
+    }
+
+    string fname   = "";
+    llong  fsize   = 0;
+    Handle fhandle = Handle();
+    bool   is_open = false;
+    AllocMode alloc_mode = AllocFull;
+
+    char*  map_addr = nullptr;
+    size_t map_size = 0;
+#ifdef _WIN32
+    Handle map_handle = Handle();
+#endif
+};
+_CLANY_END
+
+#endif // STORAGE_H
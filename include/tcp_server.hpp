@@ -21,14 +21,16 @@ public:
         return nullptr;
     }
 
-    virtual bool hasPendingConnections() const {
+    // Wait no longer than time_out seconds for an incoming connection
+    virtual bool hasPendingConnections(double time_out = 0) const {
         fd_set read_fds;
         FD_ZERO(&read_fds);
         FD_SET(tcp_socket.sock(), &read_fds);
-        timeval no_block {0, 0};
+        timeval wait_time {static_cast<long>(time_out),
+                           static_cast<long>((time_out - long(time_out)) * 1e6)};
 
         return ::select(tcp_socket.sock() + 1, &read_fds,
-                        nullptr, nullptr, &no_block) > 0;
+                        nullptr, nullptr, &wait_time) > 0;
     }
 
     bool listen(const string& host_address, uint16_t port) {
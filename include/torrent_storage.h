@@ -0,0 +1,95 @@
+#ifndef TORRENT_STORAGE_H
+#define TORRENT_STORAGE_H
+
+#include <memory>
+#include "storage.h"
+
+_CLANY_BEGIN
+// Files of a torrent laid end to end, one address space as pieces see it. Every
+// file keeps its own descriptor open for the lifetime of the torrent, a range of
+// the torrent is mapped to spans of the files it covers and I/O is done per span,
+// gathered into one call per file where possible
+class TorrentStorage {
+public:
+    // What the download needs of a file: nothing, only the blocks of wanted
+    // pieces it shares with a neighbour, or all of it
+    enum Need { NeedNone, NeedPartial, NeedAll };
+
+    struct FileEntry {
+        string path;
+        llong  length;
+        Need   need;
+    };
+    // Part of a torrent range inside one file, pos is relative to the file
+    struct Span {
+        int    file;
+        llong  pos;
+        size_t length;
+    };
+
+    TorrentStorage() = default;
+    TorrentStorage(const TorrentStorage&) = delete;
+    TorrentStorage& operator=(const TorrentStorage&) = delete;
+
+    // Open the files, return false unless all needed ones exist. Files not needed
+    // are opened if they happen to be there, I/O on a missing one fails
+    bool open(const vector<FileEntry>& file_list);
+    // Create missing files (and their directories), files already there are opened
+    // as they are. Only files needed whole are preallocated, partially needed ones
+    // are created sparse and files not needed at all are never created
+    bool create(const vector<FileEntry>& file_list,
+                FileStorage::AllocMode mode = FileStorage::AllocFull);
+    void close();
+
+    // Map every non empty file into memory, see FileStorage::map
+    bool map();
+    void unmap();
+    bool flush(llong pos, size_t length, bool sync = false) const;
+
+    vector<Span> spans(llong pos, size_t length) const;
+    // Descriptor and position in the file if the range doesn't cross files
+    bool locate(llong pos, size_t length, FileStorage::Handle& handle, llong& file_pos) const;
+
+    bool write(llong pos, const char* data, size_t length) const;
+    bool write(llong pos, const vector<ByteView>& parts) const;
+
+    bool read(llong pos, size_t length, char* data) const;
+    bool read(llong pos, size_t length, ByteArray& data) const {
+        data.resize(length);
+        return read(pos, length, data.data());
+    }
+
+    // View into the mapping if the range lies in one mapped file, else empty
+    ByteView view(llong pos, size_t length) const;
+
+    bool   isOpen()   const { return !files.empty(); }
+    bool   isMapped() const { return is_mapped; }
+    llong  size()     const { return total_size; }
+    size_t numFiles() const { return files.size(); }
+    // Files that were there already rather than created by create()
+    int    numExisting() const { return num_existing; }
+    bool   hasFile(int idx) const { return files[idx] != nullptr; }
+    const FileStorage& file(int idx) const { return *files[idx]; }
+    // Latest modification time of all files in nanoseconds
+    llong modifiedTime() const;
+    // Mode used for the files create() made, AllocReserve may become AllocSparse
+    FileStorage::AllocMode allocMode() const { return alloc_mode; }
+
+private:
+    bool openFiles(const vector<FileEntry>& file_list, bool create_missing,
+                   FileStorage::AllocMode mode);
+    // Index of the file holding torrent position pos
+    int fileAt(llong pos) const;
+    // Spans of the range, empty if any of them falls into a missing file
+    vector<Span> presentSpans(llong pos, size_t length) const;
+
+    vector<unique_ptr<FileStorage>> files;  // null for missing files not needed
+    vector<llong> offsets;  // torrent position of the first byte of each file
+    llong total_size   = 0;
+    int   num_existing = 0;
+    bool  is_mapped    = false;
+    FileStorage::AllocMode alloc_mode = FileStorage::AllocFull;
+};
+_CLANY_END
+
+#endif // TORRENT_STORAGE_H
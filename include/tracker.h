@@ -0,0 +1,141 @@
+#ifndef TRACKER_H
+#define TRACKER_H
+
+#include <memory>
+#include <chrono>
+#include <random>
+#include "socket.hpp"
+#include "clany/byte_array.hpp"
+
+_CLANY_BEGIN
+// Peer as a tracker hands it out, address and port in network byte order
+struct PeerEndpoint {
+    uint32_t ip;
+    ushort   port;
+};
+
+// What we tell the tracker about our download
+struct AnnounceRequest {
+    enum Event { None, Completed, Started, Stopped };
+
+    ByteArray info_hash;
+    string    peer_id;
+    ushort    port;        // listening port, host byte order
+    llong     uploaded;
+    llong     downloaded;
+    llong     left;
+    Event     event;
+    int       num_want;
+};
+
+struct ScrapeResult {
+    int seeders;
+    int completed;
+    int leechers;
+};
+
+struct AnnounceResponse {
+    int interval     = 0;  // seconds until the next regular announce
+    int min_interval = 0;
+    int seeders      = -1;
+    int leechers     = -1;
+    vector<PeerEndpoint> peers;
+};
+
+// Announces to one tracker. Calls block for at most the time out given to
+// setTimeOut, failures leave a reason in error()
+class Tracker {
+public:
+    using Ptr = unique_ptr<Tracker>;
+
+    static const int DEFAULT_TIME_OUT = 15;
+
+    // Tracker for the url, nullptr if its scheme isn't supported
+    static Ptr create(const string& url);
+
+    virtual ~Tracker() = default;
+
+    virtual bool announce(const AnnounceRequest& request, AnnounceResponse& response) = 0;
+
+    const string& url()   const { return tracker_url; }
+    const string& error() const { return err_msg; }
+    void setTimeOut(double seconds) { time_out = seconds; }
+
+protected:
+    explicit Tracker(const string& url) : tracker_url(url) {}
+
+    // Split scheme://host:port/path, path keeps its leading '/'
+    static bool parseUrl(const string& url, string& host, ushort& port, string& path);
+    // Look host up, address and port in network byte order
+    static bool resolve(const string& host, ushort port, SockAddrIN& addr);
+
+    bool fail(const string& message);
+
+    string tracker_url;
+    string err_msg;
+    double time_out = DEFAULT_TIME_OUT;
+};
+
+// HTTP announce (BEP 3) asking for the compact peer list of BEP 23, the
+// dictionary form is still understood for trackers that ignore compact=1
+class HttpTracker : public Tracker {
+public:
+    explicit HttpTracker(const string& url) : Tracker(url) {}
+
+    bool announce(const AnnounceRequest& request, AnnounceResponse& response) override;
+
+private:
+    string requestLine(const AnnounceRequest& request, const string& host,
+                       const string& path) const;
+    bool   exchange(const SockAddrIN& addr, const string& request, string& reply);
+    bool   parseReply(const string& reply, AnnounceResponse& response);
+};
+
+// UDP announce and scrape (BEP 15). The connection id from the connect exchange
+// is cached for the minute it stays valid, so regular announces and scrapes cost
+// one round trip. A request without reply is sent again after 15 * 2^n seconds,
+// or base * 2^n as set by setRetransmit, until the time out is used up
+class UdpTracker : public Tracker {
+public:
+    // Info hashes that fit one scrape datagram
+    static const int MAX_SCRAPE_HASHES = 74;
+
+    explicit UdpTracker(const string& url);
+
+    bool announce(const AnnounceRequest& request, AnnounceResponse& response) override;
+    // Swarm counts for many torrents, MAX_SCRAPE_HASHES per datagram
+    bool scrape(const vector<ByteArray>& info_hashes, vector<ScrapeResult>& results);
+
+    void setRetransmit(double base_seconds, int max_tries) {
+        retransmit_base  = base_seconds;
+        retransmit_tries = max_tries;
+    }
+    // Seconds a connection id is used before connecting again, at most the minute
+    // BEP 15 lets trackers keep it
+    void setConnectionIdLife(double seconds) { id_life = seconds; }
+
+private:
+    using sys_clock = chrono::steady_clock;
+
+    bool open();
+    bool connect(sys_clock::time_point deadline);
+    // Send request and wait for the reply to it, retransmitting on silence. The
+    // transaction id at offset 12 of request is set here
+    bool transact(ByteArray& request, uint32_t action, ByteArray& reply,
+                  sys_clock::time_point deadline);
+    sys_clock::time_point deadline() const;
+
+    unique_ptr<UDPSocket> sock;
+    uint64_t connection_id = 0;
+    sys_clock::time_point connected_at;
+    bool     is_connected = false;
+    uint32_t key;
+
+    double id_life          = 60;
+    double retransmit_base  = 15;
+    int    retransmit_tries = 9;
+    default_random_engine rd_engine {random_device()()};
+};
+_CLANY_END
+
+#endif // TRACKER_H
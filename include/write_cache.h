@@ -0,0 +1,63 @@
+#ifndef WRITE_CACHE_H
+#define WRITE_CACHE_H
+
+#include <map>
+#include <functional>
+#include "torrent_storage.h"
+#include <tbb/tbb.h>
+
+_CLANY_BEGIN
+// Verified pieces waiting to be written to the download file. Pieces are held in
+// memory until capacity bytes are dirty, then written back in index order with
+// runs of adjacent pieces merged into one contiguous write. Blocks never reach the
+// disk before their piece passed the hash check
+class WriteCache {
+public:
+    // Called after a run of pieces is written, and with every buffer written
+    using WrittenFunc = function<void(llong pos, size_t length)>;
+    using RecycleFunc = function<void(ByteArray&& buffer)>;
+
+    WriteCache() = default;
+    WriteCache(const WriteCache&) = delete;
+    WriteCache& operator=(const WriteCache&) = delete;
+
+    void init(const TorrentStorage* file, int piece_length,
+              WrittenFunc written = nullptr, RecycleFunc recycle = nullptr);
+    // 0 writes every piece through right away
+    void setCapacity(size_t num_bytes) { cache_capacity = num_bytes; }
+
+    // Take a verified piece, write everything back if the cache is full. Return
+    // false if the piece itself failed to be written, it is dropped then. Other
+    // pieces that failed stay dirty and are tried again later
+    bool add(int idx, ByteArray&& data);
+    bool flush();
+
+    bool contains(int idx) const;
+    // Copy part of a dirty piece into buffer, false if the piece isn't here
+    bool read(int idx, int offset, int length, ByteArray& buffer) const;
+
+    size_t capacity()     const { return cache_capacity; }
+    size_t dirtyBytes()   const { return dirty_bytes; }
+    int    numWrites()    const { return num_writes; }
+    llong  writtenBytes() const { return written_bytes; }
+
+private:
+    map<int, ByteArray> pieces;
+    const TorrentStorage* file = nullptr;
+    int    piece_length   = 0;
+    size_t cache_capacity = 0;
+
+    WrittenFunc written_func;
+    RecycleFunc recycle_func;
+
+    tbb::atomic<size_t> dirty_bytes;
+    tbb::atomic<int>    num_writes;
+    tbb::atomic<llong>  written_bytes;
+    // Guards the map, flush_mtx keeps one write back at a time and is held
+    // whenever a piece leaves the map
+    mutable tbb::spin_mutex cache_mtx;
+    tbb::mutex flush_mtx;
+};
+_CLANY_END
+
+#endif // WRITE_CACHE_H
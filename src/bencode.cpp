@@ -0,0 +1,198 @@
+#include <limits>
+#include "bencode.h"
+
+using namespace std;
+using namespace cls;
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// BencodeTree::Node
+size_t BencodeTree::Node::size() const
+{
+    if (!isList() && !isDict()) return 0;
+    return node().count;
+}
+
+int BencodeTree::Node::child(size_t i) const
+{
+    return tree->child_pos[node().first_child + i];
+}
+
+auto BencodeTree::Node::at(size_t i) const -> Node
+{
+    if (i >= size()) return Node();
+    return Node(tree, child(isDict() ? 2*i + 1 : i));
+}
+
+ByteView BencodeTree::Node::key(size_t i) const
+{
+    if (!isDict() || i >= size()) return ByteView();
+    return tree->nodes[child(2*i)].value;
+}
+
+auto BencodeTree::Node::operator[](const string& key) const -> Node
+{
+    if (!isDict()) return Node();
+
+    int child_idx = idx + 1;
+    for (auto i = 0; i < node().count; ++i) {
+        const auto& key_node = tree->nodes[child_idx];
+        if (key_node.value.size() == key.size() &&
+            equal(key.begin(), key.end(), key_node.value.begin())) {
+            return Node(tree, key_node.end);
+        }
+        child_idx = tree->nodes[key_node.end].end;
+    }
+    return Node();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// BencodeTree
+bool BencodeTree::parse(const ByteView& input)
+{
+    clear();
+    input_begin = input.begin();
+    pos         = input.begin();
+    input_end   = input.end();
+
+    if (!parseValue(0)) {
+        nodes.clear();
+        return false;
+    }
+    if (pos != input_end) {
+        nodes.clear();
+        return fail("trailing data after the root value");
+    }
+    indexChildren();
+    return true;
+}
+
+void BencodeTree::indexChildren()
+{
+    // Children sit right after their parent, hop over the subtree of each sibling.
+    // Done once here, so element i of a list is found without walking i siblings
+    child_pos.clear();
+    child_pos.reserve(nodes.size());
+    for (auto& entry : nodes) {
+        if (entry.type != List && entry.type != Dict) continue;
+        entry.first_child = static_cast<int>(child_pos.size());
+        int num_children  = entry.type == Dict ? 2*entry.count : entry.count;
+        int child_idx     = static_cast<int>(&entry - nodes.data()) + 1;
+        for (auto i = 0; i < num_children; ++i) {
+            child_pos.push_back(child_idx);
+            child_idx = nodes[child_idx].end;
+        }
+    }
+}
+
+void BencodeTree::clear()
+{
+    nodes.clear();
+    child_pos.clear();
+    err_msg.clear();
+    input_begin = pos = input_end = nullptr;
+}
+
+bool BencodeTree::parseValue(int depth)
+{
+    if (pos == input_end) return fail("unexpected end of data");
+    if (nodes.size() == node_limit) return fail("too many values");
+
+    int node_idx = static_cast<int>(nodes.size());
+    nodes.push_back({Integer, 0, 0, 0, 0, ByteView(), ByteView()});
+    const char* begin = pos;
+
+    char c = *pos;
+    if (c == 'i') {
+        ++pos;
+        llong number = 0;
+        if (!parseInteger(number)) return false;
+        if (pos == input_end || *pos != 'e') return fail("unterminated integer");
+        ++pos;
+        nodes[node_idx].integer = number;
+    } else if (c >= '0' && c <= '9') {
+        size_t length = 0;
+        if (!parseLength(length)) return false;
+        if (pos == input_end || *pos != ':') return fail("missing ':' after string length");
+        ++pos;
+        if (size_t(input_end - pos) < length) return fail("string runs past end of data");
+        nodes[node_idx].type  = Bytes;
+        nodes[node_idx].value = ByteView(pos, length);
+        pos += length;
+    } else if (c == 'l' || c == 'd') {
+        if (depth == depth_limit) return fail("nesting too deep");
+        ++pos;
+        bool is_dict = c == 'd';
+        int count = 0;
+        while (pos != input_end && *pos != 'e') {
+            // Keys of a dict are strings
+            if (is_dict && (*pos < '0' || *pos > '9')) {
+                return fail("dictionary key is not a string");
+            }
+            if (!parseValue(depth + 1)) return false;
+            if (is_dict && !parseValue(depth + 1)) return false;
+            ++count;
+        }
+        if (pos == input_end) return fail("unterminated list or dictionary");
+        ++pos;
+        nodes[node_idx].type  = is_dict ? Dict : List;
+        nodes[node_idx].count = count;
+    } else {
+        return fail(string("unexpected character '") + c + "'");
+    }
+
+    nodes[node_idx].end = static_cast<int>(nodes.size());
+    nodes[node_idx].raw = ByteView(begin, pos - begin);
+    return true;
+}
+
+bool BencodeTree::parseInteger(llong& number)
+{
+    bool is_negative = pos != input_end && *pos == '-';
+    if (is_negative) ++pos;
+
+    const char* digits = pos;
+    llong value = 0;
+    for (; pos != input_end && *pos >= '0' && *pos <= '9'; ++pos) {
+        int digit = *pos - '0';
+        if (value > (numeric_limits<llong>::max() - digit) / 10) {
+            return fail("integer out of range");
+        }
+        value = value * 10 + digit;
+    }
+
+    // i-0e, i03e and ie are not allowed
+    size_t num_digits = pos - digits;
+    if (num_digits == 0 || (num_digits > 1 && *digits == '0') ||
+        (is_negative && value == 0)) {
+        return fail("malformed integer");
+    }
+
+    number = is_negative ? -value : value;
+    return true;
+}
+
+bool BencodeTree::parseLength(size_t& length)
+{
+    const char* digits = pos;
+    size_t value = 0;
+    for (; pos != input_end && *pos >= '0' && *pos <= '9'; ++pos) {
+        value = value * 10 + (*pos - '0');
+        // Longer than the whole input can't be valid anyway
+        if (value > size_t(input_end - input_begin)) {
+            return fail("string length out of range");
+        }
+    }
+    if (pos - digits > 1 && *digits == '0') return fail("malformed string length");
+
+    length = value;
+    return true;
+}
+
+bool BencodeTree::fail(const string& message)
+{
+    // Only the innermost failure is reported
+    if (err_msg.empty()) {
+        err_msg = message + " at offset " + to_string(pos - input_begin);
+    }
+    return false;
+}
@@ -1,5 +1,4 @@
 #include <random>
-#include <openssl/sha.h>
 #include <clany/algorithm.hpp>
 #include "bt_client.h"
 
@@ -16,85 +15,148 @@ using namespace cls;
 
 namespace {
 const size_t MSG_SIZE_LIMITE   = 1 * 1024 * 1024;    // 1mb
+const int    MAX_REQUEST_LENGTH = 128 * 1024;  // peers ask for 16kb, we ask for 32kb
 const int    HANDSHAKE_MSG_LEN = 68;
-const int    MAX_TRYING_TIMES  = 5;
+const size_t MAX_PARALLEL_DIALS = 32;
+const int    CONNECT_TIME_OUT   = 5;    // seconds
+const int    HANDSHAKE_TIME_OUT = 10;   // seconds
+const double RETRY_INTERVAL     = 1.0;  // first wait before dialing a failed peer again
+const double MAX_RETRY_INTERVAL = 300.0;
+const int    MAX_BACKOFF_SHIFT  = 10;
 const double SLEEP_INTERVAL    = 0.1;
-const llong  FILE_CHUNK_SIZE   = 100 * 1024 * 1024; // 100 MB
+const double TICK_INTERVAL     = 0.05;
 const size_t BUFF_LEN          = 255;
+const llong  RESUME_BUFF_SIZE  = 256 * 1024 * 1024; // 256 MB
+const double RESUME_SAVE_INTERVAL = 60.0;
+const int    MAX_HASH_WORKERS  = 4;
+const int    TRACKER_TIME_OUT  = 10;     // seconds
+const int    STOPPED_TIME_OUT  = 2;      // seconds, for the last announce on exit
+const int    NUM_WANT          = 50;
+const int    DEFAULT_ANNOUNCE_INTERVAL = 1800;
+const int    MIN_ANNOUNCE_INTERVAL     = 5;
+const double UDP_RETRANSMIT_BASE       = 2.5;  // BEP 15 waits 15s, too long for us
+const int    UDP_RETRANSMIT_TRIES      = 4;
+const int    TRACKER_RETRY_INTERVAL    = 15;   // first wait after all trackers failed
+const int    MAX_TRACKER_RETRY_INTERVAL = 1800;
+const size_t HASH_QUEUE_SIZE   = 16;
 
 const uint SEED = random_device()();
 auto  rd_engine = default_random_engine(SEED);
 
 tbb::mutex print_mtx;
 tbb::mutex peer_list_mtx;
-tbb::mutex connection_mtx;
-tbb::mutex file_mtx;
 } // Unnamed namespace
 
-bool BTClient::TmpFile::create(const string& file_name, llong file_size)
+//////////////////////////////////////////////////////////////////////////////////////////
+// BTClient interface
+bool BTClient::setTorrent(const string& torrent_name, const string& save_file_name,
+                          FileStorage::AllocMode alloc_mode)
 {
-    fname = file_name;
-    fsize = file_size;
-    ofstream ofs(fname, ios::binary);
-    if (!ofs) return false;
+    if (download_file.isOpen()) {
+        cerr << "Torrent already set!" << endl;
+        return false;
+    }
 
-    const ByteArray file_chunk(FILE_CHUNK_SIZE);
-    for (auto i = 0u; i < fsize / FILE_CHUNK_SIZE; ++i) {
-        ofs.write(file_chunk.data(), FILE_CHUNK_SIZE);
+    MetaInfoParser parser;
+    if (!parser.parse(ByteArray(readBinaryFile(torrent_name)), meta_info)) {
+        cerr << "Fail to parse " << torrent_name << ": " << parser.error() << endl;
+        return false;
     }
-    int rest_size = file_size % FILE_CHUNK_SIZE;
-    ofs.write(ByteArray(rest_size).data(), rest_size);
+    save_name = save_file_name.empty() ? meta_info.name : save_file_name;
 
-    return true;
-}
+    // Initialize piece picker and bitfield, load (partial)downloaded file if exist
+    bit_field.resize(meta_info.num_pieces);
+    picker.init(meta_info.num_pieces);
+    auto file_list = selectFiles();
+    assembly.init(meta_info.piece_length, meta_info.length);
+    write_cache.init(&download_file, meta_info.piece_length,
+        [this](llong pos, size_t length) {
+            if (flush_policy != FlushNone) {
+                download_file.flush(pos, length, flush_policy == FlushSync);
+            }
+        },
+        [this](ByteArray&& buffer) { assembly.recycle(move(buffer)); });
+    if (!loadFile(file_list)) {
+        auto alloc_start = chrono::steady_clock::now();
+        if (!download_file.create(file_list, alloc_mode)) {
+            cerr << "Fail to create " << save_name << endl;
+            return false;
+        }
+        chrono::duration<float> alloc_time = chrono::steady_clock::now() - alloc_start;
 
-bool BTClient::TmpFile::write(size_t idx, const ByteArray& data) const
-{
-    fstream fs(fname, ios::binary | ios::in | ios::out);
-    if (!fs) return false;
+        const char* mode_name[] = {"full", "reserve", "sparse"};
+        char log_buffer[BUFF_LEN];
+        llong alloc_bytes = 0;
+        for (const auto& file : file_list) {
+            if (file.need == TorrentStorage::NeedAll) alloc_bytes += file.length;
+        }
+        sprintf(log_buffer, "Preallocate %lld bytes (%s) in %.3fs", alloc_bytes,
+                mode_name[download_file.allocMode()], alloc_time.count());
+        ATOMIC_PRINT("%s\n", log_buffer);
+        writeLog(log_buffer);
 
-    fs.seekp(idx);
-    fs.write(data.data(), data.size());
+        // Files left from an earlier run with other files selected may hold pieces
+        if (download_file.numExisting() > 0) checkFile();
+    }
+    if (use_mmap && !download_file.map()) {
+        cerr << "Fail to map " << save_name << " into memory, "
+             << "fall back to positional I/O" << endl;
+    }
+    DBGVAR(cout, bit_field);
 
     return true;
 }
 
-bool BTClient::TmpFile::read(size_t idx, size_t length, ByteArray& data) const
+auto BTClient::selectFiles() -> vector<TorrentStorage::FileEntry>
 {
-    ifstream ifs(fname, ios::binary);
-    if (!ifs) return false;
-
-    data.resize(length);
-    ifs.seekg(idx);
-    ifs.read(data.data(), length);
-
-    return true;
-}
+    const auto& files = meta_info.files;
+    auto filePriority = [this](size_t i) {
+        return i < file_priority.size() ? file_priority[i] : PiecePicker::Normal;
+    };
+    auto firstPiece = [this](const FileInfo& file) {
+        return static_cast<int>(file.offset / meta_info.piece_length);
+    };
+    auto lastPiece = [this](const FileInfo& file) {
+        return static_cast<int>((file.offset + file.length - 1) / meta_info.piece_length);
+    };
 
-//////////////////////////////////////////////////////////////////////////////////////////
-// BTClient interface
-bool BTClient::setTorrent(const string& torrent_name, const string& save_file_name)
-{
-    if (!download_file.empty()) {
-        cerr << "Torrent already set!" << endl;
-        return false;
+    vector<PiecePicker::Priority> piece_priority(meta_info.num_pieces, PiecePicker::Skip);
+    for (auto i = 0u; i < files.size(); ++i) {
+        if (files[i].length == 0) continue;
+        for (auto idx = firstPiece(files[i]); idx <= lastPiece(files[i]); ++idx) {
+            piece_priority[idx] = max(piece_priority[idx], filePriority(i));
+        }
+    }
+    for (auto idx = 0; idx < meta_info.num_pieces; ++idx) {
+        picker.setPriority(idx, piece_priority[idx]);
     }
 
-    MetaInfoParser parser;
-    if (!parser.parse(ByteArray(readBinaryFile(torrent_name)), meta_info)) return false;
-    save_name = save_file_name.empty() ? meta_info.name : save_file_name;
-
-    // Initialize piece status (-1: not have, 0: downloading, 1: have)
-    // and bitfield, load (partial)downloaded file if exist
-    bit_field.resize(meta_info.num_pieces);
-    pieces_status.resize(meta_info.num_pieces);
-    fill(pieces_status.begin(), pieces_status.end(), -1);
-    if (!loadFile(save_name)) {
-        download_file.create(save_name, meta_info.length);
+    // A multi-file torrent is saved as a directory holding its files
+    vector<TorrentStorage::FileEntry> file_list;
+    int num_selected = 0;
+    for (auto i = 0u; i < files.size(); ++i) {
+        auto need = TorrentStorage::NeedAll;
+        if (filePriority(i) == PiecePicker::Skip) {
+            // Pieces on its edges may still be wanted for a neighbour
+            bool is_shared = files[i].length > 0 &&
+                (piece_priority[firstPiece(files[i])] != PiecePicker::Skip ||
+                 piece_priority[lastPiece(files[i])]  != PiecePicker::Skip);
+            need = is_shared ? TorrentStorage::NeedPartial : TorrentStorage::NeedNone;
+        } else {
+            ++num_selected;
+        }
+        auto path = meta_info.is_multi_file ? save_name + '/' + files[i].path : save_name;
+        file_list.push_back({path, files[i].length, need});
     }
-    DBGVAR(cout, bit_field);
 
-    return true;
+    if (num_selected < int(files.size())) {
+        char log_buffer[BUFF_LEN];
+        sprintf(log_buffer, "Selected %d of %d files, %d of %d pieces wanted",
+                num_selected, (int)files.size(), picker.numWanted(), meta_info.num_pieces);
+        ATOMIC_PRINT("%s\n", log_buffer);
+        writeLog(log_buffer);
+    }
+    return file_list;
 }
 
 bool BTClient::setLogFile(const string& file_name)
@@ -107,7 +169,7 @@ bool BTClient::setLogFile(const string& file_name)
 
 void BTClient::writeLog(const string& message)
 {
-    tbb::mutex::scoped_lock(log_mtx);
+    tbb::mutex::scoped_lock lock(log_mtx);
     auto now = chrono::system_clock::now();
     chrono::duration<float> delta = now - start;
 
@@ -121,15 +183,79 @@ void BTClient::writeLog(const string& message)
     }
 }
 
+void BTClient::setCursor(llong pos)
+{
+    if (meta_info.piece_length == 0) return;
+    picker.setCursor(static_cast<int>(pos / meta_info.piece_length));
+}
+
+llong BTClient::cursor() const
+{
+    return llong(picker.cursor()) * meta_info.piece_length;
+}
+
+llong BTClient::available(llong pos) const
+{
+    if (pos < 0 || pos >= meta_info.length) return 0;
+
+    int idx = static_cast<int>(pos / meta_info.piece_length);
+    spin_mutex::scoped_lock lock(piece_mtx);
+    while (idx < meta_info.num_pieces && bit_field[idx]) ++idx;
+    return min(llong(idx) * meta_info.piece_length, meta_info.length) - pos;
+}
+
+size_t BTClient::readVerified(llong pos, size_t length, char* data) const
+{
+    length = static_cast<size_t>(min<llong>(length, available(pos)));
+
+    // Block by block, through the write cache if it isn't on disk yet
+    ByteArray buffer;
+    size_t num_read = 0;
+    while (num_read < length) {
+        int idx    = static_cast<int>(pos / meta_info.piece_length);
+        int offset = static_cast<int>(pos % meta_info.piece_length);
+        int step   = static_cast<int>(min<llong>(min<llong>(length - num_read, MAX_REQUEST_LENGTH),
+                                                 meta_info.piece_length - offset));
+        auto block = getBlock(idx, offset, step, buffer);
+        if (block.size() != size_t(step)) break;
+
+        memcpy(data + num_read, block.data(), step);
+        num_read += step;
+        pos      += step;
+    }
+    return num_read;
+}
+
 void BTClient::run()
 {
     ATOMIC_PRINT("Starting Main Loop, press q/Q to exit the program\n");
-    if (bit_field.all()) {
+    run_start = chrono::steady_clock::now();
+    if (available(cursor()) > 0) first_ready = true;
+    if (picker.numMissing() == 0) {
         is_complete = true;
         ATOMIC_PRINT("Already have the file, now seeding\n");
     }
 
-    atm_bool running[2];
+    // Leave most scheduler threads to the network tasks
+    int num_hashers = max(1, min(MAX_HASH_WORKERS,
+                                 task_scheduler_init::default_num_threads() / 2));
+    hash_pool.start(num_hashers, HASH_QUEUE_SIZE,
+        [this](HashPool::Job* const jobs[], int num_jobs, bool is_valid[]) {
+            const char* pieces[Sha1::MAX_LANES];
+            size_t lengths[Sha1::MAX_LANES];
+            int    indices[Sha1::MAX_LANES];
+            for (auto i = 0; i < num_jobs; ++i) {
+                pieces[i]  = jobs[i]->data.data();
+                lengths[i] = jobs[i]->data.size();
+                indices[i] = jobs[i]->idx;
+            }
+            checkPieces(pieces, lengths, indices, num_jobs, is_valid);
+        },
+        [this](HashPool::Job& job, bool is_valid) {
+            pieceHashed(job, is_valid);
+        });
+
+    atm_bool running[5];
     fill(begin(running), end(running), true);
 
     task_group search_peers;
@@ -139,45 +265,78 @@ void BTClient::run()
     search_peers.run(
         [this, &running]() { listen(running[1]); }
     );
-
-    // Get what we don't have now
-    needed_piece.clear();
-    needed_piece.reserve(meta_info.num_pieces);
-    for (auto idx = 0; idx < meta_info.num_pieces; ++idx) {
-        if (!bit_field[idx]) needed_piece.push_back(idx);
-    }
-    shuffle(needed_piece, rd_engine);
+    search_peers.run(
+        [this, &running]() { autoSave(running[2]); }
+    );
+    search_peers.run(
+        [this, &running]() { serve(running[3]); }
+    );
+    search_peers.run(
+        [this, &running]() { announce(running[4]); }
+    );
 
     string input_str;
     while(getline(cin, input_str)) {
         char c = input_str[0];
         // Exit the program if user press q/Q
         if (input_str.size() == 1 && (c == 'q' || c == 'Q')) {
-            fill(running, false);
-            for_each(connection_list, mem_fn(&PeerClient::stop));
             break;
         } else {
             ATOMIC_PRINT("Invalid input\n");
         }
     }
+    fill(running, false);
 
     // Wait for all tasks to terminate
     search_peers.wait();
-    torrent_task.wait();
+    hash_pool.stop();
+
+    if (hash_pool.numHashed() > 0) {
+        char log_buffer[BUFF_LEN];
+        sprintf(log_buffer, "Hashed %d pieces, avg latency: %.2f ms, max queue depth: %d",
+                hash_pool.numHashed(), hash_pool.latency(), hash_pool.maxDepth());
+        ATOMIC_PRINT("%s\n", log_buffer);
+        writeLog(log_buffer);
+    }
 
+    if (!saveResumeData()) ATOMIC_PRINT("Fail to save resume data\n");
+    if (read_cache.numHits() + read_cache.numMisses() > 0) {
+        char log_buffer[BUFF_LEN];
+        sprintf(log_buffer, "Read cache hit rate: %.1f%% (%d of %d pieces)",
+                100 * read_cache.hitRate(), read_cache.numHits(),
+                read_cache.numHits() + read_cache.numMisses());
+        ATOMIC_PRINT("%s\n", log_buffer);
+        writeLog(log_buffer);
+    }
+    if (sendfile_bytes > 0 || mapped_bytes > 0) {
+        char log_buffer[BUFF_LEN];
+        sprintf(log_buffer, "Uploaded without copy: %.2f MB with sendfile, "
+                "%.2f MB from the file mapping", sendfile_bytes / 1024.f / 1024.f,
+                mapped_bytes / 1024.f / 1024.f);
+        ATOMIC_PRINT("%s\n", log_buffer);
+        writeLog(log_buffer);
+    }
+    if (write_cache.numWrites() > 0) {
+        char log_buffer[BUFF_LEN];
+        sprintf(log_buffer, "Wrote back %.2f MB in %d writes",
+                write_cache.writtenBytes() / 1024.f / 1024.f, write_cache.numWrites());
+        ATOMIC_PRINT("%s\n", log_buffer);
+        writeLog(log_buffer);
+    }
     writeLog("Exit program");
     log_file.second << log_buffer;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
 // BTClient private methods
-auto BTClient::getIncomingPeer() -> PeerClient::Ptr
+auto BTClient::getIncomingPeer(double time_out) -> PeerClient::Ptr
 {
     SockAddrIN client_addr;
     socklen_t  addr_sz = sizeof(client_addr);
     memset(&client_addr, 0, addr_sz);
-    if (hasPendingConnections()) {
+    if (hasPendingConnections(time_out)) {
         auto sock = ::accept(tcp_socket.sock(), (SockAddr*)&client_addr, &addr_sz);
+        if (sock == INVALID_SOCKET) return nullptr;
         return PeerClient::Ptr(new PeerClient(meta_info, this, sock, client_addr,
                                               PeerClient::ConnectedState));
     }
@@ -201,110 +360,280 @@ void BTClient::listen(atm_bool& running)
     ATOMIC_PRINT("Waiting for incoming request...\n");
 
     while (running) {
-        // Sleep for a short time, prevent from using 100% CPU
-        this_tbb_thread::sleep(tick_count::interval_t(SLEEP_INTERVAL));
-
-        // When download complete, drop connection from seeders
-        if (is_complete) {
-            for (const auto& peers : connection_list) {
-                if (peers->isSeeder()) peers->stop();
-            }
+        // Wake up at least every interval to notice shutdown
+        auto peer_client = getIncomingPeer(SLEEP_INTERVAL);
+        if (!peer_client) continue;
+
+        // Turn away the connection if we are full
+        if (connections.size() >= max_connections) {
+            peer_client->disconnect();
+            continue;
         }
 
-        // Remove disconnected peer from connection list
-        for (auto iter = connection_list.begin(); iter != connection_list.end();) {
-            if (!(*iter)->isRunning()) {
-                (*iter)->wait();
-                auto peer_iter = find(peer_list.begin(), peer_list.end(),
-                                      (*iter)->getPeerInfo());
-                if (peer_iter != peer_list.end()) peer_iter->is_connected = false;
-                char log_buffer[BUFF_LEN];
-                sprintf(log_buffer, "Disconnected from %s", (*iter)->peekAddress().c_str());
-                ATOMIC_PRINT("%s\n", log_buffer);
-                writeLog(log_buffer);
-                iter = connection_list.erase(iter);
-                continue;
-            }
-            ++iter;
-        }
-
-        if (connection_list.size() > max_connections) continue;
-
-        auto peer_client = getIncomingPeer();
-        if (peer_client && handShake(peer_client.get(), false)) {
+        if (handShake(peer_client.get(), false)) {
             // Skip if connection is duplicate
             if (!addPeerClient(peer_client)) continue;
 
             ATOMIC_PRINT("Accept connection from %s:%d\n",
                          peer_client->peekAddress().c_str(), peer_client->port());
-            peer_client->sendAvailPieces(bit_field);
+            peer_client->sendAvailPieces(havePieces());
 
-            // Start torrent task for this connection
-            torrent_task.run([this, peer_client]() {
-                peer_client->start();
-            });
+            // Hand the connection to the reactor
+            if (!peer_client->start()) peer_client->stop();
         }
     }
 }
 
+void BTClient::serve(atm_bool& running)
+{
+    auto last_tick = chrono::steady_clock::now();
+    while (running) {
+        reactor.poll(TICK_INTERVAL);
+
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - last_tick;
+        if (elapsed.count() < TICK_INTERVAL) continue;
+        last_tick = chrono::steady_clock::now();
+
+        auto snapshot = connectionSnapshot();
+        for (const auto& peer : *snapshot) {
+            // When download complete, drop connection from seeders
+            if (is_complete && peer->isSeeder()) peer->stop();
+
+            if (peer->isRunning()) {
+                peer->onTick();
+            } else {
+                removePeerClient(peer);
+            }
+        }
+    }
+
+    auto snapshot = connectionSnapshot();
+    for (const auto& peer : *snapshot) {
+        peer->stop();
+        removePeerClient(peer);
+    }
+}
+
 void BTClient::initiate(atm_bool& running)
 {
+    // Connects and handshakes to many peers progress side by side on a reactor of
+    // their own, a dead peer only holds up its own slot
+    Reactor dial_reactor;
+    map<SOCKET, Dial> dials;
     while (running && !is_complete) {
-        // Sleep for a short time, prevent from using 100% CPU
-        this_tbb_thread::sleep(tick_count::interval_t(1.0));
-        if (connection_list.size() >= max_connections) continue;
+        dialPeers(dial_reactor, dials);
+        dial_reactor.poll(SLEEP_INTERVAL);
 
-        // Iterate peer list to find available connection
-        for (auto& peer : peer_list) {
-            if (peer.is_connected || !peer.is_available) continue;
-            if (!running || is_complete) break;
+        auto now = chrono::steady_clock::now();
+        vector<SOCKET> expired;
+        for (const auto& entry : dials) {
+            if (entry.second.deadline < now) expired.push_back(entry.first);
+        }
+        for (auto sock : expired) dialFailed(dial_reactor, dials, sock);
+    }
+
+    for (auto& entry : dials) {
+        dial_reactor.remove(entry.first);
+        entry.second.client->disconnect();
+        mutex::scoped_lock lock(peer_list_mtx);
+        entry.second.peer->is_connected = false;
+    }
+}
 
+void BTClient::dialPeers(Reactor& dial_reactor, map<SOCKET, Dial>& dials)
+{
+    auto now = chrono::steady_clock::now();
+    vector<SOCKET> failed;
+    {
+        mutex::scoped_lock lock(peer_list_mtx);
+        for (auto peer = peer_list.begin(); peer != peer_list.end(); ++peer) {
+            if (dials.size() >= MAX_PARALLEL_DIALS ||
+                connections.size() + dials.size() >= max_connections) {
+                break;
+            }
+            if (peer->is_connected || !peer->is_available) continue;
+            if (peer->retry_time > now) continue;
+    
             auto peer_client = make_shared<PeerClient>(meta_info, this);
             if (!peer_client->isValid()) {
                 ATOMIC_PRINT("Fail to create socket for download task!\n");
-                continue;
+                break;
             }
-
-            if (!peer_client->connect(peer.address, peer.port)) {
-                ATOMIC_PRINT("Peer not available: %s:%d, trying %d/%d\n",
-                             peer.address.c_str(), peer.port,
-                             ++peer.trying_times, MAX_TRYING_TIMES);
-                if (peer.trying_times == MAX_TRYING_TIMES) {
-                    ATOMIC_PRINT("Reach max trying number, delete peer from list\n");
-                    peer.is_available = false;
-                }
+            // Counts as connected while the dial is on its way, so it isn't dialed twice
+            peer->is_connected = true;
+            if (!peer_client->connectAsync(peer->address, peer->port)) {
+                dials[peer_client->sock()] = {peer_client, peer, ByteArray(), now, false};
+                failed.push_back(peer_client->sock());
                 continue;
             }
+    
+            SOCKET sock = peer_client->sock();
+            auto deadline = now + chrono::seconds(CONNECT_TIME_OUT);
+            dials[sock] = {peer_client, peer, ByteArray(), deadline, false};
+            dial_reactor.add(sock, Reactor::Writable,
+                [this, &dial_reactor, &dials, sock](int events) {
+                    onDialEvent(dial_reactor, dials, sock, events);
+                });
+        }
+    }
+    for (auto sock : failed) dialFailed(dial_reactor, dials, sock);
+}
 
-            if (handShake(peer_client.get(), true)) {
-                // Save peer_info, skip if connection is duplicate
-                peer.pid = peer_client->getPeerInfo().pid;
-                peer.is_connected = true;
-                peer.trying_times = 0;
-                if (!addPeerClient(peer_client)) continue;
+void BTClient::onDialEvent(Reactor& dial_reactor, map<SOCKET, Dial>& dials,
+                           SOCKET sock, int events)
+{
+    auto iter = dials.find(sock);
+    if (iter == dials.end()) return;
+    auto& dial = iter->second;
+    auto& peer_client = dial.client;
+
+    if (!dial.is_connected) {
+        // Initiator sends its handshake first, it always fits a fresh socket buffer
+        auto handshake_msg = handShakeMessage();
+        if (!peer_client->finishConnect() ||
+            ::send(sock, handshake_msg.data(), handshake_msg.size(), MSG_NOSIGNAL) !=
+            int(handshake_msg.size())) {
+            dialFailed(dial_reactor, dials, sock);
+            return;
+        }
+        dial.is_connected = true;
+        dial.deadline = chrono::steady_clock::now() + chrono::seconds(HANDSHAKE_TIME_OUT);
+        dial_reactor.modify(sock, Reactor::Readable);
 
-                ATOMIC_PRINT("Establish connection to %s:%d\n",
-                             peer.address.c_str(), peer.port);
-                peer_client->sendAvailPieces(bit_field);
+        char log_buffer[BUFF_LEN];
+        sprintf(log_buffer, "HANDSHAKE INIT ip: %s, port: %d",
+                dial.peer->address.c_str(), dial.peer->port);
+        writeLog(log_buffer);
+        return;
+    }
 
-                // Start torrent task for this connection
-                torrent_task.run([this, peer_client]() {
-                    peer_client->start();
-                });
-            }
-            if (connection_list.size() >= max_connections) break;
+    if (!(events & (Reactor::Readable | Reactor::Closed))) return;
+    char buffer[HANDSHAKE_MSG_LEN];
+    int num_bytes = ::recv(sock, buffer, HANDSHAKE_MSG_LEN - dial.buffer.size(), 0);
+    if (num_bytes == 0 || (num_bytes < 0 && !wouldBlock())) {
+        dialFailed(dial_reactor, dials, sock);
+        return;
+    }
+    if (num_bytes < 0) return;
+    dial.buffer.append(buffer, num_bytes);
+    if (dial.buffer.size() < size_t(HANDSHAKE_MSG_LEN)) return;
+
+    char log_buffer[BUFF_LEN];
+    if (dial.buffer.sub(28, 20) != meta_info.info_hash) {
+        ATOMIC_PRINT("Handshake message is invalid, drop connection from %s\n",
+                     dial.peer->address.c_str());
+        sprintf(log_buffer, "HANDSHAKE FAIL ip: %s:%d",
+                dial.peer->address.c_str(), dial.peer->port);
+        writeLog(log_buffer);
+        dialFailed(dial_reactor, dials, sock);
+        return;
+    }
+
+    // A tracker may hand out our own public address, which only the id gives away
+    if (isSelf(dial.buffer.sub(48, 20))) {
+        ATOMIC_PRINT("Connected to ourselves at %s:%d, drop it\n",
+                     dial.peer->address.c_str(), dial.peer->port);
+        {
+            mutex::scoped_lock lock(peer_list_mtx);
+            dial.peer->is_connected = false;
+            dial.peer->is_available = false;
         }
+        dial_reactor.remove(sock);
+        peer_client->disconnect();
+        dials.erase(iter);
+        return;
     }
+
+    // Handshake done, the connection goes over to the main reactor
+    auto client  = peer_client;
+    auto peer    = dial.peer;
+    auto peer_id = dial.buffer.sub(48, 20);
+    dial_reactor.remove(sock);
+    dials.erase(iter);
+
+    client->setPeerInfo({peer_id, peer->address, peer->port, true, false, 0, {}});
+    sprintf(log_buffer, "HANDSHAKE SUCCESS ip: %s:%d, pid: %s",
+            peer->address.c_str(), peer->port, string(peer_id).c_str());
+    writeLog(log_buffer);
+    {
+        mutex::scoped_lock lock(peer_list_mtx);
+        peer->pid = peer_id;
+        peer->trying_times = 0;
+    }
+    // Skip if connection is duplicate
+    if (!addPeerClient(client)) {
+        client->disconnect();
+        return;
+    }
+
+    ATOMIC_PRINT("Establish connection to %s:%d\n", peer->address.c_str(), peer->port);
+    client->sendAvailPieces(havePieces());
+
+    // Hand the connection to the reactor
+    if (!client->start()) client->stop();
+}
+
+void BTClient::dialFailed(Reactor& dial_reactor, map<SOCKET, Dial>& dials, SOCKET sock)
+{
+    auto iter = dials.find(sock);
+    if (iter == dials.end()) return;
+    auto peer = iter->second.peer;
+    dial_reactor.remove(sock);
+    iter->second.client->disconnect();
+    dials.erase(iter);
+
+    mutex::scoped_lock lock(peer_list_mtx);
+    peer->is_connected = false;
+    int shift = min(peer->trying_times++, MAX_BACKOFF_SHIFT);
+    double wait = min(RETRY_INTERVAL * (1 << shift), MAX_RETRY_INTERVAL);
+    peer->retry_time = chrono::steady_clock::now() +
+                       chrono::milliseconds(llong(wait * 1000));
+    ATOMIC_PRINT("Peer not available: %s:%d, retry in %.0fs\n",
+                 peer->address.c_str(), peer->port, wait);
 }
 
 bool BTClient::addPeerClient(PeerClient::Ptr peer_client)
 {
-    mutex::scoped_lock lock(connection_mtx);
-    for (const auto& peer : connection_list) {
-        if (*peer == *peer_client) return false;
+    return connections.add(peer_client) >= 0;
+}
+
+void BTClient::removePeerClient(PeerClient::Ptr peer_client)
+{
+    if (!connections.remove(peer_client)) return;
+
+    reactor.remove(peer_client->sock());
+    peer_client->releaseRequests();
+    picker.removePeer(peer_client->bit_field);
+    peer_client->disconnect();
+
+    {
+        mutex::scoped_lock lock(peer_list_mtx);
+        auto peer_iter = find(peer_list.begin(), peer_list.end(),
+                              peer_client->getPeerInfo());
+        if (peer_iter != peer_list.end()) peer_iter->is_connected = false;
     }
-    connection_list.push_back(peer_client);
-    return true;
+
+    char log_buffer[BUFF_LEN];
+    sprintf(log_buffer, "Disconnected from %s", peer_client->peekAddress().c_str());
+    ATOMIC_PRINT("%s\n", log_buffer);
+    writeLog(log_buffer);
+}
+
+BitField BTClient::havePieces() const
+{
+    spin_mutex::scoped_lock lock(piece_mtx);
+    return bit_field;
+}
+
+int BTClient::numHave() const
+{
+    spin_mutex::scoped_lock lock(piece_mtx);
+    return static_cast<int>(bit_field.count());
+}
+
+auto BTClient::connectionSnapshot() const -> ConnectionRegistry::Snapshot
+{
+    return connections.snapshot();
 }
 
 void BTClient::addPeerInfo(const Peer& peer)
@@ -324,12 +653,7 @@ bool BTClient::handShake(PeerClient* client_sock, bool is_initiator)
     string peer_id;
 
     auto sendMessage = [this, &client_sock]() {
-        string peerid = pid;
-        peerid.resize(20);
-        // 1 + 19 + 8 + 20 + 20
-        auto handshake_msg = string(1, char(19)) + "BitTorrent Protocol" + string(8, '0') +
-                             static_cast<string>(meta_info.info_hash) + peerid;
-        if (!client_sock->write(handshake_msg)) {
+        if (!client_sock->write(handShakeMessage())) {
             ATOMIC_PRINT("ERROR, fail to sendback handshake message!\n");
             return false;
         }
@@ -350,7 +674,7 @@ bool BTClient::handShake(PeerClient* client_sock, bool is_initiator)
         }
         peer_id = buffer.sub(48, 20);
         client_sock->setPeerInfo({peer_id, client_sock->peekAddress(),
-                                 client_sock->port(), true});
+                                 client_sock->port(), true, false, 0, {}});
         return true;
     };
 
@@ -370,6 +694,11 @@ bool BTClient::handShake(PeerClient* client_sock, bool is_initiator)
     else {
         if (!receiveMessge(buffer)) is_success = false;
         if (!sendMessage()) is_success = false;
+        // Answered first, so the dialing side sees our id and stops dialing
+        if (is_success && isSelf(peer_id)) {
+            client_sock->disconnect();
+            is_success = false;
+        }
     }
 
     if (is_success) {
@@ -385,22 +714,58 @@ bool BTClient::handShake(PeerClient* client_sock, bool is_initiator)
     return is_success;
 }
 
+bool BTClient::isSelf(const string& peer_id) const
+{
+    string own_id = pid;
+    own_id.resize(20);
+    return peer_id == own_id;
+}
+
+string BTClient::makePeerId(int16_t port)
+{
+    // Unique per process, so a handshake tells when we dialed ourselves
+    const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+    uniform_int_distribution<int> digit(0, sizeof(digits) - 2);
+    string peer_id = string("bt_client") + ":" + to_string(port) + "-";
+    while (peer_id.size() < 20) peer_id += digits[digit(rd_engine)];
+    return peer_id;
+}
+
+string BTClient::handShakeMessage() const
+{
+    string peerid = pid;
+    peerid.resize(20);
+    // 1 + 19 + 8 + 20 + 20
+    return string(1, char(19)) + "BitTorrent Protocol" + string(8, '0') +
+           static_cast<string>(meta_info.info_hash) + peerid;
+}
+
 void BTClient::broadcastPU(int idx) const
 {
-    for (const auto& peer : connection_list) {
-        peer->sendPieceUpdate(idx);
+    auto snapshot = connectionSnapshot();
+    for (const auto& peer : *snapshot) {
+        peer->queueHave(idx);
+    }
+}
+
+void BTClient::cancelBlock(int idx, int offset) const
+{
+    auto snapshot = connectionSnapshot();
+    for (const auto& peer : *snapshot) {
+        peer->cancelBlock(idx, offset);
     }
 }
 
-bool BTClient::hasIncomingData(const TCPSocket* client_sock) const
+bool BTClient::hasIncomingData(const TCPSocket* client_sock, double time_out) const
 {
     fd_set read_fds;
     FD_ZERO(&read_fds);
     FD_SET(client_sock->sock(), &read_fds);
-    timeval no_block {0, 0};
+    timeval wait_time {static_cast<long>(time_out),
+                       static_cast<long>((time_out - long(time_out)) * 1e6)};
 
     return ::select(client_sock->sock() + 1, &read_fds,
-                    nullptr, nullptr, &no_block) > 0;
+                    nullptr, nullptr, &wait_time) > 0;
 }
 
 int BTClient::recvMsg(const TCPSocket* client_sock, char* buffer,
@@ -408,26 +773,22 @@ int BTClient::recvMsg(const TCPSocket* client_sock, char* buffer,
 {
     if (msg_len > MSG_SIZE_LIMITE) return 0;
 
-    int count = 0;
-    int max_count = time_out == 0 ?
-        1 : static_cast<int>(ceil(time_out / SLEEP_INTERVAL));
-    for (;;) {
-        // Wait for incoming handshake message
-        if (++count > max_count) return 0;
-        this_tbb_thread::sleep(tick_count::interval_t(SLEEP_INTERVAL));
-        if (!hasIncomingData(client_sock)) continue;
-
-        int num_bytes = 0;
-        size_t idx = 0;
-        do {
-            num_bytes = ::recv(client_sock->sock(), buffer + idx, msg_len - num_bytes, 0);
-            if (num_bytes <= 0) return -1;
-            idx += num_bytes;
-        } while (hasIncomingData(client_sock) && idx < msg_len);
-
-        if (idx == msg_len) return 1;
-        return 0;
+    // Block in select until data arrives, give up when time_out is used up
+    auto deadline = chrono::steady_clock::now() +
+                    chrono::duration_cast<chrono::steady_clock::duration>(
+                        chrono::duration<double>(time_out));
+    size_t idx = 0;
+    while (idx < msg_len) {
+        chrono::duration<double> remaining = deadline - chrono::steady_clock::now();
+        if (remaining.count() < 0) return 0;
+        if (!hasIncomingData(client_sock, remaining.count())) continue;
+
+        int num_bytes = ::recv(client_sock->sock(), buffer + idx, msg_len - idx, 0);
+        if (num_bytes <= 0) return -1;
+        idx += num_bytes;
     }
+
+    return 1;
 }
 
 int BTClient::recvMsg(const TCPSocket* client_sock, ByteArray& buffer,
@@ -444,63 +805,433 @@ int BTClient::recvMsg(const TCPSocket* client_sock, string& buffer,
     return recvMsg(client_sock, &buffer[0], msg_len, time_out);
 }
 
-ByteArray BTClient::getBlock(int piece, int offset, int length) const
+llong BTClient::blockPosition(int piece, int offset, int& length) const
+{
+    if (piece < 0 || piece >= meta_info.num_pieces) return -1;
+    // A peer decides offset and length, reject anything outside the piece
+    // before it ends up as the size of a read or sendfile
+    if (offset < 0 || length <= 0 || length > MAX_REQUEST_LENGTH ||
+        llong(offset) + length > llong(pieceLength(piece))) {
+        return -1;
+    }
+    {
+        spin_mutex::scoped_lock lock(piece_mtx);
+        if (!bit_field[piece]) return -1;
+    }
+    return llong(piece)*meta_info.piece_length + offset;
+}
+
+ByteView BTClient::getBlock(int piece, int offset, int length, ByteArray& buffer) const
 {
     // Return empty data if we don't have this piece
-    if (!bit_field[piece]) return ByteArray();
+    llong pos = blockPosition(piece, offset, length);
+    if (pos < 0) return ByteView();
+
+    // Verified but not written back yet
+    if (write_cache.read(piece, offset, length, buffer)) return buffer;
+
+    auto data = download_file.view(pos, length);
+    if (!data.empty()) return data;
+
+    if (!download_file.read(pos, length, buffer)) return ByteView();
+    return buffer;
+}
+
+auto BTClient::getPiece(int idx) -> ReadCache::Piece
+{
+    if (read_cache.capacity() == 0 || download_file.isMapped()) return nullptr;
+    if (idx < 0 || idx >= meta_info.num_pieces) return nullptr;
+    {
+        spin_mutex::scoped_lock lock(piece_mtx);
+        if (!bit_field[idx]) return nullptr;
+    }
+
+    auto piece = read_cache.get(idx);
+    if (piece) return piece;
 
-    mutex::scoped_lock lock(file_mtx);
-    if (offset + length > meta_info.piece_length) {
-        length = meta_info.piece_length - offset;
+    // Read ahead the whole piece, its other blocks are usually requested next
+    auto data = make_shared<ByteArray>();
+    int  length = static_cast<int>(pieceLength(idx));
+    if (!write_cache.read(idx, 0, length, *data) &&
+        !download_file.read(llong(idx)*meta_info.piece_length, length, *data)) {
+        return nullptr;
     }
-    ByteArray data;
-    download_file.read(piece*meta_info.piece_length + offset, length, data);
+    read_cache.put(idx, data);
     return data;
 }
 
-ByteArray BTClient::getBlock(const ByteArray& block_header) const
+ByteView BTClient::getBlock(const ByteArray& block_header, ByteArray& buffer) const
 {
     auto header = reinterpret_cast<const int*>(block_header.data());
-    return getBlock(header[0], header[1], header[2]);
+    return getBlock(header[0], header[1], header[2], buffer);
 }
 
-void BTClient::writeBlock(int piece, int offset, const ByteArray& block_data)
+bool BTClient::loadFile(const vector<TorrentStorage::FileEntry>& file_list)
 {
-    downloaded += block_data.size();
-    download_file.write(piece*meta_info.piece_length + offset, block_data);
+    if (!download_file.open(file_list)) return false;
+    checkFile();
+    return true;
 }
 
-bool BTClient::loadFile(const string& file_name)
+void BTClient::checkFile()
 {
-    download_file.fname = file_name;
-    ifstream ifs(file_name, ios::binary | ios::ate);
+    if (loadResumeData()) return;
+
+    // Read pieces ahead into a ring of buffers and hash them on all worker threads.
+    // Tokens leave the last (serial in order) stage in order, so once token i + n
+    // is admitted token i is done and its buffers can be reused. Each token carries
+    // a run of pieces, which are hashed together by multi-buffer SHA1
+    struct Chunk {
+        ByteArray data[Sha1::MAX_LANES];
+        int  first_idx;
+        int  num_pieces;
+        bool is_valid[Sha1::MAX_LANES];
+    };
+    llong max_buffers = RESUME_BUFF_SIZE / meta_info.piece_length / Sha1::MAX_LANES;
+    int num_tokens = static_cast<int>(min<llong>(
+        2 * task_scheduler_init::default_num_threads(), max(2ll, max_buffers)));
+    vector<Chunk> chunks(num_tokens);
+
+    auto check_start = chrono::steady_clock::now();
+    int   next_idx  = 0;
+    int   num_valid = 0;
+    llong num_bytes = 0;
+    parallel_pipeline(num_tokens,
+        make_filter<void, Chunk*>(filter::serial_in_order,
+            [&](flow_control& fc) -> Chunk* {
+                if (next_idx == meta_info.num_pieces) {
+                    fc.stop();
+                    return nullptr;
+                }
+                auto& chunk = chunks[next_idx / Sha1::MAX_LANES % num_tokens];
+                chunk.first_idx  = next_idx;
+                chunk.num_pieces = min(Sha1::MAX_LANES, meta_info.num_pieces - next_idx);
+                next_idx += chunk.num_pieces;
+                for (auto i = 0; i < chunk.num_pieces; ++i) {
+                    int   idx = chunk.first_idx + i;
+                    llong pos = llong(idx) * meta_info.piece_length;
+                    chunk.data[i].resize(pieceLength(idx));
+                    // Pieces that can't be read are left as not have
+                    chunk.is_valid[i] = download_file.read(pos, chunk.data[i].size(),
+                                                           chunk.data[i].data());
+                }
+                return &chunk;
+            }) &
+        make_filter<Chunk*, Chunk*>(filter::parallel,
+            [this](Chunk* chunk) {
+                const char* pieces[Sha1::MAX_LANES];
+                size_t lengths[Sha1::MAX_LANES];
+                int    indices[Sha1::MAX_LANES];
+                bool   is_valid[Sha1::MAX_LANES];
+                for (auto i = 0; i < chunk->num_pieces; ++i) {
+                    pieces[i]  = chunk->data[i].data();
+                    lengths[i] = chunk->data[i].size();
+                    indices[i] = chunk->first_idx + i;
+                }
+                checkPieces(pieces, lengths, indices, chunk->num_pieces, is_valid);
+                for (auto i = 0; i < chunk->num_pieces; ++i) {
+                    chunk->is_valid[i] = chunk->is_valid[i] && is_valid[i];
+                }
+                return chunk;
+            }) &
+        make_filter<Chunk*, void>(filter::serial_in_order,
+            [&](Chunk* chunk) {
+                for (auto i = 0; i < chunk->num_pieces; ++i) {
+                    num_bytes += chunk->data[i].size();
+                    if (!chunk->is_valid[i]) continue;
+                    markPiece(chunk->first_idx + i);
+                    ++num_valid;
+                }
+            })
+    );
 
-    if (!ifs) return false;
-    download_file.fsize = ifs.tellg();
-    ifs.seekg(0);   // Set input position to start
+    chrono::duration<float> check_time = chrono::steady_clock::now() - check_start;
+    float seconds = max(check_time.count(), 1e-6f);
+    char log_buffer[BUFF_LEN];
+    sprintf(log_buffer, "Resume check: %d/%d pieces valid in %.2fs, "
+            "%.1f pieces/s, %.1f MB/s, SHA1: %s", num_valid, meta_info.num_pieces,
+            seconds, meta_info.num_pieces / seconds, num_bytes / 1024.f / 1024.f / seconds,
+            Sha1::implName());
+    ATOMIC_PRINT("%s\n", log_buffer);
+    writeLog(log_buffer);
+}
 
-    // Check hash
-    ByteArray piece(meta_info.piece_length);
-    int idx = 0;
-    while (++idx < meta_info.num_pieces) {
-        ifs.read(piece.data(), piece.size());
-        validatePiece(piece, idx - 1);
-    };
-    // Last piece
-    piece.resize(meta_info.length % meta_info.piece_length);
-    ifs.read(piece.data(), piece.size());
-    validatePiece(piece, idx - 1);
+bool BTClient::loadResumeData()
+{
+    ResumeData resume;
+    if (!resume.load(save_name + ".resume", meta_info.num_pieces)) return false;
+    if (resume.info_hash != meta_info.info_hash ||
+        resume.file_size != download_file.size() ||
+        resume.mtime != download_file.modifiedTime()) {
+        ATOMIC_PRINT("Resume data is outdated, checking whole file\n");
+        return false;
+    }
+
+    vector<int> have_piece;
+    for (auto idx = 0; idx < meta_info.num_pieces; ++idx) {
+        if (resume.bit_field[idx]) have_piece.push_back(idx);
+    }
+    // Spot check, any mismatch means the file was changed behind our back
+    vector<int> samples(have_piece);
+    shuffle(samples, rd_engine);
+    samples.resize(min<size_t>(samples.size(), max(resume_samples, 0)));
+    ByteArray piece;
+    for (auto idx : samples) {
+        if (!download_file.read(llong(idx)*meta_info.piece_length, pieceLength(idx), piece) ||
+            !checkPiece(piece.data(), piece.size(), idx)) {
+            ATOMIC_PRINT("Resume data spot check failed, checking whole file\n");
+            return false;
+        }
+    }
+
+    for (auto idx : have_piece) markPiece(idx);
+
+    char log_buffer[BUFF_LEN];
+    sprintf(log_buffer, "Resume data accepted: %d/%d pieces, %d spot checked",
+            (int)have_piece.size(), meta_info.num_pieces, (int)samples.size());
+    ATOMIC_PRINT("%s\n", log_buffer);
+    writeLog(log_buffer);
 
     return true;
 }
 
-bool BTClient::validatePiece(const ByteArray& piece, int idx)
+bool BTClient::saveResumeData()
+{
+    if (!download_file.isOpen()) return false;
+
+    // Every piece in the bitfield taken here is in the write cache or on disk,
+    // write the cached ones back before claiming them
+    auto have_pieces = havePieces();
+    if (!write_cache.flush()) return false;
+    // Mapped pages must reach the file before its modification time is taken
+    if (download_file.isMapped()) download_file.flush(0, download_file.size(), true);
+
+    ResumeData resume;
+    resume.info_hash = meta_info.info_hash;
+    resume.bit_field = have_pieces;
+    resume.file_size = download_file.size();
+    resume.mtime     = download_file.modifiedTime();
+    return resume.save(save_name + ".resume");
+}
+
+void BTClient::autoSave(atm_bool& running)
+{
+    auto last_save = chrono::steady_clock::now();
+    int saved_count = numHave();
+    while (running) {
+        this_tbb_thread::sleep(tick_count::interval_t(1.0));
+
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - last_save;
+        if (elapsed.count() < RESUME_SAVE_INTERVAL) continue;
+        last_save = chrono::steady_clock::now();
+
+        // Only rewrite when we have got new pieces since last time
+        int have_count = numHave();
+        if (have_count == saved_count) continue;
+        if (saveResumeData()) saved_count = have_count;
+    }
+}
+
+void BTClient::announce(atm_bool& running)
+{
+    vector<Tracker::Ptr> trackers;
+    for (const auto& url : meta_info.announce_list) {
+        auto tracker = Tracker::create(url);
+        if (!tracker) continue;
+        tracker->setTimeOut(TRACKER_TIME_OUT);
+        if (auto udp_tracker = dynamic_cast<UdpTracker*>(tracker.get())) {
+            udp_tracker->setRetransmit(UDP_RETRANSMIT_BASE, UDP_RETRANSMIT_TRIES);
+        }
+        trackers.push_back(move(tracker));
+    }
+    if (trackers.empty()) return;
+
+    AnnounceRequest request;
+    request.info_hash = meta_info.info_hash;
+    request.peer_id   = pid;
+    request.port      = ntohs(listen_port);
+    request.num_want  = NUM_WANT;
+    request.event     = AnnounceRequest::Started;
+
+    bool was_complete  = is_complete;
+    bool has_announced = false;
+    int  retry_wait    = TRACKER_RETRY_INTERVAL;
+    auto next_announce = chrono::steady_clock::now();
+    AnnounceResponse response;
+    while (running) {
+        if (is_complete && !was_complete) {
+            // Completed is only sent once the tracker has seen started
+            was_complete = true;
+            if (has_announced) {
+                request.event = AnnounceRequest::Completed;
+                next_announce = chrono::steady_clock::now();
+            }
+        }
+        if (chrono::steady_clock::now() < next_announce) {
+            this_tbb_thread::sleep(tick_count::interval_t(1.0));
+            continue;
+        }
+
+        int wait_time = retry_wait;
+        if (announceTo(trackers, request, response)) {
+            has_announced = true;
+            request.event = AnnounceRequest::None;
+            addTrackerPeers(response.peers);
+            wait_time  = response.interval > 0 ? response.interval : DEFAULT_ANNOUNCE_INTERVAL;
+            wait_time  = max(wait_time, max(response.min_interval, MIN_ANNOUNCE_INTERVAL));
+            retry_wait = TRACKER_RETRY_INTERVAL;
+        } else {
+            retry_wait = min(retry_wait * 2, MAX_TRACKER_RETRY_INTERVAL);
+        }
+        next_announce = chrono::steady_clock::now() + chrono::seconds(wait_time);
+    }
+
+    // Let the tracker drop us from its swarm, without holding up the exit
+    if (has_announced) {
+        request.event = AnnounceRequest::Stopped;
+        trackers.front()->setTimeOut(STOPPED_TIME_OUT);
+        trackers.front()->announce(request, response);
+    }
+}
+
+bool BTClient::announceTo(vector<Tracker::Ptr>& trackers, AnnounceRequest& request,
+                          AnnounceResponse& response)
+{
+    request.uploaded   = uploaded;
+    request.downloaded = downloaded;
+    request.left       = 0;
+    auto have_pieces = havePieces();
+    for (auto idx = 0; idx < meta_info.num_pieces; ++idx) {
+        if (!have_pieces[idx] && picker.priority(idx) != PiecePicker::Skip) {
+            request.left += pieceLength(idx);
+        }
+    }
+
+    char log_buffer[BUFF_LEN];
+    for (auto iter = trackers.begin(); iter != trackers.end(); ++iter) {
+        auto& tracker = *iter;
+        if (!tracker->announce(request, response)) {
+            snprintf(log_buffer, BUFF_LEN, "Announce to %s failed: %s",
+                     tracker->url().c_str(), tracker->error().c_str());
+            writeLog(log_buffer);
+            continue;
+        }
+
+        snprintf(log_buffer, BUFF_LEN, "Announce to %s: %d peers, interval %ds",
+                 tracker->url().c_str(), (int)response.peers.size(), response.interval);
+        ATOMIC_PRINT("%s\n", log_buffer);
+        writeLog(log_buffer);
+        // The tracker that answered is tried first next time (BEP 12)
+        rotate(trackers.begin(), iter, iter + 1);
+        return true;
+    }
+    return false;
+}
+
+void BTClient::addTrackerPeers(const vector<PeerEndpoint>& peers)
+{
+    // Addresses are formatted into a stack buffer and compared there, a new peer
+    // list entry is the only string made and it fits the small string buffer
+    char address[INET_ADDRSTRLEN];
+    mutex::scoped_lock lock(peer_list_mtx);
+    for (const auto& endpoint : peers) {
+        in_addr ip;
+        ip.s_addr = endpoint.ip;
+        ::inet_ntop(AF_INET, &ip, address, INET_ADDRSTRLEN);
+
+        // Ports keep network byte order, as connect expects them. Only a bound
+        // local address and loopback are caught here, our public address is
+        // dropped once its handshake shows our own peer id
+        bool is_self = endpoint.port == listen_port &&
+            (local_addr == address || strcmp(address, "127.0.0.1") == 0);
+        bool is_known = any_of(peer_list.begin(), peer_list.end(), [&](const Peer& peer) {
+            return peer.port == endpoint.port && peer.address == address;
+        });
+        if (is_self || is_known || endpoint.port == 0) continue;
+
+        peer_list.push_back({"", address, endpoint.port, false, true, 0, {}});
+    }
+}
+
+void BTClient::pieceHashed(HashPool::Job& job, bool is_valid)
 {
-    ByteArray sha1(20);
-    SHA1((uchar*)piece.data(), piece.size(), (uchar*)sha1.data());
-    if (sha1 == meta_info.sha1_vec[idx]) {
+    int idx = job.idx;
+    if (!is_valid) {
+        // Corrupted, let it be downloaded again
+        picker.release(idx);
+        assembly.recycle(move(job.data));
+        return;
+    }
+
+    // Cached before it is marked, so whoever sees the piece can read it back. A
+    // piece that can't be written is downloaded again rather than announced
+    if (!write_cache.add(idx, move(job.data))) {
+        cerr << "Fail to write piece " << idx << " to " << save_name << endl;
+        picker.release(idx);
+        return;
+    }
+    markPiece(idx);
+    broadcastPU(idx);
+
+    int piece_width = to_string(meta_info.num_pieces).size();
+    int data_width  = to_string(meta_info.length / 0x100000).size() + 3;
+    int num_wanted  = max(picker.numWanted(), 1);
+    int num_missing = picker.numMissing();
+    float dn_mb = downloaded / 1024.f / 1024.f;
+    float up_mb = uploaded   / 1024.f / 1024.f;
+
+    ATOMIC_PRINT("Piece %*d from %s, progress: %5.2f%%, "
+                 "downloaded: %*.2f MB, uploaded: %*.2f MB\n",
+                 piece_width, idx, job.from.c_str(),
+                 100.0 * (num_wanted - num_missing) / num_wanted,
+                 data_width, dn_mb, data_width, up_mb);
+
+    char log_buffer[BUFF_LEN];
+    sprintf(log_buffer, "HASH piece: %d, queue depth: %d, avg latency: %.2f ms, "
+            "dirty: %.1f KB", idx, hash_pool.depth(), hash_pool.latency(),
+            write_cache.dirtyBytes() / 1024.f);
+    writeLog(log_buffer);
+
+    // Time to first frame, a consumer at the cursor has data to play from now on
+    if (picker.isStreaming() && available(cursor()) > 0 &&
+        !first_ready.compare_and_swap(true, false)) {
+        chrono::duration<float> ready_time = chrono::steady_clock::now() - run_start;
+        sprintf(log_buffer, "First data at cursor %lld ready after %.3fs",
+                cursor(), ready_time.count());
+        ATOMIC_PRINT("%s\n", log_buffer);
+        writeLog(log_buffer);
+    }
+
+    if (num_missing == 0) {
+        if (!write_cache.flush()) {
+            cerr << "Fail to write back pieces to " << save_name << endl;
+        }
+        ATOMIC_PRINT("Download complete, now seeding. Press q/Q to quit\n");
+        is_complete = true;
+    }
+}
+
+bool BTClient::checkPiece(const char* piece, size_t length, int idx) const
+{
+    return Sha1::hash(piece, length) == meta_info.sha1_vec[idx];
+}
+
+void BTClient::checkPieces(const char* const pieces[], const size_t lengths[],
+                           const int indices[], int n, bool is_valid[]) const
+{
+    vector<ByteArray> digests(n, ByteArray(Sha1::DIGEST_LEN));
+    vector<char*> digest_ptrs(n);
+    for (auto i = 0; i < n; ++i) digest_ptrs[i] = digests[i].data();
+    Sha1::hashMany(pieces, lengths, n, digest_ptrs.data());
+
+    for (auto i = 0; i < n; ++i) is_valid[i] = digests[i] == meta_info.sha1_vec[indices[i]];
+}
+
+void BTClient::markPiece(int idx)
+{
+    {
+        spin_mutex::scoped_lock lock(piece_mtx);
         bit_field[idx] = 1;
-        pieces_status[idx] = 1;
     }
-    return bit_field[idx];
-}
\ No newline at end of file
+    picker.complete(idx);
+}
@@ -0,0 +1,68 @@
+#include "connection_registry.h"
+
+using namespace std;
+using namespace tbb;
+using namespace cls;
+
+ConnectionRegistry::ConnectionRegistry()
+    : current(make_shared<vector<PeerClient::Ptr>>())
+{
+    num_connections = 0;
+}
+
+int ConnectionRegistry::add(const PeerClient::Ptr& peer_client)
+{
+    mutex::scoped_lock lock(writer_mtx);
+    const auto& info = peer_client->getPeerInfo();
+    auto peer_key = key(info.pid, info.address);
+    if (index.count(peer_key)) return -1;
+
+    int slot = 0;
+    if (free_slots.empty()) {
+        slot = static_cast<int>(slots.size());
+        slots.push_back(peer_client);
+    } else {
+        slot = free_slots.back();
+        free_slots.pop_back();
+        slots[slot] = peer_client;
+    }
+    index[peer_key] = slot;
+    ++num_connections;
+
+    publish();
+    return slot;
+}
+
+bool ConnectionRegistry::remove(const PeerClient::Ptr& peer_client)
+{
+    mutex::scoped_lock lock(writer_mtx);
+    const auto& info = peer_client->getPeerInfo();
+    auto iter = index.find(key(info.pid, info.address));
+    if (iter == index.end() || slots[iter->second] != peer_client) return false;
+
+    slots[iter->second].reset();
+    free_slots.push_back(iter->second);
+    index.erase(iter);
+    --num_connections;
+
+    publish();
+    return true;
+}
+
+bool ConnectionRegistry::contains(const string& pid, const string& address) const
+{
+    mutex::scoped_lock lock(writer_mtx);
+    return index.count(key(pid, address)) != 0;
+}
+
+void ConnectionRegistry::publish()
+{
+    // Caller holds writer_mtx. The copy is built before the store, so readers only
+    // contend on the pointer swap. Readers still on the old snapshot keep it alive
+    auto snapshot = make_shared<vector<PeerClient::Ptr>>();
+    snapshot->reserve(num_connections);
+    for (const auto& peer : slots) {
+        if (peer) snapshot->push_back(peer);
+    }
+    atomic_store(&current, Snapshot(move(snapshot)));
+}
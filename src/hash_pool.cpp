@@ -0,0 +1,92 @@
+#include "sha1.h"
+#include "hash_pool.h"
+
+using namespace std;
+using namespace tbb;
+using namespace cls;
+
+void HashPool::start(int workers_num, size_t capacity, CheckFunc check, DoneFunc done)
+{
+    check_func = check;
+    done_func  = done;
+    max_depth  = 0;
+    num_hashed = 0;
+    job_queue.set_capacity(capacity);
+
+    num_workers = workers_num;
+    for (auto i = 0; i < num_workers; ++i) {
+        workers.run([this]() { work(); });
+    }
+}
+
+void HashPool::stop()
+{
+    if (num_workers == 0) return;
+
+    // One empty job per worker, queued behind the real ones
+    for (auto i = 0; i < num_workers; ++i) job_queue.push(nullptr);
+    workers.wait();
+    num_workers = 0;
+}
+
+void HashPool::submit(int idx, ByteArray&& data, const string& from)
+{
+    Job* job = new Job {idx, move(data), from, sys_clock::now()};
+    if (num_workers > 0 && job_queue.try_push(job)) {
+        int queued = depth();
+        for (int seen = max_depth; queued > seen; seen = max_depth) {
+            max_depth.compare_and_swap(queued, seen);
+        }
+        return;
+    }
+
+    // Queue is full, do the work here
+    finish(&job, 1);
+    delete job;
+}
+
+double HashPool::latency() const
+{
+    spin_mutex::scoped_lock lock(stat_mtx);
+    return num_hashed == 0 ? 0 : total_latency / num_hashed;
+}
+
+void HashPool::work()
+{
+    Job* jobs[Sha1::MAX_LANES];
+    bool is_running = true;
+    while (is_running) {
+        job_queue.pop(jobs[0]);
+        if (!jobs[0]) return;
+
+        // Don't wait for a full batch, only take what is already there
+        int num_jobs = 1;
+        while (num_jobs < Sha1::MAX_LANES && job_queue.try_pop(jobs[num_jobs])) {
+            if (!jobs[num_jobs]) {
+                is_running = false;
+                break;
+            }
+            ++num_jobs;
+        }
+
+        finish(jobs, num_jobs);
+        for (auto i = 0; i < num_jobs; ++i) delete jobs[i];
+    }
+}
+
+void HashPool::finish(Job* const jobs[], int num_jobs)
+{
+    bool is_valid[Sha1::MAX_LANES];
+    check_func(jobs, num_jobs, is_valid);
+
+    auto now = sys_clock::now();
+    {
+        spin_mutex::scoped_lock lock(stat_mtx);
+        for (auto i = 0; i < num_jobs; ++i) {
+            chrono::duration<double, milli> elapsed = now - jobs[i]->queued;
+            total_latency += elapsed.count();
+            ++num_hashed;
+        }
+    }
+    for (auto i = 0; i < num_jobs; ++i) done_func(*jobs[i], is_valid[i]);
+}
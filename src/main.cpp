@@ -1,3 +1,4 @@
+#include <csignal>
 #include <clany/dyn_bitset.hpp>
 #include "bt_client.h"
 #include "setup.hpp"
@@ -15,8 +16,46 @@ TRY_BEGIN
     CmdArgs bt_args;
     parseArgs(bt_args, argc, argv);
 
+#ifndef _WIN32
+    // A peer closing its end must not kill us while a send is in flight
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    auto alloc_mode = FileStorage::AllocReserve;
+    if (bt_args.alloc_mode == "full") {
+        alloc_mode = FileStorage::AllocFull;
+    } else if (bt_args.alloc_mode == "sparse") {
+        alloc_mode = FileStorage::AllocSparse;
+    } else if (!bt_args.alloc_mode.empty() && bt_args.alloc_mode != "reserve") {
+        cerr << "Unknown preallocation mode: " << bt_args.alloc_mode << endl;
+        exit(1);
+    }
+
+    vector<PiecePicker::Priority> file_priority;
+    stringstream levels(bt_args.file_priority);
+    for (string level; getline(levels, level, ',');) {
+        if (level == "skip") {
+            file_priority.push_back(PiecePicker::Skip);
+        } else if (level == "normal") {
+            file_priority.push_back(PiecePicker::Normal);
+        } else if (level == "high") {
+            file_priority.push_back(PiecePicker::High);
+        } else {
+            cerr << "Unknown file priority: " << level << endl;
+            exit(1);
+        }
+    }
+
     BTClient bt_client(bt_args.id, bt_args.ip, bt_args.port);
-    if (!bt_client.setTorrent(bt_args.torrent_file, bt_args.save_file)) {
+    bt_client.setStorageMode(bt_args.use_mmap);
+    bt_client.setResumeCheck(bt_args.resume_check);
+    bt_client.setFilePriority(file_priority);
+    bt_client.setMaxConnection(bt_args.max_conn);
+    bt_client.setRequestWindow(bt_args.req_window);
+    bt_client.setStreaming(bt_args.stream_window);
+    bt_client.setWriteCache(size_t(max(bt_args.write_cache, 0)) * 1024 * 1024);
+    bt_client.setReadCache(size_t(max(bt_args.read_cache, 0)) * 1024 * 1024);
+    if (!bt_client.setTorrent(bt_args.torrent_file, bt_args.save_file, alloc_mode)) {
         cerr << "Input torrent file is invalid!" << endl;
         exit(1);
     };
@@ -1,4 +1,5 @@
-#include <openssl/sha.h>
+#include <limits>
+#include "sha1.h"
 #include "metainfo.h"
 
 using namespace std;
@@ -6,150 +7,126 @@ using namespace cls;
 
 bool MetaInfoParser::parse(const ByteArray& data, MetaInfo& meta_info)
 {
-    if (data.empty()) return false;
-
     clear();
-    file_data = data;
-    idx = 0;
-
-    if (parseDictionry(meta_dict)) {
-        fillMetaInfo(meta_dict, meta_info);
-        return true;
+    if (!tree.parse(data)) {
+        err_msg = tree.error();
+        return false;
     }
-    return false;
+    return fillMetaInfo(tree.root(), meta_info);
 }
 
 void MetaInfoParser::clear()
 {
-    file_data.clear();
-    info_data.clear();
-    meta_dict.clear();
+    tree.clear();
+    err_msg.clear();
 }
 
-bool MetaInfoParser::parseString(string& str)
+namespace {
+// Reject names that would escape the download directory
+bool isSafeName(const string& name)
 {
-    char c = file_data[idx];
-    if (c < '0' || c > '9') return false;
-
-    string size_str;
-    while ((c = file_data[idx++]) != ':') {
-        size_str.push_back(c);
-    };
-
-    int size = stoi(size_str);
-    str = file_data.sub(idx, size);
-    idx += size;
-
-    return true;
+    return !name.empty() && name != "." && name != ".." &&
+           name.find('/') == string::npos && name.find('\\') == string::npos;
 }
+} // Unnamed namespace
 
-bool MetaInfoParser::parseInteger(llong& number)
+bool MetaInfoParser::fillMetaInfo(const BencodeTree::Node& root, MetaInfo& meta_info)
 {
-    if (file_data[idx] != 'i') return false;
-    ++idx;
-
-    bool is_negative = false;
-    if (file_data[idx] == '-') {
-        is_negative = true;
-        ++idx;
+    auto info         = root["info"];
+    auto name         = info["name"];
+    auto piece_length = info["piece length"];
+    auto pieces       = info["pieces"];
+    if (!info.isDict() || !name.isBytes() ||
+        !piece_length.isInteger() || !pieces.isBytes()) {
+        err_msg = "missing or mistyped field in info dictionary";
+        return false;
+    }
+    if (!isSafeName(name.str())) {
+        err_msg = "invalid torrent name";
+        return false;
+    }
+    meta_info.name = name.str();
+    if (!fillFiles(info, meta_info)) return false;
+
+    if (meta_info.length <= 0 || piece_length.integer() <= 0 ||
+        piece_length.integer() > numeric_limits<int>::max() ||
+        pieces.bytes().size() % SHA1_LENGTH != 0 ||
+        llong(pieces.bytes().size() / SHA1_LENGTH) !=
+        (meta_info.length + piece_length.integer() - 1) / piece_length.integer()) {
+        err_msg = "piece hashes don't match file length";
+        return false;
     }
 
-    string num_str;
-    char c;
-    while ((c = file_data[idx++]) != 'e') {
-        if (c < '0' || c > '9') return false;
-        num_str.push_back(c);
-    };
-    number = is_negative ? -stoll(num_str) : stoll(num_str);
-
-    return true;
-}
-
-// Put all list content in a string without parsing
-bool MetaInfoParser::parseList(string& str)
-{
-    if (file_data[idx] != 'l') return false;
-    int start_idx = ++idx;
-
-    int e_occur = 1;
-    while (e_occur) {
-        char c = file_data[idx];
-        if (c == 'd' || c == 'l') {
-            ++idx;
-            ++e_occur;
-        } else if (c == 'e') {
-            ++idx;
-            --e_occur;
-        } else if (c == 'i') {
-            llong num;
-            parseInteger(num);
-        } else {
-            string tmp;
-            parseString(tmp);
+    meta_info.announce     = root["announce"].str();
+    meta_info.announce_list.clear();
+    auto tiers = root["announce-list"];
+    for (auto i = 0u; i < tiers.size(); ++i) {
+        for (auto j = 0u; j < tiers.at(i).size(); ++j) {
+            if (tiers.at(i).at(j).isBytes()) {
+                meta_info.announce_list.push_back(tiers.at(i).at(j).str());
+            }
         }
     }
-    int len = idx - 1 - start_idx; // omit last 'e'
-    str = file_data.sub(start_idx, len);
+    if (meta_info.announce_list.empty() && !meta_info.announce.empty()) {
+        meta_info.announce_list.push_back(meta_info.announce);
+    }
+    meta_info.num_pieces   = pieces.bytes().size() / SHA1_LENGTH;
+    meta_info.piece_length = static_cast<int>(piece_length.integer());
+    meta_info.info_hash    = Sha1::hash(info.raw().data(), info.raw().size());
 
+    auto sha1 = pieces.bytes();
+    meta_info.sha1_vec.clear();
+    meta_info.sha1_vec.reserve(meta_info.num_pieces);
+    for (auto i = 0u; i < sha1.size(); i += SHA1_LENGTH) {
+        meta_info.sha1_vec.push_back(sha1.sub(i, SHA1_LENGTH).toByteArray());
+    }
     return true;
 }
 
-bool MetaInfoParser::parseDictionry(Dict& dict)
+bool MetaInfoParser::fillFiles(const BencodeTree::Node& info, MetaInfo& meta_info)
 {
-    if (file_data[idx] != 'd') return false;
-
-    ++idx;
-    do {
-        if (file_data[idx] == 'e') {
-            ++idx;
-            break;
-        }
-
-        string key;
-        if(!parseString(key)) return false;
-
-        if (key == "info") {
-            size_t info_begin = idx;
-            Dict info_dict;
-            parseDictionry(info_dict);
-            size_t info_len = idx - info_begin;
-            info_data = file_data.sub(info_begin, info_len);
-
-            if (file_data[idx] != 'e') return false;
-            dict.insert(info_dict.begin(), info_dict.end());
-
-            return true;
+    meta_info.files.clear();
+    meta_info.length = 0;
+
+    auto length = info["length"];
+    auto files  = info["files"];
+    meta_info.is_multi_file = files.valid();
+    if (!meta_info.is_multi_file) {
+        if (!length.isInteger() || length.integer() <= 0) {
+            err_msg = "missing or invalid file length";
+            return false;
         }
+        meta_info.length = length.integer();
+        meta_info.files.push_back({meta_info.name, meta_info.length, 0});
+        return true;
+    }
 
-        string name;
-        llong  number;
-        string list;
-        if (parseString(name)) {
-            dict.insert({key, name});
-        } else if (parseInteger(number)) {
-            dict.insert({key, to_string(number)});
-        } else if (parseList(list)) {
-            dict.insert({key, list});
-        } else {
+    if (length.valid() || !files.isList() || files.size() == 0) {
+        err_msg = "invalid file list";
+        return false;
+    }
+    meta_info.files.reserve(files.size());
+    for (auto i = 0u; i < files.size(); ++i) {
+        auto file_length = files.at(i)["length"];
+        auto path        = files.at(i)["path"];
+        if (!file_length.isInteger() || file_length.integer() < 0 ||
+            file_length.integer() > numeric_limits<llong>::max() - meta_info.length ||
+            !path.isList() || path.size() == 0) {
+            err_msg = "invalid entry " + to_string(i) + " in file list";
             return false;
         }
-    } while (idx < file_data.size());
 
+        string file_path;
+        for (auto j = 0u; j < path.size(); ++j) {
+            if (!path.at(j).isBytes() || !isSafeName(path.at(j).str())) {
+                err_msg = "invalid path of entry " + to_string(i) + " in file list";
+                return false;
+            }
+            if (j > 0) file_path += '/';
+            file_path += path.at(j).str();
+        }
+        meta_info.files.push_back({file_path, file_length.integer(), meta_info.length});
+        meta_info.length += file_length.integer();
+    }
     return true;
 }
-
-void MetaInfoParser::fillMetaInfo(const Dict& info_dict,
-                                  MetaInfo& meta_info)
-{
-    meta_info.announce     = info_dict.at("announce");
-    meta_info.length       = stoll(info_dict.at("length"));
-    meta_info.name         = info_dict.at("name");
-    meta_info.num_pieces   = info_dict.at("pieces").size() / 20;
-    meta_info.piece_length = stoi(info_dict.at("piece length"));
-    SHA1((uchar*)info_data.data(), info_data.size(), (uchar*)meta_info.info_hash.data());
-
-    ByteArray sha1(info_dict.at("pieces"));
-    for (auto i = 0u; i < sha1.size(); i += SHA1_LENGTH) {
-        meta_info.sha1_vec.push_back(sha1.sub(i, SHA1_LENGTH));
-    }
-}
\ No newline at end of file
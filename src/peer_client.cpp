@@ -1,3 +1,9 @@
+#ifdef __linux__
+#  include <sys/sendfile.h>
+#endif
+#ifndef _WIN32
+#  include <sys/uio.h>
+#endif
 #include <clany/clany_defs.h>
 #include "peer_client.h"
 #include "bt_client.h"
@@ -13,9 +19,6 @@ using namespace cls;
   cout << buffer; \
 }
 
-#define THREAD_SLEEP(interval) \
-  this_tbb_thread::sleep(tick_count::interval_t((interval)))
-
 namespace {
 struct MsgHeader {
     union {
@@ -42,178 +45,257 @@ struct BlockHeader {
         : piece_idx(idx), offset(begin), length(len) {}
 };
 
-const double SLEEP_INTERVAL   = 0.01;
-const int MSG_SIZE_LIMITE = 1024 * 1024;  // 1mb
-const size_t BLOCK_CHUNK_SIZE = 32 * 1024;   // 32kb
-const size_t BUFF_LEN = 255;
+const double REQUEST_TIME_OUT   = 20.0;
+const double RATE_INTERVAL      = 1.0;
+const int    MAX_REQUEST_WINDOW = 512;
+const int    MAX_READ_PER_EVENT = 4;
+const size_t BUFF_LEN           = 255;
 
 tbb::mutex print_mtx;
+
+// Handlers read fixed fields straight out of the payload, a message too short for
+// them must never get that far
+bool isValidLength(uchar msg_id, size_t length, int num_pieces)
+{
+    switch (msg_id) {
+    case PeerClient::CHOKE:
+    case PeerClient::UNCHOKE:
+    case PeerClient::INTERESTED:
+    case PeerClient::NOT_INTERESTED:
+        return length == 0;
+    case PeerClient::HAVE:
+        return length == 4;
+    case PeerClient::BITFIELD:
+        return length == size_t(num_pieces + 7) / 8;
+    case PeerClient::REQUEST:
+    case PeerClient::CANCEL:
+        return length == 12;
+    case PeerClient::PIECE:
+        return length > 8;
+    default:
+        return true;    // Unknown IDs are dealt with by handleMessage
+    }
+}
 } // Unnamed namespace
 
-void PeerClient::listen()
+bool PeerClient::start()
 {
-    int piece_idx = -1;
-    int last_piece_len = static_cast<int>(torrent_info.length -
-                        (torrent_info.num_pieces - 1) * torrent_info.piece_length);
-    ByteArray piece;
-    int piece_width = to_string(torrent_info.num_pieces).size();
-    int data_width  = to_string(torrent_info.length / 0x100000).size() + 3;
-    while (running && state() != UnconnectedState) {
-        THREAD_SLEEP(SLEEP_INTERVAL);
+    char buffer[BUFF_LEN];
+    sprintf(buffer, "%s:%5d, pid: %s",
+            peer_info.address.c_str(), peer_info.port, peer_info.pid.c_str());
+    addr_id = buffer;
+    addr = addr_id.substr(0, addr_id.find(','));
 
-        if (am_choking) continue;
+    if (!setNonBlocking()) return false;
+    rate_time = sys_clock::now();
 
-        ByteArray buffer;
-        int retval = bt_client->recvMsg(this, buffer, 5, 0);
-        if (!retval) continue;
+    mutex::scoped_lock lock(send_mtx);
+    reactor = &bt_client->reactor;
+    int events = send_queue.empty() ? Reactor::Readable
+                                    : Reactor::Readable | Reactor::Writable;
+    want_write = !send_queue.empty();
+    return reactor->add(handle, events, [this](int ready) { onEvent(ready); });
+}
 
-        if (retval < 0) {
-            stop();
-            break;
-        }
+void PeerClient::onEvent(int events)
+{
+    if (events & Reactor::Readable) readMessages();
+    if (running) flushHaves();
 
-        int   msg_len = *reinterpret_cast<int*>(buffer.data()) - 1;
-        uchar msg_id = buffer[4];
-        if (msg_len < 0 || msg_len > MSG_SIZE_LIMITE) {
-            ATOMIC_PRINT("Message header is invalid\n");
-            stop();
-            break;
-        }
+    if (running && (events & Reactor::Writable)) {
+        mutex::scoped_lock lock(send_mtx);
+        if (!flushQueue()) stop();
+    }
+
+    // Peer hung up and there is nothing left to read
+    if ((events & Reactor::Closed) && !(events & Reactor::Readable)) stop();
+}
+
+void PeerClient::onTick()
+{
+    // Refresh download rate and round trip time the request window is sized by
+    auto now = sys_clock::now();
+    chrono::duration<double> elapsed = now - rate_time;
+    if (elapsed.count() >= RATE_INTERVAL) {
+        double rate = rate_bytes / elapsed.count();
+        down_rate  = down_rate == 0 ? rate : 0.7 * down_rate + 0.3 * rate;
+        if (round_rtt > 0) rtt = round_rtt;
+        round_rtt  = 0;
+        rate_bytes = 0;
+        rate_time  = now;
+    }
+
+    flushHaves();
+    requestPieces();
+}
 
-        buffer.resize(msg_len);
-        if (msg_len != 0 && bt_client->recvMsg(this, buffer, msg_len) < 0) {
+void PeerClient::readMessages()
+{
+    // Take whatever the socket has in one large read, then dispatch every complete
+    // message in place. Reads per event are bounded so others are not starved,
+    // level triggered notification brings us back for the rest
+    for (auto count = 0; count < MAX_READ_PER_EVENT && running; ++count) {
+        char*  tail  = recv_buffer.tail();
+        size_t space = recv_buffer.space();
+        int num_bytes = ::recv(handle, tail, space, 0);
+        if (num_bytes == 0 || (num_bytes < 0 && !wouldBlock())) {
             stop();
-            break;
+            return;
         }
-
-        switch (msg_id) {
-        case PeerClient::CHOKE:
-            sprintf(log_buffer, "MESSAGE CHOKE FROM %s", addr_id.c_str());
-            peer_choking = true;
-            break;
-        case PeerClient::UNCHOKE:
-            sprintf(log_buffer, "MESSAGE UNCHOKE FROM %s", addr_id.c_str());
-            peer_choking = false;
-            break;
-        case PeerClient::INTERESTED:
-            sprintf(log_buffer, "MESSAGE INTERESTED FROM %s", addr_id.c_str());
-            peer_interested = true;
-            sendChoke(am_choking);
-            break;
-        case PeerClient::NOT_INTERESTED:
-            sprintf(log_buffer, "MESSAGE NOT_INTERESTED FROM %s", addr_id.c_str());
-            peer_interested = false;
-            break;
-        case PeerClient::HAVE:
-            updatePiece(buffer, bt_client->needed_piece);
-            break;
-        case PeerClient::BITFIELD:
-            setBitField(buffer, bt_client->needed_piece);
-            break;
-        case PeerClient::REQUEST:
-            handleRequest(buffer);
-            break;
-        case PeerClient::CANCEL:
-            // Cancel download task
-            break;
-        case PeerClient::PIECE:
-            receiveBlock(buffer);
-            piece_idx = *reinterpret_cast<int*>(buffer.data());
-            piece += buffer.sub(8);
-            break;
-        default:
-            ATOMIC_PRINT("Unknown message ID\n");
+        if (num_bytes < 0) return;
+        recv_buffer.produce(num_bytes);
+
+        uchar    msg_id;
+        ByteView payload;
+        auto status = RecvBuffer::Incomplete;
+        while (running &&
+               (status = recv_buffer.next(msg_id, payload)) == RecvBuffer::Complete) {
+            if (!isValidLength(msg_id, payload.size(), torrent_info.num_pieces)) {
+                ATOMIC_PRINT("Message length is invalid\n");
+                stop();
+                return;
+            }
+            handleMessage(msg_id, payload);
+        }
+        if (status == RecvBuffer::Invalid) {
+            ATOMIC_PRINT("Message header is invalid\n");
             stop();
-            break;
+            return;
         }
 
-        bt_client->writeLog(log_buffer);
-
-        if ((piece_idx == torrent_info.num_pieces - 1 &&
-            piece.size() == (size_t)last_piece_len) ||
-            piece.size() == (size_t)torrent_info.piece_length) {
-            if (bt_client->validatePiece(piece, piece_idx)) {
-                bt_client->broadcastPU(piece_idx);
-                int piece_num = bt_client->bit_field.count();
-                float dn_mb = bt_client->downloaded / 1024.f / 1024.f;
-                float up_mb = bt_client->uploaded   / 1024.f / 1024.f;
-
-                ATOMIC_PRINT("Piece %*d from %s, progress: %5.2f%%, "
-                             "downloaded: %*.2f MB, uploaded: %*.2f MB\n",
-                             piece_width, piece_idx, addr.c_str(),
-                             100.0 *  piece_num / torrent_info.num_pieces,
-                             data_width, dn_mb, data_width, up_mb);
-                if (piece_num == torrent_info.num_pieces) {
-                    ATOMIC_PRINT("Download complete, now seeding. Press q/Q to quit\n");
-                    bt_client->is_complete = true;
-                }
-            }
+        // Socket is drained
+        if (size_t(num_bytes) < space) return;
+    }
+}
 
-            piece_idx = -1;
-            piece.clear();
-        }
+void PeerClient::handleMessage(uchar msg_id, const ByteView& buffer)
+{
+    switch (msg_id) {
+    case PeerClient::CHOKE:
+        sprintf(log_buffer, "MESSAGE CHOKE FROM %s", addr_id.c_str());
+        peer_choking = true;
+        // Peer discards our pending requests when it chokes us
+        releaseRequests();
+        break;
+    case PeerClient::UNCHOKE:
+        sprintf(log_buffer, "MESSAGE UNCHOKE FROM %s", addr_id.c_str());
+        peer_choking = false;
+        requestPieces();
+        break;
+    case PeerClient::INTERESTED:
+        sprintf(log_buffer, "MESSAGE INTERESTED FROM %s", addr_id.c_str());
+        peer_interested = true;
+        sendChoke(am_choking);
+        break;
+    case PeerClient::NOT_INTERESTED:
+        sprintf(log_buffer, "MESSAGE NOT_INTERESTED FROM %s", addr_id.c_str());
+        peer_interested = false;
+        break;
+    case PeerClient::HAVE:
+        updatePiece(buffer);
+        break;
+    case PeerClient::BITFIELD:
+        setBitField(buffer);
+        break;
+    case PeerClient::REQUEST:
+        handleRequest(buffer);
+        break;
+    case PeerClient::CANCEL:
+        handleCancel(buffer);
+        break;
+    case PeerClient::PIECE:
+        receiveBlock(buffer);
+        // Top up the window right away instead of waiting for the next tick
+        requestPieces();
+        break;
+    default:
+        ATOMIC_PRINT("Unknown message ID\n");
+        stop();
+        return;
     }
+
+    bt_client->writeLog(log_buffer);
 }
 
-void PeerClient::request()
+void PeerClient::requestPieces()
 {
-    auto blocks_per_piece = torrent_info.piece_length / BLOCK_CHUNK_SIZE;
-    int last_piece_len = static_cast<int>(torrent_info.length -
-                         (torrent_info.num_pieces - 1) * torrent_info.piece_length);
-    auto& p_status = bt_client->pieces_status;
-    auto& idx_vec = bt_client->needed_piece;
+    if (!running || peer_choking || !am_interested) return;
 
-    while (running && state() != UnconnectedState) {
-        THREAD_SLEEP(SLEEP_INTERVAL);
+    // Nothing came back for our oldest request within 20s, give the blocks back
+    // so other peers can request them
+    if (!requests.empty()) {
+        chrono::duration<double> elapsed = sys_clock::now() - requests.front().time;
+        if (elapsed.count() >= REQUEST_TIME_OUT) releaseRequests();
+    }
 
-        if (peer_choking || !am_interested) continue;
+    // Keep the window full, continuing pieces already started (by any peer) before
+    // picking a new one, so requests flow across piece boundaries without a gap.
+    // Near the end blocks other peers are fetching are requested again, whoever
+    // delivers first wins
+    auto& picker   = bt_client->picker;
+    auto& assembly = bt_client->assembly;
+    auto isRequested = [this](int idx, int offset) {
+        return find_if(requests.begin(), requests.end(), [=](const BlockRequest& req) {
+            return req.piece == idx && req.offset == offset;
+        }) != requests.end();
+    };
 
-        // Find a piece to download
-        auto idx_iter = find_if(idx_vec.begin(), idx_vec.end(), [this, &p_status](int idx) {
-            return hasPiece(idx) &&
-                   p_status[idx].compare_and_swap(0, -1) < 0;
-        });
-        if (idx_iter == idx_vec.end()) continue;
-        int idx = *idx_iter;
-
-        // Send download request, handle last piece separately
-        if (idx == torrent_info.num_pieces - 1) {
-            uint iter_num = last_piece_len / BLOCK_CHUNK_SIZE;
-            for (auto i = 0u; i < iter_num; ++i) {
-                requestBlock(idx, i*BLOCK_CHUNK_SIZE, BLOCK_CHUNK_SIZE);
+    int window = requestWindow();
+    while (static_cast<int>(requests.size()) < window) {
+        int idx, offset, length;
+        if (!assembly.reserveBlock(bit_field, false, isRequested, idx, offset, length)) {
+            // Rarest piece this peer has
+            int new_idx = picker.pick(bit_field);
+            if (new_idx >= 0) {
+                assembly.start(new_idx);
+                continue;
             }
-            uint final_len = last_piece_len % BLOCK_CHUNK_SIZE;
-            requestBlock(idx, last_piece_len - final_len, final_len);
-        } else {
-            for (auto i = 0u; i < blocks_per_piece; ++i) {
-                requestBlock(idx, i*BLOCK_CHUNK_SIZE, BLOCK_CHUNK_SIZE);
+            // A streamed piece past its deadline, race its missing blocks here too
+            int late_idx = picker.overdue(bit_field);
+            auto notLate = [&](int piece, int block_offset) {
+                return piece != late_idx || isRequested(piece, block_offset);
+            };
+            bool is_raced = late_idx >= 0 &&
+                assembly.reserveBlock(bit_field, true, notLate, idx, offset, length);
+            if (!is_raced && (!picker.inEndgame() ||
+                !assembly.reserveBlock(bit_field, true, isRequested, idx, offset, length))) {
+                break;
             }
         }
 
-        // Wait until we've got the requested piece, no longer than 20s
-        double time_out = 20.0 / SLEEP_INTERVAL;
-        for (auto count = 0; count < time_out; ++count) {
-            THREAD_SLEEP(SLEEP_INTERVAL);
-            if (p_status[idx] || !running || state() == UnconnectedState) break;
+        if (!requestBlock(idx, offset, length)) {
+            assembly.unrequest(idx, offset);
+            break;
         }
-
-        // Revert piece status if we didn't get that piece
-        p_status[idx].compare_and_swap(-1, 0);
+        requests.push_back({idx, offset, length, sys_clock::now()});
     }
 }
 
-void PeerClient::start()
+int PeerClient::requestWindow() const
 {
-    char buffer[BUFF_LEN];
-    sprintf(buffer, "%s:%5d, pid: %s",
-            peer_info.address.c_str(), peer_info.port, peer_info.pid.c_str());
-    addr_id = buffer;
-    addr = addr_id.substr(0, addr_id.find(','));
+    // Bandwidth-delay product in blocks, doubled so the window can keep growing
+    // while the rate is still ramping up, never below the configured size
+    int bdp = static_cast<int>(2 * down_rate * rtt / PieceAssembly::BLOCK_SIZE) + 1;
+    return min(max(bt_client->request_window, bdp), MAX_REQUEST_WINDOW);
+}
+
+void PeerClient::cancelBlock(int idx, int offset)
+{
+    auto iter = find_if(requests.begin(), requests.end(), [=](const BlockRequest& req) {
+        return req.piece == idx && req.offset == offset;
+    });
+    if (iter == requests.end()) return;
+
+    cancelRequest(iter->piece, iter->offset, iter->length);
+    requests.erase(iter);
+}
 
-    peer_task.run([&]() { listen();  });
-    peer_task.run([&]() { request(); });
-    wait();
-    stop();
+void PeerClient::releaseRequests()
+{
+    for (const auto& req : requests) {
+        bt_client->assembly.unrequest(req.piece, req.offset);
+    }
+    requests.clear();
 }
 
 bool PeerClient::sendChoke(bool choking) const
@@ -269,6 +351,47 @@ bool PeerClient::sendPieceUpdate(int piece) const
     return write(msg);
 }
 
+void PeerClient::queueHave(int piece)
+{
+    {
+        spin_mutex::scoped_lock lock(have_mtx);
+        pending_haves.push_back(piece);
+        // Someone before us has woken the reactor already
+        if (pending_haves.size() > 1) return;
+    }
+
+    // A writable event gets the reactor thread to send the batch
+    mutex::scoped_lock lock(send_mtx);
+    if (reactor && !want_write && state() != UnconnectedState) {
+        want_write = true;
+        reactor->modify(handle, Reactor::Readable | Reactor::Writable);
+    }
+}
+
+void PeerClient::flushHaves()
+{
+    vector<int> pieces;
+    {
+        spin_mutex::scoped_lock lock(have_mtx);
+        pieces.swap(pending_haves);
+    }
+    if (pieces.empty()) return;
+
+    // All pending HAVEs go out as one write, none to a peer having the piece
+    ByteArray msg;
+    msg.reserve(pieces.size() * 9);
+    char log_buffer[BUFF_LEN];
+    for (auto piece : pieces) {
+        if (bit_field[piece]) continue;
+        MsgHeader msg_header {5, HAVE};
+        msg.append(msg_header.data, 5).append(reinterpret_cast<char*>(&piece), sizeof(int));
+
+        sprintf(log_buffer, "MESSAGE HAVE TO %s, piece: %d", addr_id.c_str(), piece);
+        bt_client->writeLog(log_buffer);
+    }
+    if (!msg.empty()) write(msg);
+}
+
 bool PeerClient::sendAvailPieces(const BitField& bit_field) const
 {
     // Do no send if we have no piece
@@ -315,56 +438,265 @@ bool PeerClient::cancelRequest(int piece, int offset, int length) const
     return write(msg);
 }
 
-bool PeerClient::sendBlock(int piece, int offset, const ByteArray& data) const
+bool PeerClient::sendBlock(int piece, int offset, const ByteView& data) const
 {
     MsgHeader   msg_header {9 + static_cast<int>(data.size()), PIECE};
     BlockHeader blk_header {piece, offset, 0};
-    auto msg = ByteArray(msg_header.data, 5) + ByteArray(blk_header.data, 8) + data;
+    OutMessage msg;
+    msg.data.reserve(13 + data.size());
+    msg.data.append(msg_header.data, 5).append(blk_header.data, 8) += data;
+    msg.piece  = piece;
+    msg.offset = offset;
 
     char log_buffer[BUFF_LEN];
     sprintf(log_buffer, "MESSAGE PIECE TO %s, piece: %d, offset: %d, length: %d",
             addr_id.c_str(), piece, offset, (int)data.size());
     bt_client->writeLog(log_buffer);
 
-    return write(msg);
+    return enqueue(move(msg));
+}
+
+bool PeerClient::sendBlock(int piece, int offset, int length,
+                           const ReadCache::Piece& data) const
+{
+    MsgHeader   msg_header {9 + length, PIECE};
+    BlockHeader blk_header {piece, offset, 0};
+    OutMessage msg;
+    msg.data.reserve(13);
+    msg.data.append(msg_header.data, 5).append(blk_header.data, 8);
+    msg.body     = data;
+    msg.body_pos = offset;
+    msg.body_len = length;
+    msg.piece    = piece;
+    msg.offset   = offset;
+
+    char log_buffer[BUFF_LEN];
+    sprintf(log_buffer, "MESSAGE PIECE TO %s, piece: %d, offset: %d, length: %d",
+            addr_id.c_str(), piece, offset, length);
+    bt_client->writeLog(log_buffer);
+
+    return enqueue(move(msg));
+}
+
+bool PeerClient::sendBlockMapped(int piece, int offset, const ByteView& data) const
+{
+    MsgHeader   msg_header {9 + static_cast<int>(data.size()), PIECE};
+    BlockHeader blk_header {piece, offset, 0};
+    OutMessage msg;
+    msg.data.reserve(13);
+    msg.data.append(msg_header.data, 5).append(blk_header.data, 8);
+    // The mapping lives as long as the download, connections are gone before it
+    msg.mapped   = data;
+    msg.body_len = data.size();
+    msg.piece    = piece;
+    msg.offset   = offset;
+
+    char log_buffer[BUFF_LEN];
+    sprintf(log_buffer, "MESSAGE PIECE TO %s, piece: %d, offset: %d, length: %d",
+            addr_id.c_str(), piece, offset, (int)data.size());
+    bt_client->writeLog(log_buffer);
+
+    return enqueue(move(msg));
+}
+
+int PeerClient::sendBlockFile(int piece, int offset, int length, llong file_pos) const
+{
+#ifdef __linux__
+    MsgHeader   msg_header {9 + length, PIECE};
+    BlockHeader blk_header {piece, offset, 0};
+
+    OutMessage msg;
+    msg.data.reserve(13);
+    msg.data.append(msg_header.data, 5).append(blk_header.data, 8);
+    msg.file_pos = file_pos;
+    msg.file_len = length;
+    msg.piece    = piece;
+    msg.offset   = offset;
+
+    char log_buffer[BUFF_LEN];
+    sprintf(log_buffer, "MESSAGE PIECE TO %s, piece: %d, offset: %d, length: %d",
+            addr_id.c_str(), piece, offset, length);
+    bt_client->writeLog(log_buffer);
+
+    return enqueue(move(msg)) ? length : 0;
+#else
+    return -1;
+#endif
+}
+
+bool PeerClient::write(const char* message, size_t n) const
+{
+    OutMessage msg;
+    msg.data.assign(message, message + n);
+    return enqueue(move(msg));
+}
+
+void PeerClient::disconnect()
+{
+    // Make sure no writer is using the descriptor when it is closed
+    mutex::scoped_lock lock(send_mtx);
+    send_queue.clear();
+    // A failed connect leaves the socket unconnected, but still open
+    TCPSocket::disconnect();
+}
+
+bool PeerClient::enqueue(OutMessage&& msg) const
+{
+    mutex::scoped_lock lock(send_mtx);
+    if (state() == UnconnectedState) return false;
+
+    send_queue.push_back(move(msg));
+    if (!flushQueue()) return false;
+
+    // Ask the reactor to tell us when the socket can take the rest
+    if (reactor && !send_queue.empty() && !want_write) {
+        want_write = true;
+        reactor->modify(handle, Reactor::Readable | Reactor::Writable);
+    }
+    return true;
 }
 
-void PeerClient::setBitField(const ByteArray& buffer, const vector<int>& needed_piece)
+bool PeerClient::flushQueue() const
 {
+    while (!send_queue.empty()) {
+        auto& msg = send_queue.front();
+
+        if (msg.sent < msg.data.size() || msg.body_len > 0) {
+            int num_bytes = sendGathered();
+            if (num_bytes < 0) return wouldBlock();
+            consumeSent(num_bytes);
+            continue;
+        }
+
+#ifdef __linux__
+        if (msg.file_len > 0) {
+            const auto& file = bt_client->download_file;
+            FileStorage::Handle file_handle;
+            llong local_pos = 0;
+            ssize_t num_bytes = -1;
+            // Blocks crossing a file boundary can't be spliced from one descriptor
+            if (file.locate(msg.file_pos, msg.file_len, file_handle, local_pos)) {
+                off_t file_off = local_pos;
+                num_bytes = ::sendfile(handle, file_handle, &file_off, msg.file_len);
+                if (num_bytes < 0 && wouldBlock()) return true;
+                if (num_bytes > 0) bt_client->sendfile_bytes += num_bytes;
+            }
+            if (num_bytes <= 0) {
+                // Kernel refused to splice the body (e.g. file system without
+                // sendfile support), finish it through user space
+                ByteArray body;
+                if (!file.read(msg.file_pos, msg.file_len, body)) return false;
+                msg.data += body;
+                msg.file_len = 0;
+                continue;
+            }
+            msg.file_pos += num_bytes;
+            msg.file_len -= num_bytes;
+            continue;
+        }
+#endif
+
+        send_queue.pop_front();
+    }
+
+    // Completely drained, let the reactor stop polling for writability
+    if (reactor && want_write) {
+        want_write = false;
+        reactor->modify(handle, Reactor::Readable);
+    }
+    return true;
+}
+
+int PeerClient::sendGathered() const
+{
+    // In memory parts of the queued messages, up to the first body that has to
+    // come from the file
+    const int MAX_PARTS = 64;
+    pair<const char*, size_t> parts[MAX_PARTS];
+    int num_parts = 0;
+    for (const auto& msg : send_queue) {
+        if (msg.sent < msg.data.size()) {
+            parts[num_parts++] = {msg.data.data() + msg.sent, msg.data.size() - msg.sent};
+        }
+        if (num_parts == MAX_PARTS) break;
+        if (msg.body_len > 0) {
+            const char* body_data = msg.body ? msg.body->data() : msg.mapped.data();
+            parts[num_parts++] = {body_data + msg.body_pos, msg.body_len};
+        }
+        if (num_parts == MAX_PARTS || msg.file_len > 0) break;
+    }
+
+#ifdef _WIN32
+    return ::send(handle, parts[0].first, static_cast<int>(parts[0].second), 0);
+#else
+    iovec iov[MAX_PARTS];
+    for (auto i = 0; i < num_parts; ++i) {
+        iov[i].iov_base = const_cast<char*>(parts[i].first);
+        iov[i].iov_len  = parts[i].second;
+    }
+    msghdr msg_hdr {};
+    msg_hdr.msg_iov    = iov;
+    msg_hdr.msg_iovlen = num_parts;
+    return static_cast<int>(::sendmsg(handle, &msg_hdr, MSG_NOSIGNAL));
+#endif
+}
+
+void PeerClient::consumeSent(size_t num_bytes) const
+{
+    // Advance through the messages in the order sendGathered took them, drop the
+    // ones that are complete
+    while (num_bytes > 0 && !send_queue.empty()) {
+        auto& msg = send_queue.front();
+        auto step = min(num_bytes, msg.data.size() - min(msg.sent, msg.data.size()));
+        msg.sent  += step;
+        num_bytes -= step;
+
+        step = min(num_bytes, msg.body_len);
+        msg.body_pos += step;
+        msg.body_len -= step;
+        num_bytes    -= step;
+
+        if (msg.sent < msg.data.size() || msg.body_len > 0 || msg.file_len > 0) break;
+        send_queue.pop_front();
+    }
+}
+
+void PeerClient::setBitField(const ByteView& buffer)
+{
+    auto& picker = bt_client->picker;
     int bf_sz = torrent_info.num_pieces;
-    bit_field.fromByteArray(bf_sz, buffer);
+    // Replace what a previous bitfield told us, if any
+    picker.removePeer(bit_field);
+    bit_field.fromByteArray(bf_sz, buffer.toByteArray());
+    picker.addPeer(bit_field);
 
     int avail_num = (int)bit_field.count();
     sprintf(log_buffer, "MESSAGE BITFIELD FROM %s, avail: %d, not avail: %d",
             addr_id.c_str(), avail_num, bf_sz - avail_num);
 
-    auto iter = find_if(needed_piece.begin(), needed_piece.end(), [this](int idx) {
-        return bit_field.test(idx);
-    });
-    if (iter != needed_piece.end()) am_interested = true;
+    if (picker.isInteresting(bit_field)) am_interested = true;
 
     sendInterested(am_interested);
 }
 
-void PeerClient::updatePiece(const ByteArray& buffer, const vector<int>& needed_piece)
+void PeerClient::updatePiece(const ByteView& buffer)
 {
     int idx = *reinterpret_cast<const int*>(buffer.data());
-    bit_field[idx] = 1;
+    if (idx < 0 || idx >= torrent_info.num_pieces) return;
 
     sprintf(log_buffer, "MESSAGE HAVE FROM %s, piece: %d", addr_id.c_str(), idx);
 
-    if (!am_interested) {
-        auto iter = find_if(needed_piece.begin(), needed_piece.end(), [this](int idx) {
-            return bit_field.test(idx);
-        });
-        if (iter != needed_piece.end()) {
-            am_interested = true;
-            sendInterested(am_interested);
-        }
+    if (bit_field[idx]) return;
+    bit_field[idx] = 1;
+    bt_client->picker.incAvailability(idx);
+
+    if (!am_interested && bt_client->picker.wants(idx)) {
+        am_interested = true;
+        sendInterested(am_interested);
     }
 }
 
-void PeerClient::handleRequest(const ByteArray& request_msg)
+void PeerClient::handleRequest(const ByteView& request_msg)
 {
     auto blk_header = reinterpret_cast<const int*>(request_msg.data());
     int piece_idx = blk_header[0];
@@ -374,19 +706,70 @@ void PeerClient::handleRequest(const ByteArray& request_msg)
     sprintf(log_buffer, "MESSAGE REQUEST FROM %s, piece: %d, offset: %d, length: %d",
             addr_id.c_str(), piece_idx, offset, length);
 
-    if (!bt_client->bit_field[piece_idx]) {
-        peer_task.run([=]() {
-            cancelRequest(piece_idx, offset, length);
-        });
-    } else {
-        peer_task.run([=]() {
-            auto data = bt_client->getBlock(request_msg);
-            if (sendBlock(piece_idx, offset, data)) bt_client->uploaded += data.size();
-        });
+    llong file_pos = bt_client->blockPosition(piece_idx, offset, length);
+    if (file_pos < 0) {
+        cancelRequest(piece_idx, offset, length);
+        return;
     }
+
+    // Blocks the file has go out without a copy, straight from the file mapping
+    // or spliced from the file with sendfile. The file doesn't have pieces still
+    // in the write cache yet
+    int sent = -1;
+    const auto& file = bt_client->download_file;
+    if (!bt_client->write_cache.contains(piece_idx)) {
+        if (file.isMapped()) {
+            auto data = file.view(file_pos, length);
+            if (!data.empty()) {
+                sent = sendBlockMapped(piece_idx, offset, data) ? length : 0;
+                if (sent > 0) bt_client->mapped_bytes += sent;
+            }
+        } else {
+            sent = sendBlockFile(piece_idx, offset, length, file_pos);
+        }
+    }
+    // Otherwise hot pieces are served from the read cache, the whole piece is read
+    // in on the first request of it
+    if (sent < 0) {
+        auto piece = bt_client->getPiece(piece_idx);
+        if (piece && size_t(offset + length) <= piece->size() &&
+            sendBlock(piece_idx, offset, length, piece)) {
+            sent = length;
+        }
+    }
+    if (sent < 0) {
+        // Fall back to copying the block through user space
+        ByteArray buffer;
+        auto data = bt_client->getBlock(piece_idx, offset, length, buffer);
+        if (data.empty()) return;
+        if (sendBlock(piece_idx, offset, data)) sent = data.size();
+    }
+    if (sent > 0) bt_client->uploaded += sent;
 }
 
-void PeerClient::receiveBlock(const ByteArray& buffer)
+void PeerClient::handleCancel(const ByteView& cancel_msg)
+{
+    auto blk_header = reinterpret_cast<const int*>(cancel_msg.data());
+    int piece_idx = blk_header[0];
+    int offset    = blk_header[1];
+    int length    = blk_header[2];
+
+    sprintf(log_buffer, "MESSAGE CANCEL FROM %s, piece: %d, offset: %d, length: %d",
+            addr_id.c_str(), piece_idx, offset, length);
+
+    // Drop the block if it is still queued, once started it has to go out whole
+    mutex::scoped_lock lock(send_mtx);
+    for (auto iter = send_queue.begin(); iter != send_queue.end(); ++iter) {
+        if (iter->piece != piece_idx || iter->offset != offset || iter->sent > 0) continue;
+        int body_len = static_cast<int>(iter->data.size() + iter->body_len +
+                                        iter->file_len) - 13;
+        bt_client->uploaded -= body_len;
+        send_queue.erase(iter);
+        break;
+    }
+}
+
+void PeerClient::receiveBlock(const ByteView& buffer)
 {
     auto blk_header = reinterpret_cast<const int*>(buffer.data());
     int piece_idx = blk_header[0];
@@ -396,5 +779,28 @@ void PeerClient::receiveBlock(const ByteArray& buffer)
     sprintf(log_buffer, "MESSAGE PIECE FROM %s, piece: %d, offset: %d, length: %d",
             addr_id.c_str(), piece_idx, offset, length);
 
-    bt_client->writeBlock(piece_idx, offset, buffer.sub(8));
+    // Drop blocks we didn't ask for, e.g. answers to requests made before a choke
+    auto req_iter = find_if(requests.begin(), requests.end(),
+        [=](const BlockRequest& req) {
+            return req.piece == piece_idx && req.offset == offset && req.length == length;
+        });
+    if (req_iter == requests.end()) return;
+
+    chrono::duration<double> sample = sys_clock::now() - req_iter->time;
+    round_rtt = round_rtt == 0 ? sample.count() : min(round_rtt, sample.count());
+    rate_bytes += length;
+    requests.erase(req_iter);
+
+    // Another peer may have delivered it first in endgame
+    auto& assembly = bt_client->assembly;
+    auto result = assembly.addBlock(piece_idx, offset, buffer.sub(8));
+    if (result == PieceAssembly::Rejected) return;
+
+    bt_client->downloaded += length;
+    bt_client->cancelBlock(piece_idx, offset);
+
+    // Verified off the reactor thread, we go on reading meanwhile
+    if (result == PieceAssembly::Completed) {
+        bt_client->hash_pool.submit(piece_idx, assembly.take(piece_idx), addr);
+    }
 }
\ No newline at end of file
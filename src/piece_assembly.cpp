@@ -0,0 +1,139 @@
+#include <cstring>
+#include "piece_assembly.h"
+
+using namespace std;
+using namespace tbb;
+using namespace cls;
+
+namespace {
+const size_t MAX_POOL_SIZE = 64;
+} // Unnamed namespace
+
+void PieceAssembly::init(int piece_len, llong total_len)
+{
+    spin_mutex::scoped_lock lock(assembly_mtx);
+    piece_length = piece_len;
+    total_length = total_len;
+    pieces.clear();
+}
+
+void PieceAssembly::start(int idx)
+{
+    spin_mutex::scoped_lock lock(assembly_mtx);
+    if (pieces.count(idx)) return;
+
+    auto& piece = pieces[idx];
+    // Reuse a buffer of a finished piece, no reallocation while blocks arrive
+    if (!pool.empty()) {
+        piece.data = move(pool.back());
+        pool.pop_back();
+    }
+    piece.data.resize(pieceLength(idx));
+    piece.received = BitField(numBlocks(idx));
+    piece.requested.assign(numBlocks(idx), 0);
+}
+
+bool PieceAssembly::reserveBlock(const BitField& peer_has, bool endgame,
+                                 const function<bool(int, int)>& skip,
+                                 int& idx, int& offset, int& length)
+{
+    spin_mutex::scoped_lock lock(assembly_mtx);
+    for (auto& entry : pieces) {
+        if (!peer_has[entry.first]) continue;
+        auto& piece = entry.second;
+        int num_blocks = piece.requested.size();
+        int block = piece.next_block;
+        while (block < num_blocks && (piece.requested[block] || piece.received[block])) {
+            ++block;
+        }
+        piece.next_block = block;
+        if (block == num_blocks) continue;
+
+        ++piece.requested[block];
+        idx    = entry.first;
+        offset = block * BLOCK_SIZE;
+        length = min(BLOCK_SIZE, static_cast<int>(piece.data.size()) - offset);
+        return true;
+    }
+    if (!endgame) return false;
+
+    // Everything is requested, duplicate the blocks still in flight with the
+    // fewest requests so far
+    int best_idx = -1, best_block = 0;
+    for (auto& entry : pieces) {
+        if (!peer_has[entry.first]) continue;
+        auto& piece = entry.second;
+        for (auto block = 0; block < int(piece.requested.size()); ++block) {
+            if (piece.received[block] || skip(entry.first, block * BLOCK_SIZE)) continue;
+            if (best_idx < 0 ||
+                piece.requested[block] < pieces[best_idx].requested[best_block]) {
+                best_idx   = entry.first;
+                best_block = block;
+            }
+        }
+    }
+    if (best_idx < 0) return false;
+
+    auto& piece = pieces[best_idx];
+    ++piece.requested[best_block];
+    idx    = best_idx;
+    offset = best_block * BLOCK_SIZE;
+    length = min(BLOCK_SIZE, static_cast<int>(piece.data.size()) - offset);
+    return true;
+}
+
+void PieceAssembly::unrequest(int idx, int offset)
+{
+    spin_mutex::scoped_lock lock(assembly_mtx);
+    auto iter = pieces.find(idx);
+    if (iter == pieces.end()) return;
+
+    auto& piece = iter->second;
+    int block = offset / BLOCK_SIZE;
+    if (block >= int(piece.requested.size()) || piece.requested[block] == 0) return;
+    if (--piece.requested[block] == 0 && !piece.received[block]) {
+        piece.next_block = min(piece.next_block, block);
+    }
+}
+
+auto PieceAssembly::addBlock(int idx, int offset, const ByteView& data) -> Result
+{
+    spin_mutex::scoped_lock lock(assembly_mtx);
+    auto iter = pieces.find(idx);
+    if (iter == pieces.end() || offset % BLOCK_SIZE != 0) return Rejected;
+
+    auto& piece = iter->second;
+    int block = offset / BLOCK_SIZE;
+    if (block >= int(piece.requested.size()) || piece.received[block] ||
+        offset + data.size() > piece.data.size()) {
+        return Rejected;
+    }
+
+    memcpy(piece.data.data() + offset, data.data(), data.size());
+    piece.received[block] = 1;
+    ++piece.num_received;
+    return piece.num_received == int(piece.requested.size()) ? Completed : Accepted;
+}
+
+ByteArray PieceAssembly::take(int idx)
+{
+    spin_mutex::scoped_lock lock(assembly_mtx);
+    auto iter = pieces.find(idx);
+    if (iter == pieces.end()) return ByteArray();
+
+    auto data = move(iter->second.data);
+    pieces.erase(iter);
+    return data;
+}
+
+void PieceAssembly::recycle(ByteArray&& buffer)
+{
+    spin_mutex::scoped_lock lock(assembly_mtx);
+    if (pool.size() < MAX_POOL_SIZE) pool.push_back(move(buffer));
+}
+
+size_t PieceAssembly::size() const
+{
+    spin_mutex::scoped_lock lock(assembly_mtx);
+    return pieces.size();
+}
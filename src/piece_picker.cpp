@@ -0,0 +1,274 @@
+#include "piece_picker.h"
+
+using namespace std;
+using namespace tbb;
+using namespace cls;
+
+void PiecePicker::init(int num_pieces)
+{
+    spin_mutex::scoped_lock lock(picker_mtx);
+    avail.assign(num_pieces, 0);
+    state.assign(num_pieces, Free);
+    prio.assign(num_pieces, Normal);
+    pick_time.assign(num_pieces, Clock::time_point());
+    cursor_idx  = 0;
+    window_head = 0;
+    pos.assign(num_pieces, -1);
+    high_pieces.clear();
+    downloading.clear();
+    order.clear();
+    order.reserve(num_pieces);
+    bucket_start.assign(1, 0);
+    num_wanted  = num_pieces;
+    num_missing = num_pieces;
+    for (auto idx = 0; idx < num_pieces; ++idx) insert(idx);
+}
+
+void PiecePicker::setPriority(int idx, Priority priority)
+{
+    spin_mutex::scoped_lock lock(picker_mtx);
+    if (prio[idx] == priority) return;
+
+    int wanted_diff = (priority != Skip) - (prio[idx] != Skip);
+    num_wanted += wanted_diff;
+    if (state[idx] != Have) num_missing += wanted_diff;
+
+    // A piece being downloaded is finished, it joins its queue if released
+    if (state[idx] == Free) dequeue(idx);
+    prio[idx] = priority;
+    if (state[idx] == Free) enqueue(idx);
+}
+
+auto PiecePicker::priority(int idx) const -> Priority
+{
+    spin_mutex::scoped_lock lock(picker_mtx);
+    return prio[idx];
+}
+
+int PiecePicker::numWanted() const
+{
+    spin_mutex::scoped_lock lock(picker_mtx);
+    return num_wanted;
+}
+
+int PiecePicker::numMissing() const
+{
+    spin_mutex::scoped_lock lock(picker_mtx);
+    return num_missing;
+}
+
+void PiecePicker::addPeer(const BitField& peer_has)
+{
+    for (auto idx = 0u; idx < peer_has.size(); ++idx) {
+        if (peer_has[idx]) incAvailability(idx);
+    }
+}
+
+void PiecePicker::removePeer(const BitField& peer_has)
+{
+    for (auto idx = 0u; idx < peer_has.size(); ++idx) {
+        if (peer_has[idx]) decAvailability(idx);
+    }
+}
+
+void PiecePicker::incAvailability(int idx)
+{
+    spin_mutex::scoped_lock lock(picker_mtx);
+    int bucket = avail[idx]++;
+    if (pos[idx] < 0) return;
+
+    // Last of its bucket becomes first of the next one
+    if (int(bucket_start.size()) <= bucket + 1) bucket_start.push_back(order.size());
+    swapPos(pos[idx], bucket_start[bucket + 1] - 1);
+    --bucket_start[bucket + 1];
+    shuffleIn(idx);
+}
+
+void PiecePicker::decAvailability(int idx)
+{
+    spin_mutex::scoped_lock lock(picker_mtx);
+    if (avail[idx] == 0) return;
+    int bucket = avail[idx]--;
+    if (pos[idx] < 0) return;
+
+    // First of its bucket becomes last of the previous one
+    swapPos(pos[idx], bucket_start[bucket]);
+    ++bucket_start[bucket];
+    shuffleIn(idx);
+}
+
+void PiecePicker::setStreaming(int window_pieces, double piece_deadline)
+{
+    spin_mutex::scoped_lock lock(picker_mtx);
+    window   = max(window_pieces, 0);
+    deadline = piece_deadline;
+}
+
+void PiecePicker::setCursor(int idx)
+{
+    spin_mutex::scoped_lock lock(picker_mtx);
+    cursor_idx  = max(0, min(idx, int(state.size())));
+    window_head = cursor_idx;
+    advanceWindow();
+}
+
+int PiecePicker::cursor() const
+{
+    spin_mutex::scoped_lock lock(picker_mtx);
+    return cursor_idx;
+}
+
+int PiecePicker::pick(const BitField& peer_has)
+{
+    spin_mutex::scoped_lock lock(picker_mtx);
+    // Wanted pieces of the window in order, the earliest deadline first
+    for (int idx = window_head, num_seen = 0;
+         idx < int(state.size()) && num_seen < window; ++idx) {
+        if (state[idx] == Have || prio[idx] == Skip) continue;
+        ++num_seen;
+        if (state[idx] == Free && peer_has[idx]) return take(idx);
+    }
+
+    int high_idx = -1;
+    for (auto idx : high_pieces) {
+        if (peer_has[idx] && (high_idx < 0 || avail[idx] < avail[high_idx])) {
+            high_idx = idx;
+        }
+    }
+    if (high_idx >= 0) return take(high_idx);
+
+    // Pieces the peer has are at least in bucket 1
+    int first = bucket_start.size() > 1 ? bucket_start[1] : int(order.size());
+    for (auto i = first; i < int(order.size()); ++i) {
+        int idx = order[i];
+        if (peer_has[idx]) return take(idx);
+    }
+    return -1;
+}
+
+int PiecePicker::overdue(const BitField& peer_has) const
+{
+    spin_mutex::scoped_lock lock(picker_mtx);
+    auto now = Clock::now();
+    for (int idx = window_head, num_seen = 0;
+         idx < int(state.size()) && num_seen < window; ++idx) {
+        if (state[idx] == Have || prio[idx] == Skip) continue;
+        ++num_seen;
+        if (state[idx] != Downloading || !peer_has[idx]) continue;
+
+        chrono::duration<double> elapsed = now - pick_time[idx];
+        if (elapsed.count() > num_seen * deadline) return idx;
+    }
+    return -1;
+}
+
+int PiecePicker::take(int idx)
+{
+    dequeue(idx);
+    state[idx] = Downloading;
+    downloading.insert(idx);
+    pick_time[idx] = Clock::now();
+    return idx;
+}
+
+void PiecePicker::advanceWindow()
+{
+    while (window_head < int(state.size()) && state[window_head] == Have) ++window_head;
+}
+
+void PiecePicker::release(int idx)
+{
+    spin_mutex::scoped_lock lock(picker_mtx);
+    if (state[idx] != Downloading) return;
+    state[idx] = Free;
+    downloading.erase(idx);
+    enqueue(idx);
+}
+
+void PiecePicker::complete(int idx)
+{
+    spin_mutex::scoped_lock lock(picker_mtx);
+    if (state[idx] == Have) return;
+    if (state[idx] == Free) dequeue(idx);
+    if (prio[idx] != Skip) --num_missing;
+    state[idx] = Have;
+    downloading.erase(idx);
+    advanceWindow();
+}
+
+bool PiecePicker::inEndgame() const
+{
+    spin_mutex::scoped_lock lock(picker_mtx);
+    size_t num_free = order.size() + high_pieces.size();
+    return num_free == 0 || int(num_free + downloading.size()) <= endgame_pieces;
+}
+
+bool PiecePicker::wants(int idx) const
+{
+    spin_mutex::scoped_lock lock(picker_mtx);
+    return state[idx] != Have && prio[idx] != Skip;
+}
+
+bool PiecePicker::isInteresting(const BitField& peer_has) const
+{
+    spin_mutex::scoped_lock lock(picker_mtx);
+    for (auto idx = 0u; idx < peer_has.size(); ++idx) {
+        if (peer_has[idx] && state[idx] != Have && prio[idx] != Skip) return true;
+    }
+    return false;
+}
+
+void PiecePicker::enqueue(int idx)
+{
+    if (prio[idx] == Normal) insert(idx);
+    if (prio[idx] == High) high_pieces.insert(idx);
+}
+
+void PiecePicker::dequeue(int idx)
+{
+    if (pos[idx] >= 0) erase(idx);
+    high_pieces.erase(idx);
+}
+
+void PiecePicker::insert(int idx)
+{
+    // Append to the top bucket, then sink to its own bucket by swapping with
+    // the first element of every bucket on the way down
+    int bucket = avail[idx];
+    while (int(bucket_start.size()) <= bucket) bucket_start.push_back(order.size());
+    order.push_back(idx);
+    pos[idx] = order.size() - 1;
+    for (auto b = int(bucket_start.size()) - 1; b > bucket; --b) {
+        swapPos(pos[idx], bucket_start[b]);
+        ++bucket_start[b];
+    }
+    shuffleIn(idx);
+}
+
+void PiecePicker::erase(int idx)
+{
+    // Rise to the top bucket by swapping with the last element of every bucket,
+    // then swap with the very last element and drop it
+    for (auto b = avail[idx] + 1; b < int(bucket_start.size()); ++b) {
+        swapPos(pos[idx], bucket_start[b] - 1);
+        --bucket_start[b];
+    }
+    swapPos(pos[idx], order.size() - 1);
+    order.pop_back();
+    pos[idx] = -1;
+}
+
+void PiecePicker::swapPos(int pos_a, int pos_b)
+{
+    if (pos_a == pos_b) return;
+    swap(order[pos_a], order[pos_b]);
+    pos[order[pos_a]] = pos_a;
+    pos[order[pos_b]] = pos_b;
+}
+
+void PiecePicker::shuffleIn(int idx)
+{
+    int bucket = avail[idx];
+    uniform_int_distribution<int> dist(bucket_start[bucket], bucketEnd(bucket) - 1);
+    swapPos(pos[idx], dist(rd_engine));
+}
@@ -0,0 +1,171 @@
+#ifdef __linux__
+#  include <sys/epoll.h>
+#elif !defined _WIN32
+#  include <poll.h>
+#endif
+#include <cmath>
+#include <vector>
+#include "reactor.h"
+
+using namespace std;
+using namespace tbb;
+using namespace cls;
+
+namespace {
+const int MAX_EVENTS = 256;
+
+int timeoutMs(double time_out)
+{
+    return time_out < 0 ? -1 : static_cast<int>(ceil(time_out * 1000));
+}
+} // Unnamed namespace
+
+bool Reactor::dispatch(SOCKET sock, int events)
+{
+    Handler handler;
+    {
+        mutex::scoped_lock lock(handler_mtx);
+        auto iter = handlers.find(sock);
+        // Socket may have been removed by a handler called earlier in this round
+        if (iter == handlers.end()) return false;
+        handler = iter->second.handler;
+    }
+    handler(events);
+    return true;
+}
+
+size_t Reactor::size() const
+{
+    mutex::scoped_lock lock(handler_mtx);
+    return handlers.size();
+}
+
+#ifdef __linux__
+namespace {
+uint32_t toEpoll(int events)
+{
+    uint32_t epoll_events = EPOLLRDHUP;
+    if (events & Reactor::Readable) epoll_events |= EPOLLIN;
+    if (events & Reactor::Writable) epoll_events |= EPOLLOUT;
+    return epoll_events;
+}
+} // Unnamed namespace
+
+Reactor::Reactor() : epoll_fd(::epoll_create1(EPOLL_CLOEXEC)) {}
+
+Reactor::~Reactor()
+{
+    if (epoll_fd >= 0) ::close(epoll_fd);
+}
+
+bool Reactor::add(SOCKET sock, int events, const Handler& handler)
+{
+    mutex::scoped_lock lock(handler_mtx);
+    epoll_event ev {};
+    ev.events  = toEpoll(events);
+    ev.data.fd = sock;
+    if (::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev) < 0) return false;
+    handlers[sock] = {events, handler};
+    return true;
+}
+
+bool Reactor::modify(SOCKET sock, int events)
+{
+    mutex::scoped_lock lock(handler_mtx);
+    auto iter = handlers.find(sock);
+    if (iter == handlers.end()) return false;
+    if (iter->second.events == events) return true;
+
+    epoll_event ev {};
+    ev.events  = toEpoll(events);
+    ev.data.fd = sock;
+    if (::epoll_ctl(epoll_fd, EPOLL_CTL_MOD, sock, &ev) < 0) return false;
+    iter->second.events = events;
+    return true;
+}
+
+void Reactor::remove(SOCKET sock)
+{
+    mutex::scoped_lock lock(handler_mtx);
+    if (handlers.erase(sock)) ::epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sock, nullptr);
+}
+
+int Reactor::poll(double time_out)
+{
+    epoll_event events[MAX_EVENTS];
+    int num_events = ::epoll_wait(epoll_fd, events, MAX_EVENTS, timeoutMs(time_out));
+    for (auto i = 0; i < num_events; ++i) {
+        int ready = 0;
+        if (events[i].events & EPOLLIN)  ready |= Readable;
+        if (events[i].events & EPOLLOUT) ready |= Writable;
+        if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) ready |= Closed;
+        dispatch(events[i].data.fd, ready);
+    }
+    return max(num_events, 0);
+}
+#else
+Reactor::Reactor() {}
+
+Reactor::~Reactor() {}
+
+bool Reactor::add(SOCKET sock, int events, const Handler& handler)
+{
+    mutex::scoped_lock lock(handler_mtx);
+    handlers[sock] = {events, handler};
+    return true;
+}
+
+bool Reactor::modify(SOCKET sock, int events)
+{
+    mutex::scoped_lock lock(handler_mtx);
+    auto iter = handlers.find(sock);
+    if (iter == handlers.end()) return false;
+    iter->second.events = events;
+    return true;
+}
+
+void Reactor::remove(SOCKET sock)
+{
+    mutex::scoped_lock lock(handler_mtx);
+    handlers.erase(sock);
+}
+
+int Reactor::poll(double time_out)
+{
+    // Interest set is rebuilt every round, fine for the number of peers poll is
+    // used with on platforms without epoll
+    vector<pollfd> poll_fds;
+    {
+        mutex::scoped_lock lock(handler_mtx);
+        poll_fds.reserve(handlers.size());
+        for (const auto& entry : handlers) {
+            pollfd pfd {};
+            pfd.fd = entry.first;
+            if (entry.second.events & Readable) pfd.events |= POLLIN;
+            if (entry.second.events & Writable) pfd.events |= POLLOUT;
+            poll_fds.push_back(pfd);
+        }
+    }
+
+#ifdef _WIN32
+    if (poll_fds.empty()) {
+        ::Sleep(timeoutMs(time_out));
+        return 0;
+    }
+    int num_events = ::WSAPoll(poll_fds.data(), static_cast<ULONG>(poll_fds.size()),
+                               timeoutMs(time_out));
+#else
+    int num_events = ::poll(poll_fds.data(), poll_fds.size(), timeoutMs(time_out));
+#endif
+    if (num_events <= 0) return 0;
+
+    for (const auto& pfd : poll_fds) {
+        int ready = 0;
+        if (pfd.revents & POLLIN)  ready |= Readable;
+        if (pfd.revents & POLLOUT) ready |= Writable;
+        if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) ready |= Closed;
+        if (ready) dispatch(pfd.fd, ready);
+    }
+    return num_events;
+}
+#endif
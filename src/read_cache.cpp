@@ -0,0 +1,53 @@
+#include "read_cache.h"
+
+using namespace std;
+using namespace tbb;
+using namespace cls;
+
+void ReadCache::setCapacity(size_t num_bytes)
+{
+    spin_mutex::scoped_lock lock(cache_mtx);
+    cache_capacity = num_bytes;
+    evict(0);
+}
+
+auto ReadCache::get(int idx) -> Piece
+{
+    spin_mutex::scoped_lock lock(cache_mtx);
+    auto iter = index.find(idx);
+    if (iter == index.end()) {
+        ++misses;
+        return nullptr;
+    }
+
+    ++hits;
+    lru_list.splice(lru_list.begin(), lru_list, iter->second);
+    return iter->second->second;
+}
+
+void ReadCache::put(int idx, const Piece& piece)
+{
+    spin_mutex::scoped_lock lock(cache_mtx);
+    if (!piece || piece->size() > cache_capacity || index.count(idx)) return;
+
+    evict(piece->size());
+    lru_list.emplace_front(idx, piece);
+    index[idx]  = lru_list.begin();
+    cache_size += piece->size();
+}
+
+size_t ReadCache::size() const
+{
+    spin_mutex::scoped_lock lock(cache_mtx);
+    return cache_size;
+}
+
+void ReadCache::evict(size_t num_bytes)
+{
+    // Make room for num_bytes more, caller holds cache_mtx
+    while (!lru_list.empty() && cache_size + num_bytes > cache_capacity) {
+        cache_size -= lru_list.back().second->size();
+        index.erase(lru_list.back().first);
+        lru_list.pop_back();
+    }
+}
@@ -0,0 +1,66 @@
+#include <cstdio>
+#include <fstream>
+#include "resume_data.h"
+
+using namespace std;
+using namespace cls;
+
+namespace {
+// magic, version, info hash, file size, mtime, number of pieces, bitfield
+const char RESUME_MAGIC[4]  = {'B', 'T', 'R', 'S'};
+const int  RESUME_VERSION   = 1;
+const int  RESUME_HEADER_SZ = 4 + 4 + 20 + 8 + 8 + 4;
+} // Unnamed namespace
+
+bool ResumeData::load(const string& file_name, int num_pieces)
+{
+    ifstream ifs(file_name, ios::binary);
+    if (!ifs) return false;
+
+    ByteArray header(RESUME_HEADER_SZ);
+    if (!ifs.read(header.data(), header.size())) return false;
+
+    int version, saved_pieces;
+    memcpy(&version, &header[4], 4);
+    memcpy(&saved_pieces, &header[44], 4);
+    if (!equal(begin(RESUME_MAGIC), end(RESUME_MAGIC), header.begin()) ||
+        version != RESUME_VERSION || saved_pieces != num_pieces) {
+        return false;
+    }
+    info_hash = header.sub(8, 20);
+    memcpy(&file_size, &header[28], 8);
+    memcpy(&mtime, &header[36], 8);
+
+    ByteArray bits((num_pieces + 7) / 8);
+    if (!ifs.read(bits.data(), bits.size())) return false;
+    bit_field.fromByteArray(num_pieces, bits);
+
+    return true;
+}
+
+bool ResumeData::save(const string& file_name) const
+{
+    // Write to a temporary file first so a crash never leaves a torn file behind
+    string tmp_name = file_name + ".tmp";
+    {
+        ofstream ofs(tmp_name, ios::binary | ios::trunc);
+        if (!ofs) return false;
+
+        int num_pieces = static_cast<int>(bit_field.size());
+        ofs.write(RESUME_MAGIC, 4);
+        ofs.write(reinterpret_cast<const char*>(&RESUME_VERSION), 4);
+        ofs.write(info_hash.data(), 20);
+        ofs.write(reinterpret_cast<const char*>(&file_size), 8);
+        ofs.write(reinterpret_cast<const char*>(&mtime), 8);
+        ofs.write(reinterpret_cast<const char*>(&num_pieces), 4);
+        auto bits = bit_field.toByteArray();
+        ofs.write(bits.data(), bits.size());
+        if (!ofs.flush()) return false;
+    }
+
+#ifdef _WIN32
+    // rename doesn't replace an existing file on Windows
+    remove(file_name.c_str());
+#endif
+    return rename(tmp_name.c_str(), file_name.c_str()) == 0;
+}
@@ -0,0 +1,332 @@
+#include <cstring>
+#include <openssl/sha.h>
+#if (defined __x86_64__ || defined __i386__) && (defined __GNUC__ || defined __clang__)
+#  define SHA1_X86_SIMD 1
+#  include <cpuid.h>
+#  include <immintrin.h>
+#endif
+#include "sha1.h"
+
+using namespace std;
+using namespace cls;
+
+namespace {
+const uint32_t SHA1_INIT[5] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+};
+
+inline uint32_t loadBE32(const char* data)
+{
+    auto bytes = reinterpret_cast<const uchar*>(data);
+    return uint32_t(bytes[0]) << 24 | uint32_t(bytes[1]) << 16 |
+           uint32_t(bytes[2]) << 8  | uint32_t(bytes[3]);
+}
+
+inline void storeBE32(char* data, uint32_t value)
+{
+    data[0] = char(value >> 24); data[1] = char(value >> 16);
+    data[2] = char(value >> 8);  data[3] = char(value);
+}
+
+// Final one or two blocks: the remaining bytes, 0x80, zeros and the bit length
+int padTail(const char* data, size_t length, char tail[128])
+{
+    size_t rest = length % 64;
+    memset(tail, 0, 128);
+    memcpy(tail, data + length - rest, rest);
+    tail[rest] = char(0x80);
+    int num_blocks = rest < 56 ? 1 : 2;
+    uint64_t bits = uint64_t(length) * 8;
+    storeBE32(tail + num_blocks*64 - 8, uint32_t(bits >> 32));
+    storeBE32(tail + num_blocks*64 - 4, uint32_t(bits));
+    return num_blocks;
+}
+
+#ifdef SHA1_X86_SIMD
+bool cpuHasShaNi()
+{
+    unsigned a, b, c, d;
+    if (__get_cpuid_max(0, nullptr) < 7) return false;
+    __cpuid(1, a, b, c, d);
+    bool has_sse41 = (c & bit_SSE4_1) && (c & bit_SSSE3);
+    __cpuid_count(7, 0, a, b, c, d);
+    return has_sse41 && (b & (1 << 29));
+}
+
+bool cpuHasAvx2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+// One group of 4 rounds, i is a constant so the branches fold away. Message
+// words are expanded 3 groups ahead with sha1msg1/xor/sha1msg2
+#define SHA1_NI_GROUP(i, E_CUR, E_NEXT)                                               \
+    if (i < 4) {                                                                      \
+        msg[i] = _mm_shuffle_epi8(                                                    \
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + 16*i)), mask);   \
+    }                                                                                 \
+    E_CUR  = i == 0 ? _mm_add_epi32(E_CUR, msg[0])                                    \
+                    : _mm_sha1nexte_epu32(E_CUR, msg[i % 4]);                         \
+    E_NEXT = abcd;                                                                    \
+    if (i >= 3 && i <= 18) {                                                          \
+        msg[(i + 1) % 4] = _mm_sha1msg2_epu32(msg[(i + 1) % 4], msg[i % 4]);          \
+    }                                                                                 \
+    abcd = _mm_sha1rnds4_epu32(abcd, E_CUR, i / 5);                                   \
+    if (i >= 1 && i <= 16) {                                                          \
+        msg[(i + 3) % 4] = _mm_sha1msg1_epu32(msg[(i + 3) % 4], msg[i % 4]);          \
+    }                                                                                 \
+    if (i >= 2 && i <= 17) {                                                          \
+        msg[(i + 2) % 4] = _mm_xor_si128(msg[(i + 2) % 4], msg[i % 4]);               \
+    }
+
+__attribute__((target("sha,sse4.1,ssse3")))
+void compressShaNi(uint32_t state[5], const char* block, size_t num_blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0x1B);
+    __m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+    __m128i e1, msg[4];
+
+    for (; num_blocks > 0; --num_blocks, block += 64) {
+        __m128i abcd_save = abcd;
+        __m128i e0_save   = e0;
+
+        SHA1_NI_GROUP( 0, e0, e1) SHA1_NI_GROUP( 1, e1, e0)
+        SHA1_NI_GROUP( 2, e0, e1) SHA1_NI_GROUP( 3, e1, e0)
+        SHA1_NI_GROUP( 4, e0, e1) SHA1_NI_GROUP( 5, e1, e0)
+        SHA1_NI_GROUP( 6, e0, e1) SHA1_NI_GROUP( 7, e1, e0)
+        SHA1_NI_GROUP( 8, e0, e1) SHA1_NI_GROUP( 9, e1, e0)
+        SHA1_NI_GROUP(10, e0, e1) SHA1_NI_GROUP(11, e1, e0)
+        SHA1_NI_GROUP(12, e0, e1) SHA1_NI_GROUP(13, e1, e0)
+        SHA1_NI_GROUP(14, e0, e1) SHA1_NI_GROUP(15, e1, e0)
+        SHA1_NI_GROUP(16, e0, e1) SHA1_NI_GROUP(17, e1, e0)
+        SHA1_NI_GROUP(18, e0, e1) SHA1_NI_GROUP(19, e1, e0)
+
+        e0   = _mm_sha1nexte_epu32(e0, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state), _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+#undef SHA1_NI_GROUP
+
+void hashShaNi(const char* data, size_t length, char* digest)
+{
+    uint32_t state[5];
+    memcpy(state, SHA1_INIT, sizeof(state));
+    compressShaNi(state, data, length / 64);
+
+    char tail[128];
+    compressShaNi(state, tail, padTail(data, length, tail));
+    for (auto i = 0; i < 5; ++i) storeBE32(digest + 4*i, state[i]);
+}
+
+// 8 buffers of the same length, one per 32 bit lane of the AVX2 registers
+__attribute__((target("avx2")))
+void compressAvx2(__m256i state[5], const char* const block[8], size_t num_blocks)
+{
+    #define ROTL(x, n) _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - n))
+    const __m256i k[4] = {
+        _mm256_set1_epi32(0x5a827999), _mm256_set1_epi32(0x6ed9eba1),
+        _mm256_set1_epi32(int(0x8f1bbcdc)), _mm256_set1_epi32(int(0xca62c1d6))
+    };
+    // Byte swap inside each 32 bit word
+    const __m256i bswap = _mm256_set_epi8(
+        12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+        12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+
+    for (size_t offset = 0; offset < num_blocks * 64; offset += 64) {
+        // Transpose the 8 blocks into 16 vectors of message words
+        __m256i w[16];
+        for (auto t = 0; t < 16; t += 8) {
+            __m256i rows[8];
+            for (auto lane = 0; lane < 8; ++lane) {
+                rows[lane] = _mm256_loadu_si256(
+                    reinterpret_cast<const __m256i*>(block[lane] + offset + 4*t));
+            }
+            __m256i t0 = _mm256_unpacklo_epi32(rows[0], rows[1]);
+            __m256i t1 = _mm256_unpackhi_epi32(rows[0], rows[1]);
+            __m256i t2 = _mm256_unpacklo_epi32(rows[2], rows[3]);
+            __m256i t3 = _mm256_unpackhi_epi32(rows[2], rows[3]);
+            __m256i t4 = _mm256_unpacklo_epi32(rows[4], rows[5]);
+            __m256i t5 = _mm256_unpackhi_epi32(rows[4], rows[5]);
+            __m256i t6 = _mm256_unpacklo_epi32(rows[6], rows[7]);
+            __m256i t7 = _mm256_unpackhi_epi32(rows[6], rows[7]);
+            __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+            __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+            __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+            __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+            __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+            __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+            __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+            __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+            w[t + 0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+            w[t + 1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+            w[t + 2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+            w[t + 3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+            w[t + 4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+            w[t + 5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+            w[t + 6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+            w[t + 7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+        }
+        for (auto t = 0; t < 16; ++t) w[t] = _mm256_shuffle_epi8(w[t], bswap);
+
+        __m256i a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+        // One loop per round function keeps the rounds branch free
+        #define ROUND(t, f)                                                               \
+            if (t >= 16) {                                                                \
+                __m256i x = _mm256_xor_si256(                                             \
+                    _mm256_xor_si256(w[(t - 3) & 15], w[(t - 8) & 15]),                   \
+                    _mm256_xor_si256(w[(t - 14) & 15], w[t & 15]));                       \
+                w[t & 15] = ROTL(x, 1);                                                   \
+            }                                                                             \
+            __m256i tmp = _mm256_add_epi32(_mm256_add_epi32(ROTL(a, 5), f),               \
+                          _mm256_add_epi32(_mm256_add_epi32(e, k[t / 20]), w[t & 15]));   \
+            e = d; d = c; c = ROTL(b, 30); b = a; a = tmp;
+        for (auto t = 0; t < 20; ++t) {
+            ROUND(t, _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d))))
+        }
+        for (auto t = 20; t < 40; ++t) {
+            ROUND(t, _mm256_xor_si256(_mm256_xor_si256(b, c), d))
+        }
+        for (auto t = 40; t < 60; ++t) {
+            ROUND(t, _mm256_or_si256(_mm256_and_si256(b, c),
+                                     _mm256_and_si256(d, _mm256_or_si256(b, c))))
+        }
+        for (auto t = 60; t < 80; ++t) {
+            ROUND(t, _mm256_xor_si256(_mm256_xor_si256(b, c), d))
+        }
+        #undef ROUND
+        state[0] = _mm256_add_epi32(state[0], a);
+        state[1] = _mm256_add_epi32(state[1], b);
+        state[2] = _mm256_add_epi32(state[2], c);
+        state[3] = _mm256_add_epi32(state[3], d);
+        state[4] = _mm256_add_epi32(state[4], e);
+    }
+    #undef ROTL
+}
+
+__attribute__((target("avx2")))
+void hashAvx2(const char* const data[], size_t length, int n, char* const digest[])
+{
+    // Unused lanes hash the first buffer again, the result is thrown away
+    const char* lanes[8];
+    for (auto lane = 0; lane < 8; ++lane) lanes[lane] = data[lane < n ? lane : 0];
+
+    __m256i state[5];
+    for (auto i = 0; i < 5; ++i) state[i] = _mm256_set1_epi32(int(SHA1_INIT[i]));
+    compressAvx2(state, lanes, length / 64);
+
+    char tails[8][128];
+    const char* tail_ptrs[8];
+    int num_tail = 0;
+    for (auto lane = 0; lane < 8; ++lane) {
+        num_tail = padTail(lanes[lane], length, tails[lane]);
+        tail_ptrs[lane] = tails[lane];
+    }
+    compressAvx2(state, tail_ptrs, num_tail);
+
+    alignas(32) uint32_t words[5][8];
+    for (auto i = 0; i < 5; ++i) {
+        _mm256_store_si256(reinterpret_cast<__m256i*>(words[i]), state[i]);
+    }
+    for (auto lane = 0; lane < n; ++lane) {
+        for (auto i = 0; i < 5; ++i) storeBE32(digest[lane] + 4*i, words[i][lane]);
+    }
+}
+#endif // SHA1_X86_SIMD
+
+void hashOpenSSL(const char* data, size_t length, char* digest)
+{
+    SHA1(reinterpret_cast<const uchar*>(data), length, reinterpret_cast<uchar*>(digest));
+}
+
+// 8 lanes of AVX2 outrun SHA-NI on a single buffer, so batches prefer them
+Sha1::Impl detectImpl()
+{
+#ifdef SHA1_X86_SIMD
+    if (cpuHasAvx2())  return Sha1::Avx2;
+    if (cpuHasShaNi()) return Sha1::ShaNi;
+#endif
+    return Sha1::OpenSSL;
+}
+
+Sha1::Impl current_impl = detectImpl();
+#ifdef SHA1_X86_SIMD
+bool has_sha_ni = cpuHasShaNi();
+#endif
+} // Unnamed namespace
+
+auto Sha1::impl() -> Impl
+{
+    return current_impl;
+}
+
+const char* Sha1::implName()
+{
+    const char* names[] = {"OpenSSL", "SHA-NI", "AVX2 multi-buffer"};
+#ifdef SHA1_X86_SIMD
+    if (current_impl == Avx2 && has_sha_ni) return "AVX2 multi-buffer, SHA-NI";
+#endif
+    return names[current_impl];
+}
+
+bool Sha1::setImpl(Impl impl)
+{
+#ifdef SHA1_X86_SIMD
+    if ((impl == ShaNi && !cpuHasShaNi()) || (impl == Avx2 && !cpuHasAvx2())) return false;
+#else
+    if (impl != OpenSSL) return false;
+#endif
+    current_impl = impl;
+#ifdef SHA1_X86_SIMD
+    has_sha_ni = impl != OpenSSL && cpuHasShaNi();
+#endif
+    return true;
+}
+
+void Sha1::hash(const char* data, size_t length, char* digest)
+{
+#ifdef SHA1_X86_SIMD
+    // A single buffer gains nothing from multi-buffer lanes
+    if (current_impl == ShaNi || (current_impl == Avx2 && has_sha_ni)) {
+        hashShaNi(data, length, digest);
+        return;
+    }
+#endif
+    hashOpenSSL(data, length, digest);
+}
+
+void Sha1::hashMany(const char* const data[], const size_t length[], int n,
+                    char* const digest[])
+{
+#ifdef SHA1_X86_SIMD
+    if (current_impl == Avx2) {
+        // Gather up to 8 buffers as long as the first one still waiting
+        vector<bool> done(n, false);
+        for (auto first = 0; first < n; ++first) {
+            if (done[first]) continue;
+            const char* lane_data[MAX_LANES];
+            char*       lane_digest[MAX_LANES];
+            int num_lanes = 0;
+            for (auto i = first; i < n && num_lanes < MAX_LANES; ++i) {
+                if (done[i] || length[i] != length[first]) continue;
+                lane_data[num_lanes]   = data[i];
+                lane_digest[num_lanes] = digest[i];
+                done[i] = true;
+                ++num_lanes;
+            }
+            if (num_lanes == 1) {
+                hash(lane_data[0], length[first], lane_digest[0]);
+            } else {
+                hashAvx2(lane_data, length[first], num_lanes, lane_digest);
+            }
+        }
+        return;
+    }
+#endif
+    for (auto i = 0; i < n; ++i) hash(data[i], length[i], digest[i]);
+}
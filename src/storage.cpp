@@ -0,0 +1,335 @@
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <cerrno>
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/stat.h>
+#  include <sys/mman.h>
+#  include <sys/uio.h>
+#  include <climits>
+#endif
+#include "storage.h"
+
+using namespace std;
+using namespace cls;
+
+namespace {
+const llong FILE_CHUNK_SIZE = 100 * 1024 * 1024; // 100 MB
+} // Unnamed namespace
+
+bool FileStorage::open(const string& file_name)
+{
+    return openHandle(file_name, false);
+}
+
+bool FileStorage::create(const string& file_name, llong file_size, AllocMode mode)
+{
+    if (!openHandle(file_name, true)) return false;
+
+    // Fall back to a sparse file if the file system can't reserve blocks
+    if (mode == AllocReserve && !reserve(file_size)) mode = AllocSparse;
+    if (mode == AllocSparse  && !resize(file_size))  return false;
+    if (mode == AllocFull    && !fillZero(file_size)) return false;
+
+    alloc_mode = mode;
+    fsize      = file_size;
+    return true;
+}
+
+bool FileStorage::fillZero(llong file_size)
+{
+    const ByteArray file_chunk(static_cast<size_t>(min(file_size, FILE_CHUNK_SIZE)));
+    llong pos = 0;
+    for (; pos + FILE_CHUNK_SIZE <= file_size; pos += FILE_CHUNK_SIZE) {
+        if (!write(pos, file_chunk)) return false;
+    }
+    return write(pos, file_chunk.data(), static_cast<size_t>(file_size - pos));
+}
+
+#ifdef _WIN32
+bool FileStorage::openHandle(const string& file_name, bool truncate)
+{
+    close();
+    fhandle = ::CreateFileA(file_name.c_str(), GENERIC_READ | GENERIC_WRITE,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                            truncate ? CREATE_ALWAYS : OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (fhandle == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER file_size;
+    ::GetFileSizeEx(fhandle, &file_size);
+    fname   = file_name;
+    fsize   = file_size.QuadPart;
+    is_open = true;
+    return true;
+}
+
+bool FileStorage::resize(llong file_size)
+{
+    LARGE_INTEGER end_pos;
+    end_pos.QuadPart = file_size;
+    return ::SetFilePointerEx(fhandle, end_pos, nullptr, FILE_BEGIN) &&
+           ::SetEndOfFile(fhandle);
+}
+
+bool FileStorage::reserve(llong file_size)
+{
+    FILE_ALLOCATION_INFO alloc_info;
+    alloc_info.AllocationSize.QuadPart = file_size;
+    return ::SetFileInformationByHandle(fhandle, FileAllocationInfo,
+                                        &alloc_info, sizeof(alloc_info)) &&
+           resize(file_size);
+}
+
+llong FileStorage::modifiedTime() const
+{
+    FILETIME write_time;
+    if (!is_open || !::GetFileTime(fhandle, nullptr, nullptr, &write_time)) return 0;
+    // 100 ns intervals
+    return (llong(write_time.dwHighDateTime) << 32 | write_time.dwLowDateTime) * 100;
+}
+
+void FileStorage::close()
+{
+    unmap();
+    if (is_open) ::CloseHandle(fhandle);
+    is_open = false;
+}
+
+bool FileStorage::map()
+{
+    if (!is_open || fsize == 0) return false;
+    if (isMapped()) return true;
+
+    map_handle = ::CreateFileMappingA(fhandle, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+    if (!map_handle) return false;
+    map_addr = static_cast<char*>(::MapViewOfFile(map_handle, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+    if (!map_addr) {
+        ::CloseHandle(map_handle);
+        return false;
+    }
+    map_size = static_cast<size_t>(fsize);
+    return true;
+}
+
+void FileStorage::unmap()
+{
+    if (!isMapped()) return;
+    ::FlushViewOfFile(map_addr, 0);
+    ::UnmapViewOfFile(map_addr);
+    ::CloseHandle(map_handle);
+    map_addr = nullptr;
+    map_size = 0;
+}
+
+bool FileStorage::flush(llong pos, size_t length, bool sync) const
+{
+    if (!inMapping(pos, length)) return false;
+    if (!::FlushViewOfFile(map_addr + pos, length)) return false;
+    return !sync || ::FlushFileBuffers(fhandle);
+}
+
+bool FileStorage::write(llong pos, const char* data, size_t length) const
+{
+    if (inMapping(pos, length)) {
+        memcpy(map_addr + pos, data, length);
+        return true;
+    }
+
+    while (length > 0) {
+        OVERLAPPED ov {};
+        ov.Offset     = static_cast<DWORD>(pos);
+        ov.OffsetHigh = static_cast<DWORD>(pos >> 32);
+        DWORD num_bytes = 0;
+        if (!::WriteFile(fhandle, data, static_cast<DWORD>(length), &num_bytes, &ov)) {
+            return false;
+        }
+        data += num_bytes; pos += num_bytes; length -= num_bytes;
+    }
+    return true;
+}
+
+bool FileStorage::write(llong pos, const vector<ByteView>& parts) const
+{
+    for (auto& part : parts) {
+        if (!write(pos, part.data(), part.size())) return false;
+        pos += part.size();
+    }
+    return true;
+}
+
+bool FileStorage::read(llong pos, size_t length, char* data) const
+{
+    if (inMapping(pos, length)) {
+        memcpy(data, map_addr + pos, length);
+        return true;
+    }
+
+    while (length > 0) {
+        OVERLAPPED ov {};
+        ov.Offset     = static_cast<DWORD>(pos);
+        ov.OffsetHigh = static_cast<DWORD>(pos >> 32);
+        DWORD num_bytes = 0;
+        if (!::ReadFile(fhandle, data, static_cast<DWORD>(length), &num_bytes, &ov) ||
+            num_bytes == 0) {
+            return false;
+        }
+        data += num_bytes; pos += num_bytes; length -= num_bytes;
+    }
+    return true;
+}
+#else
+bool FileStorage::openHandle(const string& file_name, bool truncate)
+{
+    close();
+    int flags = truncate ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR;
+    fhandle = ::open(file_name.c_str(), flags, 0644);
+    if (fhandle < 0) return false;
+
+    struct stat file_stat;
+    ::fstat(fhandle, &file_stat);
+    fname   = file_name;
+    fsize   = file_stat.st_size;
+    is_open = true;
+    return true;
+}
+
+bool FileStorage::resize(llong file_size)
+{
+    return ::ftruncate(fhandle, file_size) == 0;
+}
+
+bool FileStorage::reserve(llong file_size)
+{
+#if defined __linux__
+    // Unlike posix_fallocate, never emulated by writing zeros
+    return ::fallocate(fhandle, 0, 0, file_size) == 0;
+#elif defined __APPLE__
+    return false;
+#else
+    return ::posix_fallocate(fhandle, 0, file_size) == 0;
+#endif
+}
+
+llong FileStorage::modifiedTime() const
+{
+    struct stat file_stat;
+    if (!is_open || ::fstat(fhandle, &file_stat) < 0) return 0;
+#if defined __APPLE__
+    return llong(file_stat.st_mtimespec.tv_sec) * 1000000000 + file_stat.st_mtimespec.tv_nsec;
+#elif defined __linux__
+    return llong(file_stat.st_mtim.tv_sec) * 1000000000 + file_stat.st_mtim.tv_nsec;
+#else
+    return llong(file_stat.st_mtime) * 1000000000;
+#endif
+}
+
+void FileStorage::close()
+{
+    unmap();
+    if (is_open) ::close(fhandle);
+    is_open = false;
+}
+
+bool FileStorage::map()
+{
+    if (!is_open || fsize == 0) return false;
+    if (isMapped()) return true;
+
+    auto addr = ::mmap(nullptr, static_cast<size_t>(fsize), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fhandle, 0);
+    if (addr == MAP_FAILED) return false;
+    map_addr = static_cast<char*>(addr);
+    map_size = static_cast<size_t>(fsize);
+    return true;
+}
+
+void FileStorage::unmap()
+{
+    if (!isMapped()) return;
+    ::munmap(map_addr, map_size);
+    map_addr = nullptr;
+    map_size = 0;
+}
+
+bool FileStorage::flush(llong pos, size_t length, bool sync) const
+{
+    if (!inMapping(pos, length)) return false;
+
+    // msync requires a page aligned start address
+    static const llong page_size = ::sysconf(_SC_PAGESIZE);
+    llong begin = pos / page_size * page_size;
+    return ::msync(map_addr + begin, length + (pos - begin),
+                   sync ? MS_SYNC : MS_ASYNC) == 0;
+}
+
+bool FileStorage::write(llong pos, const char* data, size_t length) const
+{
+    if (inMapping(pos, length)) {
+        memcpy(map_addr + pos, data, length);
+        return true;
+    }
+
+    while (length > 0) {
+        auto num_bytes = ::pwrite(fhandle, data, length, pos);
+        if (num_bytes < 0 && errno == EINTR) continue;
+        if (num_bytes <= 0) return false;
+        data += num_bytes; pos += num_bytes; length -= num_bytes;
+    }
+    return true;
+}
+
+bool FileStorage::write(llong pos, const vector<ByteView>& parts) const
+{
+    size_t length = 0;
+    for (auto& part : parts) length += part.size();
+    if (inMapping(pos, length)) {
+        for (auto& part : parts) {
+            memcpy(map_addr + pos, part.data(), part.size());
+            pos += part.size();
+        }
+        return true;
+    }
+
+    // Gather into a single pwritev, IOV_MAX buffers at a time
+    vector<iovec> iov;
+    for (auto& part : parts) {
+        iov.push_back({const_cast<char*>(part.data()), part.size()});
+    }
+    size_t first = 0;
+    while (first < iov.size()) {
+        int count = static_cast<int>(min<size_t>(iov.size() - first, IOV_MAX));
+        auto num_bytes = ::pwritev(fhandle, &iov[first], count, pos);
+        if (num_bytes < 0 && errno == EINTR) continue;
+        if (num_bytes <= 0) return false;
+        pos += num_bytes;
+        // Skip what was written, a short write may stop inside a buffer
+        while (num_bytes > 0 && first < iov.size()) {
+            auto step = min<size_t>(num_bytes, iov[first].iov_len);
+            iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + step;
+            iov[first].iov_len -= step;
+            num_bytes -= step;
+            if (iov[first].iov_len == 0) ++first;
+        }
+    }
+    return true;
+}
+
+bool FileStorage::read(llong pos, size_t length, char* data) const
+{
+    if (inMapping(pos, length)) {
+        memcpy(data, map_addr + pos, length);
+        return true;
+    }
+
+    while (length > 0) {
+        auto num_bytes = ::pread(fhandle, data, length, pos);
+        if (num_bytes < 0 && errno == EINTR) continue;
+        // Reading past the end of file is treated as failure
+        if (num_bytes <= 0) return false;
+        data += num_bytes; pos += num_bytes; length -= num_bytes;
+    }
+    return true;
+}
+#endif
@@ -0,0 +1,224 @@
+#include <algorithm>
+#ifdef _WIN32
+#  include <direct.h>
+#else
+#  include <sys/stat.h>
+#endif
+#include "torrent_storage.h"
+
+using namespace std;
+using namespace cls;
+
+namespace {
+// Create every missing directory on the way to file_name
+void makeParentDirs(const string& file_name)
+{
+    for (auto sep = file_name.find('/', 1); sep != string::npos;
+         sep = file_name.find('/', sep + 1)) {
+        auto dir = file_name.substr(0, sep);
+#ifdef _WIN32
+        ::_mkdir(dir.c_str());
+#else
+        ::mkdir(dir.c_str(), 0755);
+#endif
+    }
+}
+} // Unnamed namespace
+
+bool TorrentStorage::open(const vector<FileEntry>& file_list)
+{
+    return openFiles(file_list, false, FileStorage::AllocFull);
+}
+
+bool TorrentStorage::create(const vector<FileEntry>& file_list, FileStorage::AllocMode mode)
+{
+    return openFiles(file_list, true, mode);
+}
+
+bool TorrentStorage::openFiles(const vector<FileEntry>& file_list, bool create_missing,
+                               FileStorage::AllocMode mode)
+{
+    close();
+    alloc_mode = mode;
+    for (const auto& entry : file_list) {
+        unique_ptr<FileStorage> file(new FileStorage);
+        if (!file->open(entry.path)) {
+            if (entry.need == NeedNone) {
+                file.reset();
+            } else if (!create_missing) {
+                close();
+                return false;
+            } else {
+                auto file_mode = entry.need == NeedAll ? mode : FileStorage::AllocSparse;
+                makeParentDirs(entry.path);
+                if (!file->create(entry.path, entry.length, file_mode)) {
+                    close();
+                    return false;
+                }
+                if (entry.need == NeedAll) alloc_mode = file->allocMode();
+            }
+        } else {
+            ++num_existing;
+        }
+        offsets.push_back(total_size);
+        total_size += entry.length;
+        files.push_back(move(file));
+    }
+    return true;
+}
+
+void TorrentStorage::close()
+{
+    files.clear();
+    offsets.clear();
+    total_size   = 0;
+    num_existing = 0;
+    is_mapped    = false;
+}
+
+bool TorrentStorage::map()
+{
+    for (auto& file : files) {
+        if (file && !file->empty() && !file->map()) {
+            unmap();
+            return false;
+        }
+    }
+    is_mapped = true;
+    return true;
+}
+
+void TorrentStorage::unmap()
+{
+    for (auto& file : files) {
+        if (file) file->unmap();
+    }
+    is_mapped = false;
+}
+
+bool TorrentStorage::flush(llong pos, size_t length, bool sync) const
+{
+    bool is_ok = true;
+    for (const auto& span : spans(pos, length)) {
+        if (!files[span.file]) continue;
+        is_ok = files[span.file]->flush(span.pos, span.length, sync) && is_ok;
+    }
+    return is_ok;
+}
+
+int TorrentStorage::fileAt(llong pos) const
+{
+    // Last file starting at or before pos, empty files share the offset of the
+    // next one and are skipped over
+    auto iter = upper_bound(offsets.begin(), offsets.end(), pos);
+    return static_cast<int>(iter - offsets.begin()) - 1;
+}
+
+auto TorrentStorage::spans(llong pos, size_t length) const -> vector<Span>
+{
+    vector<Span> result;
+    if (pos < 0 || pos + llong(length) > total_size) return result;
+
+    for (int idx = fileAt(pos); length > 0; ++idx) {
+        // Lengths come from the torrent, a short file on disk fails the I/O instead
+        llong file_end = idx + 1 < int(offsets.size()) ? offsets[idx + 1] : total_size;
+        llong file_pos = pos - offsets[idx];
+        llong in_file  = file_end - pos;
+        if (in_file <= 0) continue;
+
+        auto span_len = static_cast<size_t>(min<llong>(in_file, length));
+        result.push_back({idx, file_pos, span_len});
+        pos    += span_len;
+        length -= span_len;
+    }
+    return result;
+}
+
+auto TorrentStorage::presentSpans(llong pos, size_t length) const -> vector<Span>
+{
+    auto result = spans(pos, length);
+    for (const auto& span : result) {
+        if (!files[span.file]) return vector<Span>();
+    }
+    return result;
+}
+
+bool TorrentStorage::locate(llong pos, size_t length,
+                            FileStorage::Handle& handle, llong& file_pos) const
+{
+    auto file_spans = presentSpans(pos, length);
+    if (file_spans.size() != 1) return false;
+
+    handle   = files[file_spans[0].file]->handle();
+    file_pos = file_spans[0].pos;
+    return true;
+}
+
+bool TorrentStorage::write(llong pos, const char* data, size_t length) const
+{
+    auto file_spans = presentSpans(pos, length);
+    if (file_spans.empty() && length > 0) return false;
+
+    for (const auto& span : file_spans) {
+        if (!files[span.file]->write(span.pos, data, span.length)) return false;
+        data += span.length;
+    }
+    return true;
+}
+
+bool TorrentStorage::write(llong pos, const vector<ByteView>& parts) const
+{
+    size_t length = 0;
+    for (const auto& part : parts) length += part.size();
+    auto file_spans = presentSpans(pos, length);
+    if (file_spans.empty() && length > 0) return false;
+
+    // Cut the parts at file boundaries, each file gets one gathered write
+    size_t part_idx = 0, part_off = 0;
+    vector<ByteView> file_parts;
+    for (const auto& span : file_spans) {
+        file_parts.clear();
+        size_t remain = span.length;
+        while (remain > 0) {
+            const auto& part = parts[part_idx];
+            size_t step = min(remain, part.size() - part_off);
+            file_parts.push_back(part.sub(part_off, step));
+            remain   -= step;
+            part_off += step;
+            if (part_off == part.size()) {
+                ++part_idx;
+                part_off = 0;
+            }
+        }
+        if (!files[span.file]->write(span.pos, file_parts)) return false;
+    }
+    return true;
+}
+
+bool TorrentStorage::read(llong pos, size_t length, char* data) const
+{
+    auto file_spans = presentSpans(pos, length);
+    if (file_spans.empty() && length > 0) return false;
+
+    for (const auto& span : file_spans) {
+        if (!files[span.file]->read(span.pos, span.length, data)) return false;
+        data += span.length;
+    }
+    return true;
+}
+
+ByteView TorrentStorage::view(llong pos, size_t length) const
+{
+    auto file_spans = presentSpans(pos, length);
+    if (file_spans.size() != 1) return ByteView();
+    return files[file_spans[0].file]->view(file_spans[0].pos, length);
+}
+
+llong TorrentStorage::modifiedTime() const
+{
+    llong mtime = 0;
+    for (const auto& file : files) {
+        if (file) mtime = max(mtime, file->modifiedTime());
+    }
+    return mtime;
+}
@@ -0,0 +1,430 @@
+#include <chrono>
+#include "bencode.h"
+#include "tracker.h"
+
+using namespace std;
+using namespace cls;
+
+namespace {
+using sys_clock = chrono::steady_clock;
+
+const size_t MAX_REPLY_SIZE = 1 << 20;
+const size_t COMPACT_PEER_LEN = 6;
+
+// BEP 15 wire constants, all integers are big endian
+const uint64_t UDP_PROTOCOL_ID    = 0x41727101980ull;
+const uint32_t ACTION_CONNECT     = 0;
+const uint32_t ACTION_ANNOUNCE    = 1;
+const uint32_t ACTION_SCRAPE      = 2;
+const uint32_t ACTION_ERROR       = 3;
+const size_t   UDP_HEADER_LEN     = 16;
+const size_t   UDP_ANNOUNCE_LEN   = 98;
+const size_t   UDP_MAX_DATAGRAM   = 2048;
+const int      MAX_RETRANSMIT_SHIFT = 8;
+
+void put32(char* data, uint32_t value)
+{
+    for (int i = 3; i >= 0; --i, value >>= 8) data[i] = static_cast<char>(value & 0xFF);
+}
+
+void put64(char* data, uint64_t value)
+{
+    put32(data,     static_cast<uint32_t>(value >> 32));
+    put32(data + 4, static_cast<uint32_t>(value));
+}
+
+uint32_t get32(const char* data)
+{
+    const uchar* bytes = reinterpret_cast<const uchar*>(data);
+    return uint32_t(bytes[0]) << 24 | uint32_t(bytes[1]) << 16 |
+           uint32_t(bytes[2]) << 8  | uint32_t(bytes[3]);
+}
+
+uint64_t get64(const char* data)
+{
+    return uint64_t(get32(data)) << 32 | get32(data + 4);
+}
+
+// Wait until the socket is readable (or writable), false once deadline passed
+bool waitSocket(SOCKET sock, bool for_write, sys_clock::time_point deadline)
+{
+    chrono::duration<double> remaining = deadline - sys_clock::now();
+    if (remaining.count() <= 0) return false;
+
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(sock, &fds);
+    timeval wait_time {static_cast<long>(remaining.count()),
+                       static_cast<long>((remaining.count() - long(remaining.count())) * 1e6)};
+    return ::select(sock + 1, for_write ? nullptr : &fds, for_write ? &fds : nullptr,
+                    nullptr, &wait_time) > 0;
+}
+
+void urlEncode(const char* data, size_t length, string& out)
+{
+    const char* hex = "0123456789ABCDEF";
+    for (auto i = 0u; i < length; ++i) {
+        uchar c = data[i];
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+            out += c;
+        } else {
+            out += '%';
+            out += hex[c >> 4];
+            out += hex[c & 0xF];
+        }
+    }
+}
+} // Unnamed namespace
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// Tracker
+auto Tracker::create(const string& url) -> Ptr
+{
+    if (url.compare(0, 7, "http://") == 0) return Ptr(new HttpTracker(url));
+    if (url.compare(0, 6, "udp://") == 0)  return Ptr(new UdpTracker(url));
+    return nullptr;
+}
+
+bool Tracker::parseUrl(const string& url, string& host, ushort& port, string& path)
+{
+    auto host_begin = url.find("://");
+    if (host_begin == string::npos) return false;
+    host_begin += 3;
+
+    auto path_begin = url.find('/', host_begin);
+    if (path_begin == string::npos) path_begin = url.size();
+    path = path_begin < url.size() ? url.substr(path_begin) : "/";
+
+    auto port_begin = url.find(':', host_begin);
+    if (port_begin == string::npos || port_begin > path_begin) {
+        host = url.substr(host_begin, path_begin - host_begin);
+        port = url.compare(0, 7, "http://") == 0 ? 80 : 0;
+    } else {
+        host = url.substr(host_begin, port_begin - host_begin);
+        auto port_str = url.substr(port_begin + 1, path_begin - port_begin - 1);
+        if (port_str.empty() || port_str.size() > 5 ||
+            port_str.find_first_not_of("0123456789") != string::npos ||
+            stoi(port_str) > 0xFFFF) {
+            return false;
+        }
+        port = static_cast<ushort>(stoi(port_str));
+    }
+    return !host.empty() && port != 0;
+}
+
+bool Tracker::resolve(const string& host, ushort port, SockAddrIN& addr)
+{
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+
+    addrinfo* result = nullptr;
+    if (::getaddrinfo(host.c_str(), nullptr, &hints, &result) != 0 || !result) return false;
+    addr = *reinterpret_cast<const SockAddrIN*>(result->ai_addr);
+    addr.sin_port = htons(port);
+    ::freeaddrinfo(result);
+    return true;
+}
+
+bool Tracker::fail(const string& message)
+{
+    err_msg = message;
+    return false;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// HttpTracker
+bool HttpTracker::announce(const AnnounceRequest& request, AnnounceResponse& response)
+{
+    err_msg.clear();
+    string host, path;
+    ushort port = 0;
+    if (!parseUrl(tracker_url, host, port, path)) return fail("malformed url");
+
+    SockAddrIN addr;
+    if (!resolve(host, port, addr)) return fail("can't resolve " + host);
+
+    string reply;
+    if (!exchange(addr, requestLine(request, host, path), reply)) return false;
+    return parseReply(reply, response);
+}
+
+string HttpTracker::requestLine(const AnnounceRequest& request, const string& host,
+                                const string& path) const
+{
+    const char* event_name[] = {"", "completed", "started", "stopped"};
+
+    // HTTP/1.0, the tracker closes the connection after its reply
+    string line = "GET " + path + (path.find('?') == string::npos ? "?" : "&");
+    line += "info_hash=";
+    urlEncode(request.info_hash.data(), request.info_hash.size(), line);
+    line += "&peer_id=";
+    urlEncode(request.peer_id.data(), request.peer_id.size(), line);
+    line += "&port="       + to_string(request.port);
+    line += "&uploaded="   + to_string(request.uploaded);
+    line += "&downloaded=" + to_string(request.downloaded);
+    line += "&left="       + to_string(request.left);
+    line += "&numwant="    + to_string(request.num_want);
+    line += "&compact=1";
+    if (request.event != AnnounceRequest::None) {
+        line += string("&event=") + event_name[request.event];
+    }
+    line += " HTTP/1.0\r\nHost: " + host + "\r\nConnection: close\r\n\r\n";
+    return line;
+}
+
+bool HttpTracker::exchange(const SockAddrIN& addr, const string& request, string& reply)
+{
+    auto deadline = sys_clock::now() + chrono::duration_cast<sys_clock::duration>(
+                                           chrono::duration<double>(time_out));
+    char address[INET_ADDRSTRLEN];
+    ::inet_ntop(AF_INET, &addr.sin_addr, address, INET_ADDRSTRLEN);
+
+    TCPSocket sock;
+    if (!sock.connectAsync(address, addr.sin_port)) return fail("can't connect");
+    if (!waitSocket(sock.sock(), true, deadline) || !sock.finishConnect()) {
+        return fail("connection timed out or refused");
+    }
+
+    for (size_t sent = 0; sent < request.size();) {
+        if (!waitSocket(sock.sock(), true, deadline)) return fail("send timed out");
+        auto num_bytes = ::send(sock.sock(), request.data() + sent,
+                                request.size() - sent, MSG_NOSIGNAL);
+        if (num_bytes < 0 && !wouldBlock()) return fail("send failed");
+        if (num_bytes > 0) sent += num_bytes;
+    }
+
+    reply.clear();
+    char buffer[4096];
+    while (true) {
+        if (!waitSocket(sock.sock(), false, deadline)) return fail("reply timed out");
+        auto num_bytes = ::recv(sock.sock(), buffer, sizeof(buffer), 0);
+        if (num_bytes == 0) break;
+        if (num_bytes < 0) {
+            if (wouldBlock()) continue;
+            return fail("receive failed");
+        }
+        reply.append(buffer, num_bytes);
+        if (reply.size() > MAX_REPLY_SIZE) return fail("reply too large");
+    }
+    return true;
+}
+
+bool HttpTracker::parseReply(const string& reply, AnnounceResponse& response)
+{
+    // Status line "HTTP/1.x 200 ...", body after the empty line
+    auto status_begin = reply.find(' ');
+    if (reply.compare(0, 5, "HTTP/") != 0 || status_begin == string::npos ||
+        reply.compare(status_begin + 1, 3, "200") != 0) {
+        return fail("bad HTTP status: " + reply.substr(0, reply.find('\r')));
+    }
+    auto body_begin = reply.find("\r\n\r\n");
+    if (body_begin == string::npos) return fail("truncated HTTP reply");
+    body_begin += 4;
+
+    BencodeTree tree;
+    if (!tree.parse(ByteView(reply.data() + body_begin, reply.size() - body_begin))) {
+        return fail("malformed reply: " + tree.error());
+    }
+    auto root = tree.root();
+    if (!root.isDict()) return fail("reply is not a dictionary");
+    if (root["failure reason"].isBytes()) {
+        return fail("tracker refused: " + root["failure reason"].str());
+    }
+
+    response.interval     = static_cast<int>(root["interval"].integer());
+    response.min_interval = static_cast<int>(root["min interval"].integer());
+    response.seeders  = root["complete"].isInteger()   ? int(root["complete"].integer())   : -1;
+    response.leechers = root["incomplete"].isInteger() ? int(root["incomplete"].integer()) : -1;
+
+    // Compact peers are 4 bytes of address and 2 of port, already in network
+    // byte order, so they are copied as they are
+    auto peers = root["peers"];
+    response.peers.clear();
+    if (peers.isBytes()) {
+        auto data = peers.bytes();
+        if (data.size() % COMPACT_PEER_LEN != 0) return fail("malformed compact peer list");
+        response.peers.resize(data.size() / COMPACT_PEER_LEN);
+        for (auto i = 0u; i < response.peers.size(); ++i) {
+            memcpy(&response.peers[i].ip,   data.data() + i*COMPACT_PEER_LEN,     4);
+            memcpy(&response.peers[i].port, data.data() + i*COMPACT_PEER_LEN + 4, 2);
+        }
+    } else if (peers.isList()) {
+        response.peers.reserve(peers.size());
+        for (auto i = 0u; i < peers.size(); ++i) {
+            auto ip   = peers.at(i)["ip"];
+            auto port = peers.at(i)["port"];
+            in_addr address;
+            if (!ip.isBytes() || !port.isInteger() ||
+                port.integer() <= 0 || port.integer() > 0xFFFF ||
+                ::inet_pton(AF_INET, ip.str().c_str(), &address) != 1) {
+                continue;
+            }
+            response.peers.push_back({address.s_addr,
+                                      htons(static_cast<ushort>(port.integer()))});
+        }
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// UdpTracker
+UdpTracker::UdpTracker(const string& url) : Tracker(url)
+{
+    key = uniform_int_distribution<uint32_t>()(rd_engine);
+}
+
+auto UdpTracker::deadline() const -> sys_clock::time_point
+{
+    return sys_clock::now() + chrono::duration_cast<sys_clock::duration>(
+                                  chrono::duration<double>(time_out));
+}
+
+bool UdpTracker::open()
+{
+    if (sock) return true;
+
+    string host, path;
+    ushort port = 0;
+    SockAddrIN addr;
+    if (!parseUrl(tracker_url, host, port, path)) return fail("malformed url");
+    if (!resolve(host, port, addr)) return fail("can't resolve " + host);
+
+    // A connected datagram socket only hears from the tracker
+    char address[INET_ADDRSTRLEN];
+    ::inet_ntop(AF_INET, &addr.sin_addr, address, INET_ADDRSTRLEN);
+    unique_ptr<UDPSocket> udp_sock(new UDPSocket);
+    if (!udp_sock->isValid() || !udp_sock->connect(address, addr.sin_port)) {
+        return fail("can't open socket");
+    }
+    sock = move(udp_sock);
+    return true;
+}
+
+bool UdpTracker::connect(sys_clock::time_point deadline)
+{
+    chrono::duration<double> age = sys_clock::now() - connected_at;
+    if (is_connected && age.count() < id_life) return true;
+    is_connected = false;
+
+    ByteArray request(UDP_HEADER_LEN), reply;
+    put64(request.data(), UDP_PROTOCOL_ID);
+    put32(request.data() + 8, ACTION_CONNECT);
+    if (!transact(request, ACTION_CONNECT, reply, deadline)) return false;
+    if (reply.size() < UDP_HEADER_LEN) return fail("short connect reply");
+
+    connection_id = get64(reply.data() + 8);
+    connected_at  = sys_clock::now();
+    is_connected  = true;
+    return true;
+}
+
+bool UdpTracker::transact(ByteArray& request, uint32_t action, ByteArray& reply,
+                          sys_clock::time_point deadline)
+{
+    uint32_t transaction_id = uniform_int_distribution<uint32_t>()(rd_engine);
+    put32(request.data() + 12, transaction_id);
+
+    reply.resize(UDP_MAX_DATAGRAM);
+    for (int n = 0; n < retransmit_tries; ++n) {
+        if (sys_clock::now() >= deadline) break;
+        if (!sock->write(request.data(), request.size())) return fail("send failed");
+
+        auto wait = chrono::duration<double>(
+            retransmit_base * (1 << min(n, MAX_RETRANSMIT_SHIFT)));
+        auto resend_at = min(deadline, sys_clock::now() +
+                             chrono::duration_cast<sys_clock::duration>(wait));
+        while (waitSocket(sock->sock(), false, resend_at)) {
+            auto num_bytes = ::recv(sock->sock(), reply.data(), reply.size(), 0);
+            // Stale replies of earlier tries or other requests are dropped
+            if (num_bytes < 8 || get32(reply.data() + 4) != transaction_id) continue;
+
+            if (get32(reply.data()) == ACTION_ERROR) {
+                return fail("tracker refused: " + string(reply.data() + 8, num_bytes - 8));
+            }
+            if (get32(reply.data()) != action) return fail("unexpected reply action");
+            reply.resize(num_bytes);
+            return true;
+        }
+    }
+    return fail("no reply");
+}
+
+bool UdpTracker::announce(const AnnounceRequest& request, AnnounceResponse& response)
+{
+    err_msg.clear();
+    auto until = deadline();
+    if (!open() || !connect(until)) return false;
+
+    ByteArray packet(UDP_ANNOUNCE_LEN), reply;
+    auto data = packet.data();
+    string peer_id = request.peer_id;
+    peer_id.resize(20, '\0');
+    put64(data, connection_id);
+    put32(data + 8, ACTION_ANNOUNCE);
+    memcpy(data + 16, request.info_hash.data(), 20);
+    memcpy(data + 36, peer_id.data(), 20);
+    put64(data + 56, request.downloaded);
+    put64(data + 64, request.left);
+    put64(data + 72, request.uploaded);
+    put32(data + 80, request.event);
+    put32(data + 84, 0);  // let the tracker take the source address
+    put32(data + 88, key);
+    put32(data + 92, request.num_want);
+    data[96] = static_cast<char>(request.port >> 8);
+    data[97] = static_cast<char>(request.port & 0xFF);
+    if (!transact(packet, ACTION_ANNOUNCE, reply, until)) {
+        // The id may be what the tracker objects to, get a fresh one next time
+        is_connected = false;
+        return false;
+    }
+    if (reply.size() < 20) return fail("short announce reply");
+
+    response.interval     = static_cast<int>(get32(reply.data() + 8));
+    response.min_interval = 0;
+    response.leechers     = static_cast<int>(get32(reply.data() + 12));
+    response.seeders      = static_cast<int>(get32(reply.data() + 16));
+
+    // Same layout as the compact list of HTTP trackers
+    size_t num_peers = (reply.size() - 20) / COMPACT_PEER_LEN;
+    response.peers.resize(num_peers);
+    for (auto i = 0u; i < num_peers; ++i) {
+        memcpy(&response.peers[i].ip,   reply.data() + 20 + i*COMPACT_PEER_LEN,     4);
+        memcpy(&response.peers[i].port, reply.data() + 20 + i*COMPACT_PEER_LEN + 4, 2);
+    }
+    return true;
+}
+
+bool UdpTracker::scrape(const vector<ByteArray>& info_hashes, vector<ScrapeResult>& results)
+{
+    err_msg.clear();
+    results.clear();
+    auto until = deadline();
+    if (!open()) return false;
+
+    ByteArray packet, reply;
+    for (size_t first = 0; first < info_hashes.size(); first += MAX_SCRAPE_HASHES) {
+        size_t num_hashes = min<size_t>(MAX_SCRAPE_HASHES, info_hashes.size() - first);
+        if (!connect(until)) return false;
+
+        packet.resize(UDP_HEADER_LEN + 20 * num_hashes);
+        put64(packet.data(), connection_id);
+        put32(packet.data() + 8, ACTION_SCRAPE);
+        for (auto i = 0u; i < num_hashes; ++i) {
+            memcpy(packet.data() + UDP_HEADER_LEN + 20*i, info_hashes[first + i].data(), 20);
+        }
+        if (!transact(packet, ACTION_SCRAPE, reply, until)) {
+            is_connected = false;
+            return false;
+        }
+        if (reply.size() < 8 + 12 * num_hashes) return fail("short scrape reply");
+
+        for (auto i = 0u; i < num_hashes; ++i) {
+            const char* counts = reply.data() + 8 + 12*i;
+            results.push_back({static_cast<int>(get32(counts)),
+                               static_cast<int>(get32(counts + 4)),
+                               static_cast<int>(get32(counts + 8))});
+        }
+    }
+    return true;
+}
@@ -0,0 +1,122 @@
+#include <cstring>
+#include "write_cache.h"
+
+using namespace std;
+using namespace tbb;
+using namespace cls;
+
+void WriteCache::init(const TorrentStorage* storage, int piece_len,
+                      WrittenFunc written, RecycleFunc recycle)
+{
+    file          = storage;
+    piece_length  = piece_len;
+    written_func  = written;
+    recycle_func  = recycle;
+    dirty_bytes   = 0;
+    num_writes    = 0;
+    written_bytes = 0;
+}
+
+bool WriteCache::add(int idx, ByteArray&& data)
+{
+    {
+        spin_mutex::scoped_lock lock(cache_mtx);
+        if (!pieces.count(idx)) {
+            dirty_bytes += data.size();
+            pieces[idx] = move(data);
+        }
+    }
+    if (!data.empty() && recycle_func) recycle_func(move(data));
+
+    if (dirty_bytes < max<size_t>(cache_capacity, 1) || flush()) return true;
+
+    // Other pieces that failed stay dirty and are tried again, this one is given
+    // back unless it made it to the file. A flush running on another thread holds
+    // pointers to the buffers it writes, so the piece only leaves under flush_mtx
+    ByteArray buffer;
+    {
+        mutex::scoped_lock flush_lock(flush_mtx);
+        spin_mutex::scoped_lock lock(cache_mtx);
+        auto iter = pieces.find(idx);
+        if (iter == pieces.end()) return true;
+        dirty_bytes -= iter->second.size();
+        buffer = move(iter->second);
+        pieces.erase(iter);
+    }
+    if (recycle_func) recycle_func(move(buffer));
+    return false;
+}
+
+bool WriteCache::flush()
+{
+    mutex::scoped_lock flush_lock(flush_mtx);
+
+    // Pieces only leave the map under flush_mtx, so the buffers stay put while we
+    // write without holding the map lock, and readers keep finding them meanwhile
+    vector<pair<int, const ByteArray*>> dirty;
+    {
+        spin_mutex::scoped_lock lock(cache_mtx);
+        for (auto& entry : pieces) dirty.emplace_back(entry.first, &entry.second);
+    }
+    if (dirty.empty()) return true;
+
+    bool is_ok = true;
+    vector<int> written;
+    vector<ByteView> run;
+    for (size_t first = 0, last = 0; first < dirty.size(); first = last) {
+        run.clear();
+        size_t length = 0;
+        for (last = first; last < dirty.size() &&
+             dirty[last].first == dirty[first].first + int(last - first); ++last) {
+            run.emplace_back(dirty[last].second->data(), dirty[last].second->size());
+            length += dirty[last].second->size();
+        }
+
+        llong pos = llong(dirty[first].first) * piece_length;
+        if (!file->write(pos, run)) {
+            is_ok = false;
+            continue;
+        }
+        ++num_writes;
+        written_bytes += length;
+        if (written_func) written_func(pos, length);
+        for (auto i = first; i < last; ++i) written.push_back(dirty[i].first);
+    }
+
+    vector<ByteArray> buffers;
+    {
+        spin_mutex::scoped_lock lock(cache_mtx);
+        for (auto idx : written) {
+            auto iter = pieces.find(idx);
+            if (iter == pieces.end()) continue;
+            dirty_bytes -= iter->second.size();
+            buffers.push_back(move(iter->second));
+            pieces.erase(iter);
+        }
+    }
+    if (recycle_func) {
+        for (auto& buffer : buffers) recycle_func(move(buffer));
+    }
+
+    return is_ok;
+}
+
+bool WriteCache::contains(int idx) const
+{
+    spin_mutex::scoped_lock lock(cache_mtx);
+    return pieces.count(idx) != 0;
+}
+
+bool WriteCache::read(int idx, int offset, int length, ByteArray& buffer) const
+{
+    spin_mutex::scoped_lock lock(cache_mtx);
+    auto iter = pieces.find(idx);
+    if (iter == pieces.end() || offset < 0 || length < 0 ||
+        size_t(offset + length) > iter->second.size()) {
+        return false;
+    }
+
+    buffer.resize(length);
+    memcpy(buffer.data(), iter->second.data() + offset, length);
+    return true;
+}
@@ -0,0 +1,254 @@
+#include <iostream>
+#include <thread>
+#include <dirent.h>
+#include "tracker.h"
+
+using namespace std;
+using namespace cls;
+
+// HttpTracker against a stand-in tracker on the loopback interface, which takes
+// one connection per announce, records the request and answers with a canned
+// reply: compact and dictionary peer lists, a failure reason, broken replies, URL
+// escaping of the request, and no descriptor left behind by a refused connect
+namespace {
+int num_failed = 0;
+
+void check(bool is_ok, const string& what)
+{
+    if (is_ok) return;
+    cout << "FAILED: " << what << endl;
+    ++num_failed;
+}
+
+class StandInTracker {
+public:
+    StandInTracker() {
+        listen_sock = ::socket(AF_INET, SOCK_STREAM, 0);
+        SockAddrIN addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family      = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addr_len   = sizeof(addr);
+        if (::bind(listen_sock, (SockAddr*)&addr, addr_len) < 0 ||
+            ::listen(listen_sock, 4) < 0 ||
+            ::getsockname(listen_sock, (SockAddr*)&addr, &addr_len) < 0) {
+            throw runtime_error("can't listen on the loopback interface");
+        }
+        port = ntohs(addr.sin_port);
+    }
+    ~StandInTracker() { CLOSESOCKET(listen_sock); }
+
+    ushort listenPort() const { return port; }
+    string url(const string& path = "/announce") const {
+        return "http://127.0.0.1:" + to_string(port) + path;
+    }
+
+    // Announce while the stand-in serves one connection with reply, a reply of
+    // nullptr leaves the request unanswered until the client gives up
+    bool announce(HttpTracker& tracker, const AnnounceRequest& request,
+                  AnnounceResponse& response, const char* reply, size_t reply_len) {
+        received.clear();
+        thread server([&] {
+            SOCKET sock = ::accept(listen_sock, nullptr, nullptr);
+            if (sock == INVALID_SOCKET) return;
+            char buffer[1024];
+            while (received.find("\r\n\r\n") == string::npos) {
+                auto num_bytes = ::recv(sock, buffer, sizeof(buffer), 0);
+                if (num_bytes <= 0) break;
+                received.append(buffer, num_bytes);
+            }
+            if (reply) {
+                ::send(sock, reply, reply_len, MSG_NOSIGNAL);
+            } else {
+                ::recv(sock, buffer, sizeof(buffer), 0);  // until the client hangs up
+            }
+            CLOSESOCKET(sock);
+        });
+        bool is_ok = tracker.announce(request, response);
+        server.join();
+        return is_ok;
+    }
+    bool announce(HttpTracker& tracker, const AnnounceRequest& request,
+                  AnnounceResponse& response, const string& reply) {
+        return announce(tracker, request, response, reply.data(), reply.size());
+    }
+
+    // The request line and headers of the last announce
+    string received;
+
+private:
+    SOCKET listen_sock;
+    ushort port;
+};
+
+AnnounceRequest makeRequest()
+{
+    AnnounceRequest request;
+    request.info_hash  = ByteArray(20, 'h');
+    request.peer_id    = "-BT0001-abcdefghijkl";
+    request.port       = 6881;
+    request.uploaded   = 1;
+    request.downloaded = 2;
+    request.left       = 3;
+    request.event      = AnnounceRequest::Started;
+    request.num_want   = 50;
+    return request;
+}
+
+string okReply(const string& body)
+{
+    return "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\n" + body;
+}
+
+int openDescriptors()
+{
+    int count = 0;
+    if (DIR* dir = ::opendir("/proc/self/fd")) {
+        while (::readdir(dir)) ++count;
+        ::closedir(dir);
+    }
+    return count;
+}
+
+void testCompactPeers(StandInTracker& stand_in)
+{
+    HttpTracker tracker(stand_in.url());
+    AnnounceResponse response;
+    const char peers[] = "\x0A\x00\x00\x01\x1A\xE1" "\xC0\xA8\x01\x02\x00\x50";
+    bool is_ok = stand_in.announce(tracker, makeRequest(), response, okReply(
+        "d8:completei5e10:incompletei3e8:intervali900e12:min intervali60e"
+        "5:peers12:" + string(peers, 12) + "e"));
+
+    check(is_ok, "compact reply accepted: " + tracker.error());
+    check(response.interval == 900 && response.min_interval == 60,
+          "compact reply intervals");
+    check(response.seeders == 5 && response.leechers == 3, "compact reply counts");
+    check(response.peers.size() == 2, "compact reply has 2 peers");
+    if (response.peers.size() == 2) {
+        check(response.peers[0].ip == htonl(0x0A000001) &&
+              response.peers[0].port == htons(6881), "first compact peer");
+        check(response.peers[1].ip == htonl(0xC0A80102) &&
+              response.peers[1].port == htons(80), "second compact peer");
+    }
+
+    is_ok = stand_in.announce(tracker, makeRequest(), response,
+                              okReply("d8:intervali900e5:peers7:1234567e"));
+    check(!is_ok, "compact list of 7 bytes refused");
+}
+
+void testDictPeers(StandInTracker& stand_in)
+{
+    HttpTracker tracker(stand_in.url());
+    AnnounceResponse response;
+    bool is_ok = stand_in.announce(tracker, makeRequest(), response, okReply(
+        "d8:intervali1800e5:peersl"
+        "d2:ip8:10.0.0.77:peer id20:-XX0001-000000000000"
+        "4:porti6881ee"
+        "d2:ip9:not an ip4:porti6882ee"
+        "d2:ip8:10.0.0.84:porti70000ee"
+        "ee"));
+
+    check(is_ok, "dictionary reply accepted: " + tracker.error());
+    check(response.interval == 1800, "dictionary reply interval");
+    check(response.seeders == -1 && response.leechers == -1,
+          "counts missing from dictionary reply");
+    check(response.peers.size() == 1, "dictionary reply keeps only the valid peer");
+    if (response.peers.size() == 1) {
+        check(response.peers[0].ip == htonl(0x0A000007) &&
+              response.peers[0].port == htons(6881), "dictionary peer");
+    }
+}
+
+void testFailures(StandInTracker& stand_in)
+{
+    HttpTracker tracker(stand_in.url());
+    AnnounceResponse response;
+
+    bool is_ok = stand_in.announce(tracker, makeRequest(), response,
+                                   okReply("d14:failure reason12:unregisterede"));
+    check(!is_ok && tracker.error().find("unregistered") != string::npos,
+          "failure reason reported: " + tracker.error());
+
+    is_ok = stand_in.announce(tracker, makeRequest(), response,
+                              okReply("d8:intervali900e5:peers12:abc"));
+    check(!is_ok && tracker.error().find("malformed reply") != string::npos,
+          "truncated body refused: " + tracker.error());
+
+    is_ok = stand_in.announce(tracker, makeRequest(), response,
+                              string("HTTP/1.0 200 OK\r\nContent-Length: 10\r\n"));
+    check(!is_ok && tracker.error().find("truncated HTTP reply") != string::npos,
+          "truncated header refused: " + tracker.error());
+
+    is_ok = stand_in.announce(tracker, makeRequest(), response,
+                              string("HTTP/1.0 404 Not Found\r\n\r\n"));
+    check(!is_ok && tracker.error().find("bad HTTP status") != string::npos,
+          "HTTP error status refused: " + tracker.error());
+
+    is_ok = stand_in.announce(tracker, makeRequest(), response, okReply("le"));
+    check(!is_ok, "reply that isn't a dictionary refused");
+
+    tracker.setTimeOut(0.3);
+    is_ok = stand_in.announce(tracker, makeRequest(), response, nullptr, 0);
+    check(!is_ok && tracker.error().find("timed out") != string::npos,
+          "silent tracker times out: " + tracker.error());
+}
+
+void testRequestLine(StandInTracker& stand_in)
+{
+    HttpTracker tracker(stand_in.url("/announce?passkey=k3y"));
+    AnnounceResponse response;
+    auto request = makeRequest();
+    const char hash[] = "\x00\x20\x25\x7E\x41\xFF\x2F\x3F\x26\x3D"
+                        "\x2D\x5F\x2E\x80\x7F\x61\x7A\x30\x39\x0A";
+    request.info_hash = ByteArray(hash, hash + 20);
+    request.peer_id   = "-BT0001-a b&c=d%e~f.";
+    request.event     = AnnounceRequest::Completed;
+    stand_in.announce(tracker, request, response, okReply("d8:intervali900ee"));
+
+    const auto& line = stand_in.received;
+    check(line.compare(0, 30, "GET /announce?passkey=k3y&info") == 0,
+          "query appended to the path of the url: " + line.substr(0, 40));
+    check(line.find("info_hash=%00%20%25~A%FF%2F%3F%26%3D-_.%80%7Faz09%0A&") !=
+          string::npos, "info_hash escaped");
+    check(line.find("peer_id=-BT0001-a%20b%26c%3Dd%25e~f.&") != string::npos,
+          "peer_id escaped");
+    check(line.find("&port=6881&uploaded=1&downloaded=2&left=3&numwant=50"
+                    "&compact=1&event=completed HTTP/1.0\r\n") != string::npos,
+          "announce parameters");
+    check(line.find("\r\nHost: 127.0.0.1\r\n") != string::npos, "Host header");
+
+    request.event = AnnounceRequest::None;
+    stand_in.announce(tracker, request, response, okReply("d8:intervali900ee"));
+    check(stand_in.received.find("event=") == string::npos, "no event for a regular announce");
+}
+
+void testRefused()
+{
+    // A port nobody listens on, taken from a socket closed right away
+    ushort port = StandInTracker().listenPort();
+    HttpTracker tracker("http://127.0.0.1:" + to_string(port) + "/announce");
+    AnnounceResponse response;
+    check(!tracker.announce(makeRequest(), response), "refused connection fails");
+
+    int num_open = openDescriptors();
+    for (auto i = 0; i < 20; ++i) tracker.announce(makeRequest(), response);
+    check(openDescriptors() == num_open, "refused connections leave no descriptor open");
+}
+} // Unnamed namespace
+
+int main()
+{
+    StandInTracker stand_in;
+    testCompactPeers(stand_in);
+    testDictPeers(stand_in);
+    testFailures(stand_in);
+    testRequestLine(stand_in);
+    testRefused();
+
+    if (num_failed > 0) {
+        cout << num_failed << " checks failed" << endl;
+        return 1;
+    }
+    cout << "All checks passed" << endl;
+    return 0;
+}
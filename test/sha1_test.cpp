@@ -0,0 +1,108 @@
+#include <iostream>
+#include <random>
+#include <openssl/sha.h>
+#include "sha1.h"
+
+using namespace std;
+using namespace cls;
+
+// Every SHA1 implementation the CPU supports against OpenSSL's SHA1(): single
+// buffers of every length around the padding boundaries, batches of 1 to 8 lanes
+// with equal and mixed lengths, and batches of whole pieces
+namespace {
+const size_t MAX_SHORT_LEN = 300;
+const size_t PIECE_LEN     = 512 * 1024;
+
+default_random_engine rd_engine(2014);
+int num_failed = 0;
+
+ByteArray randomData(size_t length)
+{
+    uniform_int_distribution<int> byte(0, 255);
+    ByteArray data(length);
+    for (auto& c : data) c = static_cast<char>(byte(rd_engine));
+    return data;
+}
+
+ByteArray expected(const ByteArray& data)
+{
+    ByteArray digest(Sha1::DIGEST_LEN);
+    SHA1(reinterpret_cast<const uchar*>(data.data()), data.size(),
+         reinterpret_cast<uchar*>(digest.data()));
+    return digest;
+}
+
+void check(bool is_ok, const string& what)
+{
+    if (is_ok) return;
+    cout << "FAILED: " << Sha1::implName() << ", " << what << endl;
+    ++num_failed;
+}
+
+void checkMany(const vector<ByteArray>& buffers, const string& what)
+{
+    int n = static_cast<int>(buffers.size());
+    vector<const char*> data(n);
+    vector<size_t>      length(n);
+    vector<ByteArray>   digests(n, ByteArray(Sha1::DIGEST_LEN));
+    vector<char*>       digest_ptrs(n);
+    for (auto i = 0; i < n; ++i) {
+        data[i]        = buffers[i].data();
+        length[i]      = buffers[i].size();
+        digest_ptrs[i] = digests[i].data();
+    }
+    Sha1::hashMany(data.data(), length.data(), n, digest_ptrs.data());
+
+    for (auto i = 0; i < n; ++i) {
+        check(digests[i] == expected(buffers[i]),
+              what + ", lane " + to_string(i) + " of " + to_string(n) +
+              ", length " + to_string(length[i]));
+    }
+}
+
+void testImpl()
+{
+    for (auto length = 0u; length <= MAX_SHORT_LEN; ++length) {
+        auto data = randomData(length);
+        check(Sha1::hash(data.data(), length) == expected(data),
+              "single buffer, length " + to_string(length));
+    }
+
+    // Lanes of one length take the multi-buffer path
+    uniform_int_distribution<size_t> short_len(0, MAX_SHORT_LEN);
+    for (auto n = 1; n <= Sha1::MAX_LANES; ++n) {
+        for (auto length : {size_t(0), size_t(55), size_t(56), size_t(64),
+                            size_t(119), size_t(120), short_len(rd_engine)}) {
+            vector<ByteArray> buffers;
+            for (auto i = 0; i < n; ++i) buffers.push_back(randomData(length));
+            checkMany(buffers, "equal lengths");
+        }
+
+        vector<ByteArray> buffers;
+        for (auto i = 0; i < n; ++i) buffers.push_back(randomData(short_len(rd_engine)));
+        checkMany(buffers, "mixed lengths");
+    }
+
+    // A full batch of pieces with a shorter last piece among them
+    vector<ByteArray> pieces;
+    for (auto i = 0; i < Sha1::MAX_LANES + 3; ++i) pieces.push_back(randomData(PIECE_LEN));
+    pieces.push_back(randomData(PIECE_LEN / 3));
+    checkMany(pieces, "pieces");
+}
+} // Unnamed namespace
+
+int main()
+{
+    for (auto impl : {Sha1::OpenSSL, Sha1::ShaNi, Sha1::Avx2}) {
+        if (!Sha1::setImpl(impl)) continue;
+        cout << "Testing " << Sha1::implName() << endl;
+        testImpl();
+    }
+
+    if (num_failed > 0) {
+        cout << num_failed << " checks failed" << endl;
+        return 1;
+    }
+    cout << "All checks passed" << endl;
+    return 0;
+}
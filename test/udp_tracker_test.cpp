@@ -0,0 +1,385 @@
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include "tracker.h"
+
+using namespace std;
+using namespace cls;
+
+// UdpTracker against a stand-in tracker on the loopback interface. Each test
+// scripts the replies of the stand-in and checks what the client sent: the
+// connect and announce exchange, replies to other transactions, error replies,
+// retransmission of lost requests, renewal of the connection id and scrapes
+// split over datagrams
+namespace {
+const uint64_t PROTOCOL_ID     = 0x41727101980ull;
+const uint64_t CONNECTION_ID   = 0x1122334455667788ull;
+const uint32_t ACTION_CONNECT  = 0;
+const uint32_t ACTION_ANNOUNCE = 1;
+const uint32_t ACTION_SCRAPE   = 2;
+const uint32_t ACTION_ERROR    = 3;
+
+int num_failed = 0;
+
+void check(bool is_ok, const string& what)
+{
+    if (is_ok) return;
+    cout << "FAILED: " << what << endl;
+    ++num_failed;
+}
+
+void put32(ByteArray& data, uint32_t value)
+{
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        data.push_back(static_cast<char>(value >> shift));
+    }
+}
+
+void put64(ByteArray& data, uint64_t value)
+{
+    put32(data, static_cast<uint32_t>(value >> 32));
+    put32(data, static_cast<uint32_t>(value));
+}
+
+uint32_t get32(const ByteArray& data, size_t pos)
+{
+    const uchar* bytes = reinterpret_cast<const uchar*>(data.data() + pos);
+    return uint32_t(bytes[0]) << 24 | uint32_t(bytes[1]) << 16 |
+           uint32_t(bytes[2]) << 8  | uint32_t(bytes[3]);
+}
+
+uint64_t get64(const ByteArray& data, size_t pos)
+{
+    return uint64_t(get32(data, pos)) << 32 | get32(data, pos + 4);
+}
+
+ByteArray replyHeader(uint32_t action, uint32_t transaction_id)
+{
+    ByteArray reply;
+    put32(reply, action);
+    put32(reply, transaction_id);
+    return reply;
+}
+
+ByteArray connectReply(const ByteArray& request)
+{
+    auto reply = replyHeader(ACTION_CONNECT, get32(request, 12));
+    put64(reply, CONNECTION_ID);
+    return reply;
+}
+
+ByteArray announceReply(const ByteArray& request, uint32_t interval)
+{
+    auto reply = replyHeader(ACTION_ANNOUNCE, get32(request, 12));
+    put32(reply, interval);
+    put32(reply, 4);  // leechers
+    put32(reply, 7);  // seeders
+    const char peers[] = "\x0A\x00\x00\x01\x1A\xE1" "\xC0\xA8\x01\x02\x00\x50";
+    reply.append(peers, 12);
+    return reply;
+}
+
+class StandInTracker {
+public:
+    // Replies to one request, the stand-in sends them in order
+    using Script = function<vector<ByteArray>(const ByteArray& request)>;
+
+    StandInTracker() {
+        sock = ::socket(AF_INET, SOCK_DGRAM, 0);
+        SockAddrIN addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family      = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addr_len   = sizeof(addr);
+        if (::bind(sock, (SockAddr*)&addr, addr_len) < 0 ||
+            ::getsockname(sock, (SockAddr*)&addr, &addr_len) < 0) {
+            throw runtime_error("can't bind on the loopback interface");
+        }
+        port   = ntohs(addr.sin_port);
+        server = thread([this] { serve(); });
+    }
+    ~StandInTracker() {
+        running = false;
+        server.join();
+        CLOSESOCKET(sock);
+    }
+
+    string url() const { return "udp://127.0.0.1:" + to_string(port); }
+
+    void setScript(const Script& reply_script) {
+        lock_guard<mutex> lock(mtx);
+        script = reply_script;
+        received.clear();
+    }
+
+    // Requests received since the script was set, of one action
+    vector<ByteArray> requests(uint32_t action) {
+        lock_guard<mutex> lock(mtx);
+        vector<ByteArray> result;
+        for (const auto& request : received) {
+            if (get32(request, 8) == action) result.push_back(request);
+        }
+        return result;
+    }
+
+private:
+    void serve() {
+        char buffer[2048];
+        while (running) {
+            fd_set fds;
+            FD_ZERO(&fds);
+            FD_SET(sock, &fds);
+            timeval wait_time {0, 20000};
+            if (::select(sock + 1, &fds, nullptr, nullptr, &wait_time) <= 0) continue;
+
+            SockAddrIN from;
+            socklen_t from_len = sizeof(from);
+            auto num_bytes = ::recvfrom(sock, buffer, sizeof(buffer), 0,
+                                        (SockAddr*)&from, &from_len);
+            if (num_bytes < 16) continue;
+
+            ByteArray request(buffer, buffer + num_bytes);
+            vector<ByteArray> replies;
+            {
+                lock_guard<mutex> lock(mtx);
+                received.push_back(request);
+                if (script) replies = script(request);
+            }
+            for (const auto& reply : replies) {
+                ::sendto(sock, reply.data(), reply.size(), 0, (SockAddr*)&from, from_len);
+            }
+        }
+    }
+
+    SOCKET sock;
+    ushort port;
+    thread server;
+    atomic<bool> running {true};
+
+    mutex  mtx;
+    Script script;
+    vector<ByteArray> received;
+};
+
+// Connect and announce as a tracker should
+vector<ByteArray> answer(const ByteArray& request)
+{
+    switch (get32(request, 8)) {
+    case ACTION_CONNECT:  return {connectReply(request)};
+    case ACTION_ANNOUNCE: return {announceReply(request, 1200)};
+    default:              return {};
+    }
+}
+
+AnnounceRequest makeRequest()
+{
+    AnnounceRequest request;
+    request.info_hash  = ByteArray(20, 'h');
+    request.peer_id    = "-BT0001-abcdefghijkl";
+    request.port       = 6881;
+    request.uploaded   = 1;
+    request.downloaded = 2;
+    request.left       = 3;
+    request.event      = AnnounceRequest::Started;
+    request.num_want   = 50;
+    return request;
+}
+
+unique_ptr<UdpTracker> makeTracker(const StandInTracker& stand_in)
+{
+    unique_ptr<UdpTracker> tracker(new UdpTracker(stand_in.url()));
+    tracker->setTimeOut(3);
+    tracker->setRetransmit(0.1, 4);
+    return tracker;
+}
+
+void testAnnounce(StandInTracker& stand_in)
+{
+    stand_in.setScript(answer);
+    auto tracker = makeTracker(stand_in);
+    AnnounceResponse response;
+    check(tracker->announce(makeRequest(), response), "announce: " + tracker->error());
+    check(response.interval == 1200 && response.leechers == 4 && response.seeders == 7,
+          "announce reply counts");
+    check(response.peers.size() == 2, "announce reply has 2 peers");
+    if (response.peers.size() == 2) {
+        check(response.peers[0].ip == htonl(0x0A000001) &&
+              response.peers[0].port == htons(6881), "first peer");
+        check(response.peers[1].ip == htonl(0xC0A80102) &&
+              response.peers[1].port == htons(80), "second peer");
+    }
+
+    auto connects  = stand_in.requests(ACTION_CONNECT);
+    auto announces = stand_in.requests(ACTION_ANNOUNCE);
+    check(connects.size() == 1 && connects[0].size() == 16 &&
+          get64(connects[0], 0) == PROTOCOL_ID, "one connect request");
+    check(announces.size() == 1 && announces[0].size() == 98, "one announce request");
+    if (announces.size() == 1) {
+        const auto& packet = announces[0];
+        check(get64(packet, 0) == CONNECTION_ID, "announce uses the connection id");
+        check(packet.sub(16, 20) == ByteArray(20, 'h'), "announce info_hash");
+        check(packet.sub(36, 20) == ByteArray(makeRequest().peer_id), "announce peer_id");
+        check(get64(packet, 56) == 2 && get64(packet, 64) == 3 && get64(packet, 72) == 1,
+              "announce downloaded, left and uploaded");
+        check(get32(packet, 80) == 2 && get32(packet, 92) == 50, "announce event and num_want");
+        check(uchar(packet[96]) == 0x1A && uchar(packet[97]) == 0xE1, "announce port");
+    }
+
+    // The connection id is still valid, no second connect
+    check(tracker->announce(makeRequest(), response), "second announce");
+    check(stand_in.requests(ACTION_CONNECT).size() == 1 &&
+          stand_in.requests(ACTION_ANNOUNCE).size() == 2, "connection id reused");
+}
+
+void testTransactionId(StandInTracker& stand_in)
+{
+    // A reply to some other transaction comes first and must be ignored
+    stand_in.setScript([](const ByteArray& request) -> vector<ByteArray> {
+        if (get32(request, 8) == ACTION_CONNECT) return {connectReply(request)};
+        auto stale = announceReply(request, 1);
+        stale[7] ^= 0x5A;
+        return {stale, announceReply(request, 1200)};
+    });
+    auto tracker = makeTracker(stand_in);
+    AnnounceResponse response;
+    check(tracker->announce(makeRequest(), response) && response.interval == 1200,
+          "reply of another transaction ignored");
+    check(stand_in.requests(ACTION_ANNOUNCE).size() == 1, "no retransmit for a stale reply");
+}
+
+void testError(StandInTracker& stand_in)
+{
+    stand_in.setScript([](const ByteArray& request) -> vector<ByteArray> {
+        if (get32(request, 8) == ACTION_CONNECT) return {connectReply(request)};
+        auto reply = replyHeader(ACTION_ERROR, get32(request, 12));
+        reply.append("unknown torrent");
+        return {reply};
+    });
+    auto tracker = makeTracker(stand_in);
+    AnnounceResponse response;
+    check(!tracker->announce(makeRequest(), response) &&
+          tracker->error() == "tracker refused: unknown torrent",
+          "error reply reported: " + tracker->error());
+
+    // The connection id may be what the tracker objects to, it is renewed
+    stand_in.setScript(answer);
+    check(tracker->announce(makeRequest(), response), "announce after error");
+    check(stand_in.requests(ACTION_CONNECT).size() == 1, "connect again after error");
+}
+
+void testRetransmit(StandInTracker& stand_in)
+{
+    // The first two connect requests are lost
+    int num_dropped = 0;
+    stand_in.setScript([&num_dropped](const ByteArray& request) -> vector<ByteArray> {
+        if (get32(request, 8) == ACTION_CONNECT && num_dropped < 2) {
+            ++num_dropped;
+            return {};
+        }
+        return answer(request);
+    });
+    auto tracker = makeTracker(stand_in);
+    AnnounceResponse response;
+    check(tracker->announce(makeRequest(), response), "announce over lossy link");
+    auto connects = stand_in.requests(ACTION_CONNECT);
+    check(connects.size() == 3, "connect sent 3 times, got " + to_string(connects.size()));
+    if (connects.size() == 3) {
+        check(get32(connects[0], 12) == get32(connects[2], 12),
+              "retransmits keep the transaction id");
+    }
+
+    // Nothing ever comes back, every try is used, waiting 0.1, 0.2 and 0.4s
+    stand_in.setScript(nullptr);
+    tracker = makeTracker(stand_in);
+    tracker->setRetransmit(0.1, 3);
+    auto start = chrono::steady_clock::now();
+    check(!tracker->announce(makeRequest(), response) && tracker->error() == "no reply",
+          "silent tracker fails: " + tracker->error());
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    check(stand_in.requests(ACTION_CONNECT).size() == 3, "silent tracker tried 3 times");
+    check(elapsed.count() > 0.6 && elapsed.count() < 1.5,
+          "retransmit back off, took " + to_string(elapsed.count()) + "s");
+}
+
+void testConnectionIdLife(StandInTracker& stand_in)
+{
+    stand_in.setScript(answer);
+    auto tracker = makeTracker(stand_in);
+    tracker->setConnectionIdLife(0.2);
+    AnnounceResponse response;
+    tracker->announce(makeRequest(), response);
+    tracker->announce(makeRequest(), response);
+    check(stand_in.requests(ACTION_CONNECT).size() == 1, "connection id used while valid");
+
+    this_thread::sleep_for(chrono::milliseconds(300));
+    check(tracker->announce(makeRequest(), response), "announce after expiry");
+    check(stand_in.requests(ACTION_CONNECT).size() == 2, "expired connection id renewed");
+}
+
+void testScrape(StandInTracker& stand_in)
+{
+    // Counts derived from the first byte of each hash
+    stand_in.setScript([](const ByteArray& request) -> vector<ByteArray> {
+        if (get32(request, 8) != ACTION_SCRAPE) return answer(request);
+        auto reply = replyHeader(ACTION_SCRAPE, get32(request, 12));
+        for (size_t pos = 16; pos + 20 <= request.size(); pos += 20) {
+            uint32_t value = uchar(request[pos]);
+            put32(reply, value);
+            put32(reply, value * 2);
+            put32(reply, value * 3);
+        }
+        return {reply};
+    });
+    auto tracker = makeTracker(stand_in);
+
+    vector<ByteArray> info_hashes;
+    for (auto i = 0; i < 100; ++i) info_hashes.push_back(ByteArray(20, char(i)));
+    vector<ScrapeResult> results;
+    check(tracker->scrape(info_hashes, results), "scrape: " + tracker->error());
+
+    auto scrapes = stand_in.requests(ACTION_SCRAPE);
+    check(scrapes.size() == 2, "100 hashes scraped in 2 datagrams");
+    if (scrapes.size() == 2) {
+        check(scrapes[0].size() == 16 + 20 * UdpTracker::MAX_SCRAPE_HASHES &&
+              scrapes[1].size() == 16 + 20 * (100 - UdpTracker::MAX_SCRAPE_HASHES),
+              "scrape datagram sizes");
+        check(get64(scrapes[1], 0) == CONNECTION_ID, "scrape uses the connection id");
+    }
+    check(stand_in.requests(ACTION_CONNECT).size() == 1, "one connect for all scrapes");
+
+    bool is_ordered = results.size() == 100;
+    for (auto i = 0u; is_ordered && i < results.size(); ++i) {
+        is_ordered = results[i].seeders == int(i) && results[i].completed == int(2*i) &&
+                     results[i].leechers == int(3*i);
+    }
+    check(is_ordered, "scrape results in order of the hashes");
+
+    // Too short a reply for the hashes asked for
+    stand_in.setScript([](const ByteArray& request) -> vector<ByteArray> {
+        if (get32(request, 8) != ACTION_SCRAPE) return answer(request);
+        return {replyHeader(ACTION_SCRAPE, get32(request, 12))};
+    });
+    check(!tracker->scrape(info_hashes, results) &&
+          tracker->error() == "short scrape reply", "short scrape reply refused");
+}
+} // Unnamed namespace
+
+int main()
+{
+    StandInTracker stand_in;
+    testAnnounce(stand_in);
+    testTransactionId(stand_in);
+    testError(stand_in);
+    testRetransmit(stand_in);
+    testConnectionIdLife(stand_in);
+    testScrape(stand_in);
+
+    if (num_failed > 0) {
+        cout << num_failed << " checks failed" << endl;
+        return 1;
+    }
+    cout << "All checks passed" << endl;
+    return 0;
+}
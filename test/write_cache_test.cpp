@@ -0,0 +1,121 @@
+#include <iostream>
+#include <thread>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <sys/resource.h>
+#include "write_cache.h"
+
+using namespace std;
+using namespace cls;
+
+// WriteCache with two threads adding pieces at once while writes past a file size
+// limit fail. Every piece must end up in exactly one place: written to the file
+// with its content, given back by add as failed, or still dirty in the cache, and
+// the dirty byte count must match what is left
+namespace {
+const int  PIECE_LEN  = 16 * 1024;
+const int  NUM_PIECES = 256;
+const int  FAIL_FROM  = 160;    // writes reaching this piece fail
+const int  NUM_ROUNDS = 500;
+const char FILE_NAME[] = "write_cache_test.tmp";
+
+int num_failed = 0;
+
+void check(bool is_ok, const string& what)
+{
+    if (is_ok) return;
+    cout << "FAILED: " << what << endl;
+    ++num_failed;
+}
+
+ByteArray pieceData(int idx, int round)
+{
+    return ByteArray(PIECE_LEN, static_cast<char>(idx * 7 + round));
+}
+
+void testRound(const TorrentStorage& file, int round)
+{
+    vector<int>  times_written(NUM_PIECES, 0);
+    vector<char> is_failed(NUM_PIECES, false);
+    tbb::atomic<int> num_recycled;
+    num_recycled = 0;
+
+    // Flushes run one at a time, so written needs no lock of its own
+    WriteCache cache;
+    cache.init(&file, PIECE_LEN,
+               [&](llong pos, size_t length) {
+                   for (auto i = 0u; i < length / PIECE_LEN; ++i) {
+                       ++times_written[pos / PIECE_LEN + i];
+                   }
+               },
+               [&](ByteArray&& buffer) {
+                   // Wipe it, a write still using the buffer would show
+                   memset(buffer.data(), 0, buffer.size());
+                   ++num_recycled;
+               });
+    cache.setCapacity(4 * PIECE_LEN);
+
+    auto add_pieces = [&](int first) {
+        for (auto idx = first; idx < NUM_PIECES; idx += 2) {
+            is_failed[idx] = !cache.add(idx, pieceData(idx, round));
+        }
+    };
+    thread even(add_pieces, 0);
+    thread odd(add_pieces, 1);
+    even.join();
+    odd.join();
+    cache.flush();
+
+    int num_dirty = 0, num_written = 0, num_dropped = 0;
+    for (auto idx = 0; idx < NUM_PIECES; ++idx) {
+        bool is_dirty = cache.contains(idx);
+        num_dirty   += is_dirty;
+        num_written += times_written[idx];
+        num_dropped += is_failed[idx];
+
+        auto where = "round " + to_string(round) + ", piece " + to_string(idx);
+        check(times_written[idx] + is_failed[idx] + is_dirty == 1,
+              where + " is in exactly one place");
+        if (idx >= FAIL_FROM) check(times_written[idx] == 0, where + " not written");
+        if (times_written[idx] == 1) {
+            ByteArray data;
+            check(file.read(llong(idx) * PIECE_LEN, PIECE_LEN, data) &&
+                  data == pieceData(idx, round), where + " written intact");
+        }
+    }
+    check(cache.dirtyBytes() == size_t(num_dirty) * PIECE_LEN,
+          "round " + to_string(round) + " dirty bytes");
+    check(num_recycled == num_written + num_dropped,
+          "round " + to_string(round) + " buffers given back");
+}
+} // Unnamed namespace
+
+int main()
+{
+    TorrentStorage file;
+    vector<TorrentStorage::FileEntry> file_list =
+        {{FILE_NAME, llong(NUM_PIECES) * PIECE_LEN, TorrentStorage::NeedAll}};
+    if (!file.create(file_list, FileStorage::AllocSparse)) {
+        cout << "Can't create " << FILE_NAME << endl;
+        return 1;
+    }
+
+    // Writes past the limit fail with EFBIG instead of raising SIGXFSZ
+    signal(SIGXFSZ, SIG_IGN);
+    rlimit limit;
+    getrlimit(RLIMIT_FSIZE, &limit);
+    limit.rlim_cur = rlim_t(FAIL_FROM) * PIECE_LEN;
+    setrlimit(RLIMIT_FSIZE, &limit);
+
+    for (auto round = 0; round < NUM_ROUNDS; ++round) testRound(file, round);
+    file.close();
+    remove(FILE_NAME);
+
+    if (num_failed > 0) {
+        cout << num_failed << " checks failed" << endl;
+        return 1;
+    }
+    cout << "All checks passed" << endl;
+    return 0;
+}